@@ -21,6 +21,52 @@ using std::string;
 using XenBackend::Exception;
 using XenBackend::FrontendHandlerPtr;
 
+/* Optional per frontend latency budget, ms. */
+static const char *cFieldLatencyBudget = "latency-budget-ms";
+
+/*
+ * Shared buffers: the backend advertises the feature, the frontend asks
+ * for it and the backend then publishes, after every buffer request, the
+ * number of buffers shared and the grant reference of each buffer's page
+ * directory. No buffers means the frontend uses its own this time.
+ */
+static const char *cFieldFeatureSharedBuffers = "feature-shared-buffers";
+static const char *cFieldSharedBuffers = "shared-buffers";
+static const char *cFieldSharedBufferNum = "shared-buffer-num";
+static const char *cFieldSharedBufferDir = "shared-buffer-dir-";
+
+CameraFrontendHandler::CameraFrontendHandler(CameraManagerPtr cameraManager,
+                                             GrantMapBudgetPtr mapBudget,
+                                             const Config& config,
+                                             const std::string& devName,
+                                             domid_t beDomId, domid_t feDomId,
+                                             uint16_t devId) :
+    FrontendHandlerBase("CameraFrontend", devName,
+                        beDomId, feDomId, devId),
+    mLog("CameraFrontend"),
+    mConfig(config),
+    mCameraManager(cameraManager),
+    mMapBudget(mapBudget)
+{
+    if (mConfig.sharedBuffers)
+        getXenStore().writeInt(getXsBackendPath() + "/" +
+                               cFieldFeatureSharedBuffers, 1);
+}
+
+void CameraFrontendHandler::sharedBuffersPublish(
+    const std::vector<grant_ref_t>& directories)
+{
+    string basePath = getXsBackendPath() + "/";
+
+    for (size_t i = 0; i < directories.size(); i++)
+        getXenStore().writeUint(basePath + cFieldSharedBufferDir +
+                                to_string(i), directories[i]);
+
+    /* Written last: the frontend reads the directories once it changes. */
+    getXenStore().writeUint(basePath + cFieldSharedBufferNum,
+                            directories.size());
+}
+
 void CameraFrontendHandler::onBind()
 {
     LOG(mLog, DEBUG) << "On frontend bind : " << getDomId();
@@ -42,8 +88,30 @@ void CameraFrontendHandler::onBind()
     auto uniqueId = getXenStore().readString(camBasePath +
                                              XENCAMERA_FIELD_UNIQUE_ID);
 
-    auto controls = getXenStore().readString(camBasePath +
-                                             XENCAMERA_FIELD_CONTROLS);
+    FrontendConfig config;
+
+    config.controls = getXenStore().readString(camBasePath +
+                                               XENCAMERA_FIELD_CONTROLS);
+
+    config.latencyBudgetMs = mConfig.latencyBudgetMs;
+
+    if (getXenStore().checkIfExist(camBasePath + cFieldLatencyBudget))
+        config.latencyBudgetMs = getXenStore().readUint(camBasePath +
+                                                        cFieldLatencyBudget);
+
+    config.mapBudget = mMapBudget;
+
+    config.sharedBuffers = mConfig.sharedBuffers &&
+        getXenStore().checkIfExist(camBasePath + cFieldSharedBuffers) &&
+        getXenStore().readUint(camBasePath + cFieldSharedBuffers);
+
+    if (config.sharedBuffers) {
+        LOG(mLog, DEBUG) << "Frontend shares buffers";
+
+        config.sharedBuffersPublish =
+            std::bind(&CameraFrontendHandler::sharedBuffersPublish, this,
+                 std::placeholders::_1);
+    }
 
     mCameraHandler = mCameraManager->getCameraHandler(uniqueId);
 
@@ -59,7 +127,7 @@ void CameraFrontendHandler::onBind()
                                                         getDomId(),
                                                         req_port,
                                                         req_ref,
-                                                        controls,
+                                                        config,
                                                         mCameraHandler));
 
     addRingBuffer(ctrlRingBuffer);
@@ -70,9 +138,10 @@ void CameraFrontendHandler::onStateClosed()
     mCameraHandler.reset();
 }
 
-Backend::Backend(const string& deviceName) :
+Backend::Backend(const string& deviceName, const Config& config) :
     BackendBase("CameraBackend", deviceName),
-    mLog("CameraBackend")
+    mLog("CameraBackend"),
+    mConfig(config)
 
 {
     try {
@@ -90,13 +159,18 @@ Backend::~Backend()
 void Backend::onNewFrontend(domid_t domId, uint16_t devId)
 {
     addFrontendHandler(FrontendHandlerPtr(
-            new CameraFrontendHandler(mCameraManager, getDeviceName(),
-                                      getDomId(), domId, devId)));
+            new CameraFrontendHandler(mCameraManager, mMapBudget, mConfig,
+                                      getDeviceName(), getDomId(),
+                                      domId, devId)));
 }
 
 void Backend::init()
 {
-    mCameraManager.reset(new CameraManager());
+    mCameraManager.reset(new CameraManager(mConfig));
+
+    if (mConfig.mapBudget.enabled)
+        mMapBudget.reset(new GrantMapBudget(mConfig.mapBudget.maxBytes,
+                                            mConfig.mapBudget.idleMs));
 }
 
 void Backend::release()
@@ -20,17 +20,16 @@
 #include <xen/io/cameraif.h>
 
 #include "CameraManager.hpp"
+#include "Config.hpp"
 
 class CameraFrontendHandler : public XenBackend::FrontendHandlerBase
 {
 public:
     CameraFrontendHandler(CameraManagerPtr cameraManager,
+                          GrantMapBudgetPtr mapBudget,
+                          const Config& config,
                           const std::string& devName, domid_t beDomId,
-                          domid_t feDomId, uint16_t devId) :
-        FrontendHandlerBase("CameraFrontend", devName,
-                            beDomId, feDomId, devId),
-        mLog("CameraFrontend"),
-        mCameraManager(cameraManager) {}
+                          domid_t feDomId, uint16_t devId);
 
 protected:
     void onBind() override;
@@ -39,20 +38,28 @@ protected:
 private:
     XenBackend::Log mLog;
 
+    Config mConfig;
+
     CameraManagerPtr mCameraManager;
     CameraHandlerPtr mCameraHandler;
+    GrantMapBudgetPtr mMapBudget;
+
+    void sharedBuffersPublish(const std::vector<grant_ref_t>& directories);
 };
 
 class Backend : public XenBackend::BackendBase
 {
 public:
-    Backend(const std::string& deviceName);
+    Backend(const std::string& deviceName, const Config& config);
     ~Backend();
 
 private:
     XenBackend::Log mLog;
 
+    Config mConfig;
+
     CameraManagerPtr mCameraManager;
+    GrantMapBudgetPtr mMapBudget;
 
     void init();
     void release();
@@ -10,6 +10,10 @@
  * Copyright (C) 2018 EPAM Systems Inc.
  */
 
+#include <algorithm>
+#include <fstream>
+
+#include <dirent.h>
 #include <fcntl.h>
 #include <signal.h>
 #include <unistd.h>
@@ -21,20 +25,26 @@
 #include "Camera.hpp"
 
 #include <xen/be/Exception.hpp>
-#include <xen/io/cameraif.h>
 
 using XenBackend::Exception;
 using XenBackend::PollFd;
 
-Camera::Camera(const std::string devName):
+Camera::Camera(const std::string devName, bool udmabuf):
     mLog("Camera"),
     mUniqueId(devName),
     mDevPath("/dev/" + devName),
     mFd(-1),
-    mFrameDoneCallback(nullptr)
+    mUdmabufFd(-1),
+    mMemoryType(V4L2_MEMORY_MMAP),
+    mFrameDoneCallback(nullptr),
+    mStreaming(false),
+    mTimestampMonotonic(false)
 {
     try {
         init();
+
+        if (udmabuf)
+            udmabufInit();
     } catch (...) {
         release();
         throw;
@@ -57,8 +67,11 @@ void Camera::init()
 
     formatEnumerate();
     controlEnumerate();
+    controlSubscribe();
+    videoNodesEnumerate();
 
-    mPollFd.reset(new PollFd(mFd, POLLIN));
+    /* Control events are signalled with POLLPRI. */
+    mPollFd.reset(new PollFd(mFd, POLLIN | POLLPRI));
 }
 
 void Camera::release()
@@ -67,6 +80,41 @@ void Camera::release()
 
     mPollFd.reset();
     close();
+
+    if (mUdmabufFd >= 0)
+        ::close(mUdmabufFd);
+
+    mUdmabufFd = -1;
+}
+
+void Camera::udmabufInit()
+{
+    int fd = ::open("/dev/udmabuf", O_RDWR);
+
+    if (fd < 0) {
+        LOG(mLog, WARNING) << "No udmabuf, " << mDevPath <<
+            " captures into driver buffers: " << strerror(errno);
+        return;
+    }
+
+    /* Asking for no buffers tells if the queue takes DMABUFs at all. */
+    v4l2_requestbuffers req {0};
+
+    req.count = 0;
+    req.type = cV4L2BufType;
+    req.memory = V4L2_MEMORY_DMABUF;
+
+    if (xioctl(VIDIOC_REQBUFS, &req) < 0) {
+        LOG(mLog, WARNING) << mDevPath << " can't import DMABUFs," <<
+            " captures into driver buffers";
+        ::close(fd);
+        return;
+    }
+
+    mUdmabufFd = fd;
+    mMemoryType = V4L2_MEMORY_DMABUF;
+
+    LOG(mLog, DEBUG) << mDevPath << " captures into udmabufs";
 }
 
 bool Camera::isOpen()
@@ -167,6 +215,32 @@ bool Camera::isCaptureDevice()
     return true;
 }
 
+void Camera::videoNodesEnumerate()
+{
+    std::string path = "/sys/class/video4linux/" + mUniqueId +
+        "/device/video4linux";
+    DIR *dir = opendir(path.c_str());
+
+    mVideoNodes.clear();
+
+    if (!dir)
+        return;
+
+    /* Nodes of the same parent device share the sensor. */
+    while (auto entry = readdir(dir)) {
+        std::string name = entry->d_name;
+
+        if (name.compare(0, 5, "video") || name == mUniqueId)
+            continue;
+
+        LOG(mLog, DEBUG) << mDevPath << " has sibling node " << name;
+
+        mVideoNodes.push_back(name);
+    }
+
+    closedir(dir);
+}
+
 void Camera::close()
 {
     if (isOpen())
@@ -182,7 +256,7 @@ void Camera::close()
  */
 int Camera::bufferGetMin()
 {
-    return static_cast<int>(controlGetValue(V4L2_CID_MIN_BUFFERS_FOR_CAPTURE));
+    return static_cast<int>(controlRead(V4L2_CID_MIN_BUFFERS_FOR_CAPTURE));
 }
 
 int Camera::bufferRequest(int numBuffers)
@@ -191,7 +265,7 @@ int Camera::bufferRequest(int numBuffers)
 
     req.count = numBuffers;
     req.type = cV4L2BufType;
-    req.memory = cMemoryType;
+    req.memory = mMemoryType;
 
     if (xioctl(VIDIOC_REQBUFS, &req) < 0)
         throw Exception("Failed to call [VIDIOC_REQBUFS] for device " +
@@ -208,7 +282,7 @@ v4l2_buffer Camera::bufferQuery(int index)
     v4l2_buffer buf {0};
 
     buf.type = cV4L2BufType;
-    buf.memory = cMemoryType;
+    buf.memory = mMemoryType;
     buf.index = index;
 
     if (xioctl(VIDIOC_QUERYBUF, &buf) < 0)
@@ -225,9 +299,14 @@ void Camera::bufferQueue(int index)
     DLOG(mLog, DEBUG) << "[VIDIOC_QBUF] index " << std::to_string(index) <<
         " for device " << mDevPath;
     buf.type = cV4L2BufType;
-    buf.memory = cMemoryType;
+    buf.memory = mMemoryType;
     buf.index = index;
 
+    if (mMemoryType == V4L2_MEMORY_DMABUF) {
+        buf.m.fd = mBuffers[index].fd;
+        buf.length = mBuffers[index].size;
+    }
+
     if (xioctl(VIDIOC_QBUF, &buf) < 0)
         throw Exception("Failed to call [VIDIOC_QBUF] for device " +
                         mDevPath, errno);
@@ -239,7 +318,7 @@ v4l2_buffer Camera::bufferDequeue()
 
     DLOG(mLog, DEBUG) << "[VIDIOC_DQBUF] for device " << mDevPath;
     buf.type = cV4L2BufType;
-    buf.memory = cMemoryType;
+    buf.memory = mMemoryType;
 
     if (xioctl(VIDIOC_DQBUF, &buf) < 0)
         throw Exception("Failed to call [VIDIOC_DQBUF] for device " +
@@ -262,11 +341,71 @@ int Camera::bufferExport(int index)
     return expbuf.fd;
 }
 
+int Camera::bufferGetFd(int index)
+{
+    if (mBuffers[index].fd < 0)
+        mBuffers[index].fd = bufferExport(index);
+
+    return mBuffers[index].fd;
+}
+
 void *Camera::bufferGetData(int index)
 {
     return mBuffers[index].data;
 }
 
+size_t Camera::bufferGetSize(int index)
+{
+    return mBuffers[index].size;
+}
+
+int Camera::bufferGetCount()
+{
+    return mBuffers.size();
+}
+
+void Camera::bufferMap(int index)
+{
+    if (mMemoryType == V4L2_MEMORY_DMABUF) {
+        bufferAllocate(index);
+        return;
+    }
+
+    v4l2_buffer buf = bufferQuery(index);
+
+    void *start = mmap(nullptr, buf.length, PROT_READ | PROT_WRITE,
+                       MAP_SHARED, mFd, buf.m.offset);
+
+    if (start == MAP_FAILED)
+        throw Exception("Failed to mmap buffer for device " +
+                        mDevPath, errno);
+
+    mBuffers.push_back(
+        {
+            .size = static_cast<size_t>(buf.length),
+            .data = start,
+            .fd = -1,
+            .udmabuf = nullptr
+        }
+    );
+}
+
+void Camera::bufferAllocate(int index)
+{
+    size_t size = formatGet().fmt.pix.sizeimage;
+    UdmaBufferPtr udmabuf(new UdmaBuffer(mUdmabufFd, size));
+
+    /* The fd is the backend's, so there is nothing to export. */
+    mBuffers.push_back(
+        {
+            .size = udmabuf->size(),
+            .data = udmabuf->get(),
+            .fd = udmabuf->getFd(),
+            .udmabuf = std::move(udmabuf)
+        }
+    );
+}
+
 /*
  ********************************************************************
  * Stream related functionality.
@@ -277,11 +416,50 @@ void Camera::eventThread()
 {
     try {
         while (mPollFd->poll()) {
-            v4l2_buffer buf = bufferDequeue();
+            v4l2_event event;
+
+            while (xioctl(VIDIOC_DQEVENT, &event) == 0)
+                onControlEvent(event);
+
+            v4l2_buffer buf {0};
+
+            buf.type = cV4L2BufType;
+            buf.memory = mMemoryType;
+
+            /* The wake up might have been for events only. */
+            if (xioctl(VIDIOC_DQBUF, &buf) < 0) {
+                if (errno == EAGAIN)
+                    continue;
 
-            if (mFrameDoneCallback)
-                mFrameDoneCallback(buf.index, buf.bytesused);
-            bufferQueue(buf.index);
+                throw Exception("Failed to call [VIDIOC_DQBUF] for device " +
+                                mDevPath, errno);
+            }
+
+            /* Frame boundary: write controls set during the frame. */
+            try {
+                controlApply();
+            } catch (const std::exception& e) {
+                LOG(mLog, ERROR) << e.what();
+            }
+
+            mTimestampMonotonic = (buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) ==
+                V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+
+            /* Capacity is reserved up front, so this stays valid. */
+            UdmaBuffer *udmabuf = mBuffers[buf.index].udmabuf.get();
+
+            /* The frame is only read by the CPU from within the callback. */
+            if (udmabuf)
+                udmabuf->readBegin();
+
+            bool done = !mFrameDoneCallback ||
+                mFrameDoneCallback(buf.index, buf.bytesused, buf.timestamp);
+
+            if (udmabuf)
+                udmabuf->readEnd();
+
+            if (done)
+                bufferQueue(buf.index);
         }
     } catch(const std::exception& e) {
         LOG(mLog, ERROR) << e.what();
@@ -294,6 +472,22 @@ void Camera::streamStart(FrameDoneCallback clb)
 {
     mFrameDoneCallback = clb;
 
+    /* Events are only read while streaming: catch up on what was missed. */
+    controlRefresh();
+
+    {
+        std::lock_guard<std::mutex> lock(mControlLock);
+
+        mStreaming = true;
+    }
+
+    /*
+     * Buffers are kept across stream restarts and all of them are
+     * dequeued on STREAMOFF, so give them all to the driver.
+     */
+    for (size_t i = 0; i < mBuffers.size(); i++)
+        bufferQueue(i);
+
     mThread = std::thread(&Camera::eventThread, this);
 
     v4l2_buf_type type = cV4L2BufType;
@@ -312,6 +506,19 @@ void Camera::streamStop()
     if (mThread.joinable())
         mThread.join();
 
+    {
+        std::lock_guard<std::mutex> lock(mControlLock);
+
+        mStreaming = false;
+    }
+
+    /* No more frame boundaries to wait for. */
+    try {
+        controlApply();
+    } catch (const std::exception& e) {
+        LOG(mLog, ERROR) << e.what();
+    }
+
     v4l2_buf_type type = cV4L2BufType;
 
     if (xioctl(VIDIOC_STREAMOFF, &type) < 0)
@@ -320,42 +527,82 @@ void Camera::streamStop()
     LOG(mLog, DEBUG) << "Stopped streaming on device " << mDevPath;
 }
 
-int Camera::streamAlloc(int numBuffers)
+int Camera::streamAlloc(int numBuffers, int maxBuffers)
 {
     int numAllocated = bufferRequest(numBuffers);
 
+    /*
+     * Buffers are read by index without locks from other threads
+     * while the stream grows: they must never be reallocated.
+     */
+    mBuffers.reserve(std::max(numAllocated, maxBuffers));
+
     if (numAllocated != numBuffers)
         LOG(mLog, WARNING) << "Allocated " << numAllocated <<
             ", expected " << numBuffers;
 
-    for (int i = 0; i < numAllocated; i++) {
-        v4l2_buffer buf = bufferQuery(i);
+    for (int i = 0; i < numAllocated; i++)
+        bufferMap(i);
+
+    return numAllocated;
+}
+
+int Camera::streamGrow(int numBuffers)
+{
+    v4l2_create_buffers create {0};
 
-        void *start = mmap(nullptr, buf.length, PROT_READ | PROT_WRITE,
-                           MAP_SHARED, mFd, buf.m.offset);
+    numBuffers = std::min(numBuffers, static_cast<int>(
+        mBuffers.capacity() - mBuffers.size()));
 
-        if (start == MAP_FAILED)
-            throw Exception("Failed to mmap buffer for device " +
-                            mDevPath, errno);
+    if (numBuffers <= 0)
+        return 0;
 
-        bufferQueue(i);
+    create.count = numBuffers;
+    create.memory = mMemoryType;
+    create.format = formatGet();
 
-        mBuffers.push_back(
-            {
-                .size = static_cast<size_t>(buf.length),
-                .data = start
-            }
-        );
+    if (xioctl(VIDIOC_CREATE_BUFS, &create) < 0)
+        throw Exception("Failed to call [VIDIOC_CREATE_BUFS] for device " +
+                        mDevPath, errno);
+
+    for (uint32_t i = 0; i < create.count; i++) {
+        bufferMap(create.index + i);
+
+        /* The stream is running, so new buffers go to the driver. */
+        bufferQueue(create.index + i);
     }
 
-    return numAllocated;
+    LOG(mLog, DEBUG) << "Added " << create.count <<
+        " buffers for device " << mDevPath;
+
+    return create.count;
 }
 
 void Camera::streamRelease()
 {
     DLOG(mLog, DEBUG) << "Release all buffers";
-    for (auto const& buffer: mBuffers)
+    for (auto const& buffer: mBuffers) {
+        /* Freed with mBuffers, once the driver has dropped them. */
+        if (buffer.udmabuf)
+            continue;
+
+        if (buffer.fd >= 0)
+            ::close(buffer.fd);
+
         munmap(buffer.data, buffer.size);
+    }
+
+    if (mBuffers.size()) {
+        v4l2_requestbuffers req {0};
+
+        req.count = 0;
+        req.type = cV4L2BufType;
+        req.memory = mMemoryType;
+
+        /* Free the buffers in the driver, so the format can be changed. */
+        if (xioctl(VIDIOC_REQBUFS, &req) < 0)
+            LOG(mLog, ERROR) << "Failed to free buffers for " << mDevPath;
+    }
 
     mBuffers.clear();
 }
@@ -389,7 +636,7 @@ void Camera::formatSet(v4l2_format fmt)
                         mDevPath, errno);
 }
 
-void Camera::formatTry(v4l2_format fmt)
+void Camera::formatTry(v4l2_format& fmt)
 {
     LOG(mLog, DEBUG) << "Try format " << fmt.fmt.pix.width <<
         "x" << fmt.fmt.pix.height;
@@ -412,6 +659,26 @@ void Camera::formatSet(uint32_t width, uint32_t height, uint32_t pixelFormat)
     formatSet(fmt);
 }
 
+uint64_t Camera::busBandwidthGet()
+{
+    /*
+     * For USB cameras the video device is a child of the USB interface,
+     * the parent of which knows the link speed in Mbit/s.
+     */
+    std::ifstream file("/sys/class/video4linux/" + mUniqueId +
+                       "/device/../speed");
+    double mbps;
+
+    if (!(file >> mbps) || mbps <= 0)
+        return 0;
+
+    /*
+     * Isochronous transfers can only take a part of the link: 3 x 1024
+     * bytes per microframe out of the 480 Mbit/s of a high speed link.
+     */
+    return static_cast<uint64_t>(mbps * 1000000 / 8 * cUsbIsocShare);
+}
+
 void Camera::formatEnumerate()
 {
     v4l2_fmtdesc fmt = {0};
@@ -537,25 +804,26 @@ int Camera::frameIntervalGet(int index, uint32_t pixelFormat,
  */
 void Camera::controlEnumerate()
 {
-    v4l2_queryctrl queryctrl {0};
+    v4l2_query_ext_ctrl queryctrl {0};
 
     queryctrl.id = V4L2_CTRL_FLAG_NEXT_CTRL;
 
-    while (xioctl(VIDIOC_QUERYCTRL, &queryctrl) == 0) {
+    while (xioctl(VIDIOC_QUERY_EXT_CTRL, &queryctrl) == 0) {
         if (!(queryctrl.flags & V4L2_CTRL_FLAG_DISABLED)) {
             LOG(mLog, DEBUG) << "Control " << queryctrl.name;
 
-            if (queryctrl.type != V4L2_CTRL_TYPE_MENU) {
+            if (isControlTypeSupported(queryctrl.type)) {
                 ControlInfo ctrl {0};
 
                 ctrl.v4l2_cid = queryctrl.id;
+                ctrl.type = queryctrl.type;
                 ctrl.flags = queryctrl.flags;
                 ctrl.minimum = queryctrl.minimum;
                 ctrl.maximum = queryctrl.maximum;
                 ctrl.default_value = queryctrl.default_value;
                 ctrl.step = queryctrl.step;
 
-                mControls.push_back(ctrl);
+                mControls[ctrl.v4l2_cid] = ctrl;
             }
         }
         queryctrl.id |= V4L2_CTRL_FLAG_NEXT_CTRL;
@@ -570,61 +838,241 @@ void Camera::controlEnumerate()
                         mDevPath, errno);
 }
 
-Camera::ControlInfo Camera::controlEnum(std::string name)
+bool Camera::isControlTypeSupported(uint32_t type)
 {
-    int v4l2_cid;
-
-    if (name == XENCAMERA_CTRL_CONTRAST_STR)
-        v4l2_cid = V4L2_CID_CONTRAST;
-    else if (name == XENCAMERA_CTRL_BRIGHTNESS_STR)
-        v4l2_cid = V4L2_CID_BRIGHTNESS;
-    else if (name == XENCAMERA_CTRL_HUE_STR)
-        v4l2_cid = V4L2_CID_HUE;
-    else if (name == XENCAMERA_CTRL_SATURATION_STR)
-        v4l2_cid = V4L2_CID_SATURATION;
-    else
-        throw Exception("Wrong control name " + name + " for device " +
-                        mDevPath, EINVAL);
+    /* Controls with a single value: no buttons, classes and arrays. */
+    switch (type) {
+    case V4L2_CTRL_TYPE_INTEGER:
+    case V4L2_CTRL_TYPE_BOOLEAN:
+    case V4L2_CTRL_TYPE_MENU:
+    case V4L2_CTRL_TYPE_INTEGER_MENU:
+    case V4L2_CTRL_TYPE_BITMASK:
+    case V4L2_CTRL_TYPE_INTEGER64:
+        return true;
+
+    default:
+        return false;
+    }
+}
 
+Camera::ControlInfo Camera::controlEnum(int v4l2_cid)
+{
     /* Check if this control is supported by the HW. */
-    for (auto const& ctrl: mControls)
-        if (ctrl.v4l2_cid == v4l2_cid)
-            return ctrl;
+    auto it = mControls.find(v4l2_cid);
 
-    throw Exception("Control " + name + " not found for device " +
-                    mDevPath, EINVAL);
+    if (it == mControls.end())
+        throw Exception("Control " + std::to_string(v4l2_cid) +
+                        " not found for device " + mDevPath, EINVAL);
+
+    return it->second;
 }
 
-void Camera::controlSetValue(std::string name, signed int value)
+bool Camera::controlSetValue(int v4l2_cid, int64_t value)
 {
-    v4l2_control control {0};
+    auto ctrl = controlEnum(v4l2_cid);
 
-    auto ctrl = controlEnum(name);
+    if (controlGetValue(v4l2_cid) == value)
+        return false;
 
-    control.id = ctrl.v4l2_cid;
-    control.value = value;
+    {
+        std::lock_guard<std::mutex> lock(mControlLock);
 
-    if (xioctl(VIDIOC_S_CTRL, &control) < 0)
-        throw Exception("Failed to call [VIDIOC_S_CTRL] for device " +
-                        mDevPath, errno);
+        if (!isControlVolatile(ctrl))
+            mControlValues[v4l2_cid] = value;
+
+        mControlsPending[v4l2_cid] = value;
+
+        if (mStreaming)
+            return true;
+    }
+
+    controlApply();
+
+    return true;
+}
+
+void Camera::controlApply()
+{
+    std::map<int, int64_t> pending;
+
+    {
+        std::lock_guard<std::mutex> lock(mControlLock);
+
+        pending.swap(mControlsPending);
+    }
+
+    if (pending.empty())
+        return;
+
+    std::vector<v4l2_ext_control> controls;
+
+    for (auto const& ctrl: pending) {
+        v4l2_ext_control control {0};
+
+        control.id = ctrl.first;
+
+        if (mControls.at(ctrl.first).type == V4L2_CTRL_TYPE_INTEGER64)
+            control.value64 = ctrl.second;
+        else
+            control.value = ctrl.second;
+
+        controls.push_back(control);
+    }
+
+    v4l2_ext_controls ext {0};
+
+    ext.which = V4L2_CTRL_WHICH_CUR_VAL;
+    ext.count = controls.size();
+    ext.controls = controls.data();
+
+    if (xioctl(VIDIOC_S_EXT_CTRLS, &ext) < 0) {
+        int err = errno;
+
+        /* Make the cache, and the frontends, agree with the HW again. */
+        controlRefresh();
+
+        throw Exception("Failed to call [VIDIOC_S_EXT_CTRLS] for device " +
+                        mDevPath, err);
+    }
+
+    DLOG(mLog, DEBUG) << "Applied " << controls.size() <<
+        " control(s) for device " << mDevPath;
+
+    /* The driver might have clamped the values. */
+    for (auto const& control: controls)
+        controlUpdate(control.id,
+                      mControls.at(control.id).type == V4L2_CTRL_TYPE_INTEGER64 ?
+                      control.value64 : control.value);
 }
 
-signed int Camera::controlGetValue(int v4l2_cid)
+int64_t Camera::controlRead(int v4l2_cid, bool is64)
 {
-    v4l2_control control {0};
+    v4l2_ext_control control {0};
+    v4l2_ext_controls ext {0};
 
     control.id = v4l2_cid;
 
-    if (xioctl(VIDIOC_G_CTRL, &control) < 0)
-        throw Exception("Failed to call [VIDIOC_G_CTRL] for device " +
+    ext.which = V4L2_CTRL_WHICH_CUR_VAL;
+    ext.count = 1;
+    ext.controls = &control;
+
+    if (xioctl(VIDIOC_G_EXT_CTRLS, &ext) < 0)
+        throw Exception("Failed to call [VIDIOC_G_EXT_CTRLS] for device " +
                         mDevPath, errno);
-    return control.value;
+
+    return is64 ? control.value64 : control.value;
 }
 
-signed int Camera::controlGetValue(std::string name)
+int64_t Camera::controlGetValue(int v4l2_cid)
 {
-    auto ctrl = controlEnum(name);
+    auto ctrl = controlEnum(v4l2_cid);
+
+    {
+        std::lock_guard<std::mutex> lock(mControlLock);
+
+        /* Set, but not written to the HW yet. */
+        auto pending = mControlsPending.find(v4l2_cid);
+
+        if (pending != mControlsPending.end())
+            return pending->second;
+
+        /*
+         * Events, which keep the cache up to date with changes made by
+         * others, are only read while streaming.
+         */
+        auto it = mControlValues.find(v4l2_cid);
+
+        if (mStreaming && it != mControlValues.end())
+            return it->second;
+    }
+
+    auto value = controlRead(v4l2_cid,
+                             ctrl.type == V4L2_CTRL_TYPE_INTEGER64);
+
+    controlUpdate(v4l2_cid, value);
+
+    return value;
+}
+
+bool Camera::isControlVolatile(const ControlInfo& ctrl)
+{
+    /* Values the HW changes by itself: never cached, as never reported. */
+    return ctrl.flags & V4L2_CTRL_FLAG_VOLATILE;
+}
+
+void Camera::controlSubscribe()
+{
+    for (auto const& ctrl: mControls) {
+        v4l2_event_subscription sub {0};
+
+        sub.type = V4L2_EVENT_CTRL;
+        sub.id = ctrl.first;
+
+        /*
+         * Our own changes are not reported back, those are put into
+         * the cache when set.
+         */
+        if (xioctl(VIDIOC_SUBSCRIBE_EVENT, &sub) < 0)
+            LOG(mLog, WARNING) << "Failed to subscribe to control " <<
+                ctrl.first << " events for device " << mDevPath;
+    }
+
+    controlRefresh();
+}
+
+void Camera::controlRefresh()
+{
+    for (auto const& ctrl: mControls) {
+        if (ctrl.second.flags & V4L2_CTRL_FLAG_WRITE_ONLY ||
+            isControlVolatile(ctrl.second))
+            continue;
+
+        try {
+            controlUpdate(ctrl.first, controlRead(ctrl.first,
+                ctrl.second.type == V4L2_CTRL_TYPE_INTEGER64));
+        } catch (const std::exception& e) {
+            LOG(mLog, WARNING) << e.what();
+        }
+    }
+}
+
+void Camera::controlUpdate(int v4l2_cid, int64_t value)
+{
+    auto ctrl = mControls.find(v4l2_cid);
+
+    if (ctrl == mControls.end() || isControlVolatile(ctrl->second))
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(mControlLock);
+
+        auto it = mControlValues.find(v4l2_cid);
+
+        if (it != mControlValues.end() && it->second == value)
+            return;
+
+        bool known = it != mControlValues.end();
+
+        mControlValues[v4l2_cid] = value;
+
+        /* Initial values are no news. */
+        if (!known)
+            return;
+    }
+
+    DLOG(mLog, DEBUG) << "Control " << v4l2_cid << " changed to " << value;
+
+    if (mControlChangeCallback)
+        mControlChangeCallback(v4l2_cid, value);
+}
+
+void Camera::onControlEvent(const v4l2_event& event)
+{
+    if (event.type != V4L2_EVENT_CTRL ||
+        !(event.u.ctrl.changes & V4L2_EVENT_CTRL_CH_VALUE))
+        return;
 
-    return controlGetValue(ctrl.v4l2_cid);
+    controlUpdate(event.id, event.u.ctrl.type == V4L2_CTRL_TYPE_INTEGER64 ?
+                  event.u.ctrl.value64 : event.u.ctrl.value);
 }
 
@@ -9,20 +9,28 @@
 #define SRC_CAMERA_HPP_
 
 #include <list>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <string>
 #include <thread>
+#include <unordered_map>
 
 #include <linux/videodev2.h>
 
 #include <xen/be/Log.hpp>
 #include <xen/be/Utils.hpp>
 
+#include "UdmaBuffer.hpp"
+
 class Camera
 {
 public:
-    Camera(const std::string devName);
+    /*
+     * With udmabuf set buffers are allocated by the backend from cached
+     * memory and imported as DMABUFs, if the kernel and the driver can.
+     */
+    Camera(const std::string devName, bool udmabuf = false);
     ~Camera();
 
     const std::string getDevPath() const {
@@ -33,6 +41,11 @@ public:
         return mUniqueId;
     }
 
+    /* Other video nodes of the same device, e.g. ISP's preview node. */
+    const std::vector<std::string>& getVideoNodes() const {
+        return mVideoNodes;
+    }
+
     /* Buffer related functionlity. */
     v4l2_buffer bufferQuery(int index);
     int bufferRequest(int numBuffers);
@@ -40,39 +53,108 @@ public:
     v4l2_buffer bufferDequeue();
     int bufferGetMin();
     int bufferExport(int index);
+    int bufferGetFd(int index);
     void *bufferGetData(int index);
+    size_t bufferGetSize(int index);
+    int bufferGetCount();
+    /* Buffers are cached memory, not driver memory. */
+    bool bufferIsCached() const {
+        return mMemoryType == V4L2_MEMORY_DMABUF;
+    }
 
     /* Stream related functionlity. */
-    typedef std::function<void(int, int)> FrameDoneCallback;
-
-    int streamAlloc(int numBuffers);
+    /*
+     * index, size, capture timestamp: returns false if the callback has
+     * already queued the buffer back itself.
+     */
+    typedef std::function<bool(int, int, const timeval&)> FrameDoneCallback;
+
+    /* Room is kept for maxBuffers, so growing never moves buffers. */
+    int streamAlloc(int numBuffers, int maxBuffers = 0);
+    /*
+     * Add buffers to a running stream up to the room kept at allocation:
+     * returns the number of buffers added.
+     */
+    int streamGrow(int numBuffers);
     void streamRelease();
     void streamStart(FrameDoneCallback clb);
     void streamStop();
 
+    /*
+     * Whether the timestamp of the frame is CLOCK_MONOTONIC: only valid
+     * in the frame done callback.
+     */
+    bool isTimestampMonotonic() const {
+        return mTimestampMonotonic;
+    }
+
     /* Format related functionality. */
+    struct FormatSize {
+        int width;
+        int height;
+        std::vector<v4l2_fract> fps;
+    };
+
+    struct Format {
+        uint32_t pixelFormat;
+        std::string description;
+
+        std::vector<FormatSize> size;
+    };
+
+    const std::vector<Format>& getFormats() const {
+        return mFormats;
+    }
+
     void formatSet(uint32_t width, uint32_t height, uint32_t pixelFormat);
     void formatSet(v4l2_format fmt);
-    void formatTry(v4l2_format fmt);
+    void formatTry(v4l2_format& fmt);
     v4l2_format formatGet();
 
+    /*
+     * Bandwidth in bytes per second the bus the camera sits on can
+     * sustain for video, 0 if unknown.
+     */
+    uint64_t busBandwidthGet();
+
     /* Frame rate related functionality. */
     void frameRateSet(int num, int denom);
     v4l2_fract frameRateGet();
 
     /* Control related functionality. */
+    /* Menu controls take the index of the menu item as the value. */
     struct ControlInfo {
         int v4l2_cid;
+        uint32_t type;
         int flags;
-        signed int minimum;
-        signed int maximum;
-        signed int default_value;
-        signed int step;
+        int64_t minimum;
+        int64_t maximum;
+        int64_t default_value;
+        int64_t step;
     };
 
-    ControlInfo controlEnum(std::string name);
-    void controlSetValue(std::string name, signed int value);
-    signed int controlGetValue(std::string name);
+    ControlInfo controlEnum(int v4l2_cid);
+    /*
+     * Returns false if the control already has the value. While streaming
+     * the value is only cached and written to the HW at the next frame
+     * boundary, batched with other controls set meanwhile.
+     */
+    bool controlSetValue(int v4l2_cid, int64_t value);
+    /*
+     * Cached value while streaming, kept up to date with V4L2 control
+     * events. Read from the HW otherwise, and always for volatile ones.
+     */
+    int64_t controlGetValue(int v4l2_cid);
+
+    /*
+     * V4L2 CID, value: called on changes made by the driver or other
+     * applications, from the event thread or when a value is read.
+     */
+    typedef std::function<void(int, int64_t)> ControlChangeCallback;
+
+    void controlSetCallback(ControlChangeCallback clb) {
+        mControlChangeCallback = clb;
+    }
 
 protected:
     XenBackend::Log mLog;
@@ -80,9 +162,15 @@ protected:
     const std::string mUniqueId;
     const std::string mDevPath;
     int mFd;
+    /* Open /dev/udmabuf if buffers are allocated from it, -1 otherwise. */
+    int mUdmabufFd;
 
     static const v4l2_buf_type cV4L2BufType = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    v4l2_memory cMemoryType = V4L2_MEMORY_MMAP;
+    /* DMABUF once udmabuf is in use, MMAP otherwise. */
+    v4l2_memory mMemoryType;
+
+    /* Part of a USB link usable for isochronous video: 196 of 480 Mbit/s. */
+    static constexpr double cUsbIsocShare = 0.4;
 
     std::vector<std::string> mVideoNodes;
 
@@ -95,6 +183,10 @@ protected:
     struct Buffer {
         size_t size;
         void *data;
+        /* DMABUF exported on demand, -1 if not yet. */
+        int fd;
+        /* Backing memory of a DMABUF capture buffer. */
+        UdmaBufferPtr udmabuf;
     };
 
     std::vector<Buffer> mBuffers;
@@ -108,21 +200,14 @@ protected:
     void open();
     void close();
     bool isCaptureDevice();
+    void videoNodesEnumerate();
 
-    /* Format related functionality. */
-    struct FormatSize {
-        int width;
-        int height;
-        std::vector<v4l2_fract> fps;
-    };
+    void bufferMap(int index);
+    void bufferAllocate(int index);
 
-    struct Format {
-        uint32_t pixelFormat;
-        std::string description;
-
-        std::vector<FormatSize> size;
-    };
+    void udmabufInit();
 
+    /* Format related functionality. */
     std::vector<Format> mFormats;
 
     void formatEnumerate();
@@ -139,10 +224,26 @@ protected:
         return static_cast<float>(fract.denominator) / fract.numerator;
     }
 
-    std::vector<ControlInfo> mControls;
+    /* V4L2 CID to control, filled in on init only. */
+    std::unordered_map<int, ControlInfo> mControls;
+
+    std::mutex mControlLock;
+    std::unordered_map<int, int64_t> mControlValues;
+    /* Values set, but not yet written to the HW: last one wins. */
+    std::map<int, int64_t> mControlsPending;
+    bool mStreaming;
+    bool mTimestampMonotonic;
+    ControlChangeCallback mControlChangeCallback;
 
     void controlEnumerate();
-    signed int controlGetValue(int v4l2_cid);
+    static bool isControlTypeSupported(uint32_t type);
+    static bool isControlVolatile(const ControlInfo& ctrl);
+    int64_t controlRead(int v4l2_cid, bool is64 = false);
+    void controlSubscribe();
+    void controlRefresh();
+    void controlApply();
+    void controlUpdate(int v4l2_cid, int64_t value);
+    void onControlEvent(const v4l2_event& event);
 
     void eventThread();
 };
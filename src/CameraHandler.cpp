@@ -17,8 +17,11 @@
 
 using namespace std::placeholders;
 
-CameraHandler::CameraHandler(std::string uniqueId) :
-    mLog("CameraHandler")
+CameraHandler::CameraHandler(std::string uniqueId, const Config& config) :
+    mLog("CameraHandler"),
+    mConfig(config),
+    mHistory(config.historyMaxBytes || !config.mailbox ?
+             config.historyMaxBytes : cMailboxMaxBytes)
 {
     LOG(mLog, DEBUG) << "Create camera handler";
 
@@ -40,225 +43,1779 @@ CameraHandler::~CameraHandler()
 void CameraHandler::init(std::string uniqueId)
 {
     mFormatSet = false;
-    mFramerateSet = false;
+    mFrameSequence = 0;
+    mHwFrameRate = { 0, 0 };
+    mHwFrameIntervalUs = 0;
+    mStagingGain = 0;
+    mStagingSamples = 0;
+    mTimestampMonotonic = false;
+    mPoolAllocated = false;
+    mPoolFormat = {0};
+    mPoolNumRequested = 0;
+    mLingering = false;
+    mLingerTerminate = false;
+    mSuspended = false;
+    mIdleFrames = 0;
     mBuffersAllocated.clear();
     mStreamingNow.clear();
-    mCamera.reset(new Camera(uniqueId));
+    mCamera.reset(new Camera(uniqueId, mConfig.udmabuf));
+    mCamera->controlSetCallback(bind(&CameraHandler::onControlChangeCallback,
+                                     this, _1, _2));
+
+    mBusBandwidth = mConfig.busBandwidthMbps ?
+        mConfig.busBandwidthMbps * 1000000ull / 8 :
+        mCamera->busBandwidthGet();
+
+    if (mBusBandwidth)
+        LOG(mLog, DEBUG) << "Bus bandwidth " << mBusBandwidth << " bytes/s";
+
+    mBufferDepth = mConfig.getBufferDepth(mCamera->getUniqueId());
+    mBufferStats = {0};
+
+    try {
+        mNumBuffersMin = std::max(mCamera->bufferGetMin(), 2);
+    } catch (const std::exception& e) {
+        /* Not all the drivers tell this. */
+        mNumBuffersMin = 2;
+    }
+
+    mNumBuffersWanted = std::max(static_cast<int>(mBufferDepth.numBuffers),
+                                 mNumBuffersMin);
+
+    for (auto const& name: mCamera->getVideoNodes())
+        mVideoNodes.push_back({ .name = name });
+
+    mControlEventsScheduled = false;
+    mWorkQueue.reset(new WorkQueue("CameraWorker"));
+
+    if (mConfig.lingerMs)
+        mLingerThread = std::thread(&CameraHandler::lingerThread, this);
+}
+
+void CameraHandler::lingerThread()
+{
+    std::unique_lock<std::mutex> lock(mLock);
+
+    while (!mLingerTerminate) {
+        if (!mLingering) {
+            mLingerCondVar.wait(lock);
+            continue;
+        }
+
+        mLingerCondVar.wait_until(lock, mLingerDeadline);
+
+        if (mLingering &&
+            std::chrono::steady_clock::now() >= mLingerDeadline) {
+            LOG(mLog, DEBUG) << "Linger window expired, stop streaming";
+
+            lingerFlush();
+        }
+    }
+}
+
+/* Must be called with mLock held. */
+void CameraHandler::lingerFlush()
+{
+    mLingering = false;
+
+    if (mSuspended)
+        mSuspended = false;
+    else
+        mCamera->streamStop();
+
+    {
+        /* Frames from the previous run are of no use for the next one. */
+        std::lock_guard<std::mutex> frameLock(mFrameLock);
+
+        mHistory.clear();
+        sharedHoldsReset();
+    }
+
+    bufferDepthAdapt();
+}
+
+bool CameraHandler::isSameFormat(const v4l2_pix_format& a,
+                                 const v4l2_pix_format& b)
+{
+    return a.pixelformat == b.pixelformat && a.width == b.width &&
+        a.height == b.height && a.bytesperline == b.bytesperline &&
+        a.sizeimage == b.sizeimage;
+}
+
+/* Must be called with mLock held. */
+void CameraHandler::poolAlloc(int numBuffers)
+{
+    v4l2_pix_format fmt = mCamera->formatGet().fmt.pix;
+
+    if (mPoolAllocated) {
+        if (mPoolNumRequested == numBuffers && isSameFormat(mPoolFormat, fmt))
+            return;
+
+        poolRelease();
+    }
+
+    mNumBuffersAllocated = mCamera->streamAlloc(numBuffers,
+        mBufferDepth.adaptive ? mBufferDepth.maxBuffers : 0);
+    mPoolAllocated = true;
+    mPoolFormat = fmt;
+    mPoolNumRequested = numBuffers;
+}
+
+/* Called from the camera's event thread. */
+void CameraHandler::bufferDepthUpdate(uint64_t holdUs)
+{
+    std::lock_guard<std::mutex> lock(mFrameLock);
+
+    mBufferStats.holdUs = mBufferStats.frames ?
+        (7 * mBufferStats.holdUs + holdUs) / 8 : holdUs;
+    mBufferStats.maxHoldUs = std::max(mBufferStats.maxHoldUs, holdUs);
+    mBufferStats.frames++;
+    mBufferStats.sinceGrowth++;
+
+    /* Buffers added while frontends share them would never be shared. */
+    if (!mBufferDepth.adaptive || mBufferStats.growFailed ||
+        mBufferStats.growPending || mSharedUsers.size() ||
+        !mHwFrameIntervalUs ||
+        mBufferStats.sinceGrowth < cBufferDepthSettleFrames ||
+        mCamera->bufferGetCount() >=
+        static_cast<int>(mBufferDepth.maxBuffers))
+        return;
+
+    /*
+     * While a frame is held the driver has one buffer less to capture to:
+     * add one before it runs out of them.
+     */
+    if (4 * mBufferStats.holdUs < 3 * mHwFrameIntervalUs)
+        return;
+
+    /*
+     * Other threads read the buffers under mLock only, so they are
+     * added by the worker holding both locks.
+     */
+    mBufferStats.growPending = true;
+    mWorkQueue->post(std::bind(&CameraHandler::bufferGrow, this));
+}
+
+/* Runs on the work queue. */
+void CameraHandler::bufferGrow()
+{
+    std::lock_guard<std::mutex> lock(mLock);
+    std::lock_guard<std::mutex> frameLock(mFrameLock);
+
+    mBufferStats.growPending = false;
+    mBufferStats.sinceGrowth = 0;
+
+    /* The stream might have stopped or started sharing meanwhile. */
+    if (mSuspended || (!mStreamingNow.size() && !mLingering) ||
+        mSharedUsers.size())
+        return;
+
+    try {
+        int grown = mCamera->streamGrow(1);
+
+        mBufferStats.grown += grown;
+
+        /* No room was kept for more. */
+        if (!grown)
+            mBufferStats.growFailed = true;
+    } catch (const std::exception& e) {
+        LOG(mLog, WARNING) << "Can't add buffers: " << e.what();
+        mBufferStats.growFailed = true;
+    }
+}
+
+/* Must be called with mLock held, once the stream is stopped. */
+void CameraHandler::bufferDepthAdapt()
+{
+    std::lock_guard<std::mutex> lock(mFrameLock);
+
+    int count = mCamera->bufferGetCount();
+
+    LOG(mLog, DEBUG) << "Buffers: " << count << " (min " << mNumBuffersMin <<
+        ", max " << mBufferDepth.maxBuffers << "), frames " <<
+        mBufferStats.frames << ", hold us avg " << mBufferStats.holdUs <<
+        " max " << mBufferStats.maxHoldUs << ", frame period us " <<
+        mHwFrameIntervalUs << ", grown by " << mBufferStats.grown;
+
+    if (mBufferDepth.adaptive && mBufferStats.frames) {
+        if (mBufferStats.grown) {
+            /* Keep what the pool has grown to. */
+            mNumBuffersWanted = count;
+            mPoolNumRequested = count;
+        } else if (4 * mBufferStats.holdUs < mHwFrameIntervalUs &&
+                   mNumBuffersWanted > mNumBuffersMin) {
+            /* Shrink on the next pool allocation. */
+            mNumBuffersWanted--;
+        }
+    }
+
+    mBufferStats = {0};
+}
+
+/* Must be called with mLock held. */
+void CameraHandler::poolRelease()
+{
+    if (!mPoolAllocated)
+        return;
+
+    /* Buffers can't be freed while the stream lingers. */
+    if (mLingering)
+        lingerFlush();
+
+    mCamera->streamRelease();
+    mPoolAllocated = false;
+}
+
+void CameraHandler::listenerSet(domid_t domId, Listeners listeners)
+{
+    std::lock_guard<std::mutex> lock(mFrameLock);
+
+    mListeners.emplace(domId, listeners);
+}
+
+void CameraHandler::listenerReset(domid_t domId)
+{
+    std::lock_guard<std::mutex> nodeLock(mLock);
+
+    nodeRelease(domId);
+
+    {
+        std::lock_guard<std::mutex> lock(mFrameLock);
+
+        mListeners.erase(domId);
+        mFrontendFormats.erase(domId);
+        mFrameRates.erase(domId);
+        mLastSequences.erase(domId);
+
+        /* Drop scaled frames nobody is interested in anymore. */
+        for (auto it = mScaledFrames.begin(); it != mScaledFrames.end(); ) {
+            bool used = false;
+
+            for (auto const& fmt: mFrontendFormats)
+                if (it->first == getScaledFrameKey(fmt.second))
+                    used = true;
+
+            if (used)
+                ++it;
+            else
+                it = mScaledFrames.erase(it);
+        }
+    }
+
+    /* The frontend may go without stopping its stream. */
+    if (mStreamingNow.erase(domId) && !mStreamingNow.size())
+        streamHwRelease();
+
+    frameRateApply();
+}
+
+/* Must be called with mLock held. */
+CameraHandler::NodeUser *CameraHandler::getNodeUser(domid_t domId)
+{
+    auto it = mNodeUsers.find(domId);
+
+    if (it == mNodeUsers.end())
+        return nullptr;
+
+    return &it->second;
+}
+
+/*
+ * Must be called with mLock held. With probed set nothing is assigned:
+ * the format the frontend would get from a node is returned there, as if
+ * its current node was released first, like CONFIG_SET does.
+ */
+bool CameraHandler::nodeAssign(domid_t domId, const xencamera_config_req& req,
+                               v4l2_pix_format *probed)
+{
+    v4l2_pix_format hw = mCamera->formatGet().fmt.pix;
+
+    if (req.pixel_format == hw.pixelformat && req.width == hw.width &&
+        req.height == hw.height)
+        return false;
+
+    NodeUser *user = probed ? getNodeUser(domId) : nullptr;
+
+    for (size_t i = 0; i < mVideoNodes.size(); i++) {
+        auto& node = mVideoNodes[i];
+
+        if (node.failed)
+            continue;
+
+        int numUsers = node.numUsers;
+
+        if (user && user->node == i)
+            numUsers--;
+
+        bool isMatch = false;
+
+        if (!numUsers) {
+            try {
+                if (!node.camera)
+                    node.camera.reset(new Camera(node.name,
+                                                 mConfig.udmabuf));
+            } catch (const std::exception& e) {
+                /* E.g. a metadata node. */
+                LOG(mLog, DEBUG) << "Can't use " << node.name << ": " <<
+                    e.what();
+
+                node.failed = true;
+                continue;
+            }
+
+            try {
+                v4l2_format fmt {0};
+
+                fmt.fmt.pix.pixelformat = req.pixel_format;
+                fmt.fmt.pix.width = req.width;
+                fmt.fmt.pix.height = req.height;
+
+                node.camera->formatTry(fmt);
+
+                isMatch = fmt.fmt.pix.pixelformat == req.pixel_format &&
+                    fmt.fmt.pix.width == req.width &&
+                    fmt.fmt.pix.height == req.height;
+
+                if (isMatch && probed) {
+                    *probed = fmt.fmt.pix;
+                } else if (isMatch) {
+                    node.camera->formatSet(fmt);
+                    node.format = node.camera->formatGet().fmt.pix;
+                }
+            } catch (const std::exception& e) {
+                LOG(mLog, DEBUG) << "Can't configure " << node.name << ": " <<
+                    e.what();
+                isMatch = false;
+            }
+        }
+
+        /* Nodes in use keep their format. */
+        if (!probed || numUsers)
+            isMatch = node.camera &&
+                node.format.pixelformat == req.pixel_format &&
+                node.format.width == req.width &&
+                node.format.height == req.height;
+
+        if (!isMatch) {
+            if (!node.numUsers)
+                node.camera.reset();
+
+            continue;
+        }
+
+        if (probed) {
+            if (numUsers)
+                *probed = node.format;
+            else if (!node.numUsers)
+                node.camera.reset();
+
+            return true;
+        }
+
+        node.numUsers++;
+
+        {
+            std::lock_guard<std::mutex> frameLock(mFrameLock);
+
+            mNodeUsers[domId] = { .node = i };
+            mFrontendFormats[domId] = node.format;
+        }
+
+        LOG(mLog, DEBUG) << "Route dom " << std::to_string(domId) << " to " <<
+            node.name;
+
+        return true;
+    }
+
+    return false;
+}
+
+/* Must be called with mLock held. */
+void CameraHandler::nodeRelease(domid_t domId)
+{
+    NodeUser *user = getNodeUser(domId);
+
+    if (!user)
+        return;
+
+    auto& node = mVideoNodes[user->node];
+
+    /* The frontend might be gone without stopping its stream. */
+    if (user->streaming && !--node.numStreaming)
+        node.camera->streamStop();
+
+    if (user->hasBuffers && !--node.numBufferUsers)
+        node.camera->streamRelease();
+
+    {
+        std::lock_guard<std::mutex> frameLock(mFrameLock);
+
+        mNodeUsers.erase(domId);
+        mFrontendFormats.erase(domId);
+    }
+
+    if (!--node.numUsers) {
+        node.camera.reset();
+        node.format = {0};
+    }
+}
+
+/* Must be called with mLock held. */
+bool CameraHandler::nodeBufRequest(domid_t domId, const xencamera_req& aReq,
+                                   xencamera_resp& aResp)
+{
+    NodeUser *user = getNodeUser(domId);
+
+    if (!user)
+        return false;
+
+    auto& node = mVideoNodes[user->node];
+
+    if (!user->hasBuffers) {
+        if (!node.numBufferUsers)
+            node.numBuffers = node.camera->streamAlloc(mNumBuffersWanted);
+
+        node.numBufferUsers++;
+
+        std::lock_guard<std::mutex> frameLock(mFrameLock);
+
+        user->hasBuffers = true;
+    }
+
+    aResp.resp.buf_request.num_bufs =
+        std::min(static_cast<int>(aReq.req.buf_request.num_bufs),
+                 node.numBuffers);
+
+    return true;
+}
+
+/* Must be called with mLock held. */
+bool CameraHandler::nodeBufRelease(domid_t domId)
+{
+    NodeUser *user = getNodeUser(domId);
+
+    if (!user)
+        return false;
+
+    auto& node = mVideoNodes[user->node];
+
+    if (user->hasBuffers) {
+        {
+            std::lock_guard<std::mutex> frameLock(mFrameLock);
+
+            user->hasBuffers = false;
+        }
+
+        if (!--node.numBufferUsers && !node.numStreaming)
+            node.camera->streamRelease();
+    }
+
+    return true;
+}
+
+/* Must be called with mLock held. */
+bool CameraHandler::nodeStreamStart(domid_t domId)
+{
+    NodeUser *user = getNodeUser(domId);
+
+    if (!user)
+        return false;
+
+    auto& node = mVideoNodes[user->node];
+
+    if (user->streaming)
+        return true;
+
+    if (!node.numStreaming++)
+        node.camera->streamStart(bind(&CameraHandler::onNodeFrameDoneCallback,
+                                      this, user->node, _1, _2, _3));
+
+    std::lock_guard<std::mutex> frameLock(mFrameLock);
+
+    auto it = mFrameRates.find(domId);
+
+    if (it != mFrameRates.end())
+        it->second.nextUs = 0;
+
+    user->streaming = true;
+
+    return true;
+}
+
+/* Must be called with mLock held. */
+bool CameraHandler::nodeStreamStop(domid_t domId)
+{
+    NodeUser *user = getNodeUser(domId);
+
+    if (!user)
+        return false;
+
+    auto& node = mVideoNodes[user->node];
+
+    if (!user->streaming)
+        return true;
+
+    {
+        std::lock_guard<std::mutex> frameLock(mFrameLock);
+
+        user->streaming = false;
+    }
+
+    if (!--node.numStreaming)
+        node.camera->streamStop();
+
+    return true;
+}
+
+bool CameraHandler::onNodeFrameDoneCallback(size_t node, int index, int size,
+                                            const timeval& timestamp)
+{
+    std::lock_guard<std::mutex> lock(mFrameLock);
+    auto data = static_cast<const uint8_t *>(
+        mVideoNodes[node].camera->bufferGetData(index));
+    uint64_t timestampUs = timestamp.tv_sec * 1000000ull + timestamp.tv_usec;
+
+    mTimestampMonotonic = mVideoNodes[node].camera->isTimestampMonotonic();
+
+    for (auto const& user : mNodeUsers) {
+        if (user.second.node != node || !user.second.streaming ||
+            !isFrameDue(user.first, timestampUs))
+            continue;
+
+        auto listener = mListeners.find(user.first);
+
+        if (listener != mListeners.end() &&
+            listener->second.frame(data, size, timestampUs))
+            frameRateAdvance(user.first, timestampUs);
+    }
+
+    return true;
+}
+
+bool CameraHandler::frontendFormatGet(domid_t domId, v4l2_pix_format& fmt)
+{
+    std::lock_guard<std::mutex> lock(mFrameLock);
+
+    auto it = mFrontendFormats.find(domId);
+
+    if (it == mFrontendFormats.end())
+        return false;
+
+    fmt = it->second;
+    return true;
+}
+
+bool CameraHandler::frontendFormatTry(const xencamera_config_req& req,
+                                      v4l2_pix_format& fmt)
+{
+    v4l2_format hw = mCamera->formatGet();
+
+    /*
+     * Only downscaling can be emulated, everything else gets the HW
+     * configuration. Format conversion needs a mem2mem device.
+     */
+    if (!req.width || !req.height ||
+        req.width > hw.fmt.pix.width || req.height > hw.fmt.pix.height)
+        return false;
+
+    if (req.pixel_format == hw.fmt.pix.pixelformat &&
+        Scaler::isSupported(req.pixel_format)) {
+        fmt = Scaler::getPixFormat(req.pixel_format, req.width, req.height);
+
+        return fmt.width != hw.fmt.pix.width ||
+            fmt.height != hw.fmt.pix.height;
+    }
+
+    if (req.pixel_format == hw.fmt.pix.pixelformat &&
+        req.width == hw.fmt.pix.width && req.height == hw.fmt.pix.height)
+        return false;
+
+    if (JpegDecoder::isSupported(hw.fmt.pix.pixelformat, req.pixel_format)) {
+        fmt = Scaler::getPixFormat(req.pixel_format, req.width, req.height);
+
+        return true;
+    }
+
+    if (mConfig.m2mDevice.empty())
+        return false;
+
+    fmt = {0};
+    fmt.pixelformat = req.pixel_format;
+    fmt.width = req.width;
+    fmt.height = req.height;
+    fmt.field = V4L2_FIELD_NONE;
+
+    return M2MDevice::isSupported(mConfig.m2mDevice, hw.fmt.pix, fmt);
+}
+
+/* Must be called with mLock held. */
+bool CameraHandler::isConvertible(uint32_t hwPixelFormat,
+                                  const v4l2_pix_format& fmt)
+{
+    if (JpegDecoder::isSupported(hwPixelFormat, fmt.pixelformat))
+        return true;
+
+    auto key = std::make_pair(hwPixelFormat, fmt.pixelformat);
+    auto it = mConversions.find(key);
+
+    if (it != mConversions.end())
+        return it->second;
+
+    bool converts = conversionProbe(hwPixelFormat, fmt);
+
+    mConversions[key] = converts;
+
+    return converts;
+}
+
+bool CameraHandler::conversionProbe(uint32_t hwPixelFormat,
+                                    const v4l2_pix_format& fmt)
+{
+    if (mConfig.m2mDevice.empty())
+        return false;
+
+    v4l2_format hw {0};
+
+    hw.fmt.pix.pixelformat = hwPixelFormat;
+    hw.fmt.pix.width = fmt.width;
+    hw.fmt.pix.height = fmt.height;
+
+    try {
+        mCamera->formatTry(hw);
+    } catch (const std::exception& e) {
+        return false;
+    }
+
+    v4l2_pix_format out = fmt;
+
+    return M2MDevice::isSupported(mConfig.m2mDevice, hw.fmt.pix, out);
+}
+
+/*
+ * Finds the pixel format the HW is best run at to deliver the requested
+ * configuration at the frame rate the frontend wants.
+ */
+bool CameraHandler::formatNegotiate(domid_t domId,
+                                    const xencamera_config_req& req,
+                                    uint32_t& hwPixelFormat)
+{
+    FormatNegotiator negotiator(mCamera->getFormats(), mBusBandwidth);
+    FormatNegotiator::Choice choice;
+    v4l2_pix_format fmt {0};
+    float fps = 0;
+
+    fmt.pixelformat = req.pixel_format;
+    fmt.width = req.width;
+    fmt.height = req.height;
+    fmt.field = V4L2_FIELD_NONE;
+
+    {
+        std::lock_guard<std::mutex> frameLock(mFrameLock);
+
+        auto it = mFrameRates.find(domId);
+
+        if (it != mFrameRates.end())
+            fps = static_cast<float>(it->second.rate.numerator) /
+                it->second.rate.denominator;
+    }
+
+    if (!negotiator.negotiate(fmt, fps,
+                              bind(&CameraHandler::isConvertible,
+                                   this, _1, _2), choice))
+        return false;
+
+    hwPixelFormat = choice.pixelFormat;
+
+    return true;
+}
+
+void CameraHandler::frontendFormatToXen(const v4l2_pix_format& fmt,
+                                        xencamera_config_resp *cfg_resp)
+{
+    cfg_resp->pixel_format = fmt.pixelformat;
+    cfg_resp->width = fmt.width;
+    cfg_resp->height = fmt.height;
+}
+
+void CameraHandler::frontendConfigToXen(domid_t domId,
+                                        xencamera_config_resp *cfg_resp)
+{
+    v4l2_pix_format fmt;
+
+    if (frontendFormatGet(domId, fmt))
+        frontendFormatToXen(fmt, cfg_resp);
+
+    std::lock_guard<std::mutex> lock(mFrameLock);
+
+    auto it = mFrameRates.find(domId);
+
+    /* Frontend gets decimated frames if it asked for less than HW runs. */
+    if (it != mFrameRates.end() &&
+        static_cast<uint64_t>(it->second.rate.numerator) *
+            cfg_resp->frame_rate_denom <
+        static_cast<uint64_t>(cfg_resp->frame_rate_numer) *
+            it->second.rate.denominator) {
+        cfg_resp->frame_rate_numer = it->second.rate.numerator;
+        cfg_resp->frame_rate_denom = it->second.rate.denominator;
+    }
+}
+
+void CameraHandler::configToXen(xencamera_config_resp *cfg_resp)
+{
+    v4l2_format fmt = mCamera->formatGet();
+
+    cfg_resp->pixel_format = fmt.fmt.pix.pixelformat;
+    cfg_resp->width = fmt.fmt.pix.width;
+    cfg_resp->height = fmt.fmt.pix.height;
+
+    cfg_resp->colorspace = V4L2ToXen::colorspaceToXen(fmt.fmt.pix.colorspace);
+
+    cfg_resp->xfer_func = V4L2ToXen::xferToXen(fmt.fmt.pix.xfer_func);
+
+    cfg_resp->ycbcr_enc = V4L2ToXen::ycbcrToXen(fmt.fmt.pix.ycbcr_enc);
+
+    cfg_resp->quantization = V4L2ToXen::quantizationToXen(fmt.fmt.pix.quantization);
+
+    /* TODO: This needs to be properly handled. */
+    cfg_resp->displ_asp_ratio_numer = 1;
+    cfg_resp->displ_asp_ratio_denom = 1;
+
+    v4l2_fract frameRate = mCamera->frameRateGet();
+
+    cfg_resp->frame_rate_numer = frameRate.numerator;
+    cfg_resp->frame_rate_denom = frameRate.denominator;
+}
+
+void CameraHandler::configSetTry(const xencamera_req& aReq,
+                                 xencamera_resp& aResp, bool is_set,
+                                 uint32_t hwPixelFormat)
+{
+    const xencamera_config_req *cfg_req = &aReq.req.config;
+
+    v4l2_format fmt {0};
+
+    fmt.fmt.pix.pixelformat = hwPixelFormat ? hwPixelFormat :
+        cfg_req->pixel_format;
+    fmt.fmt.pix.width = cfg_req->width;
+    fmt.fmt.pix.height = cfg_req->height;
+
+    /*
+     * The format is only set once, before any buffers are allocated:
+     * frontends configured later get theirs scaled or converted.
+     */
+    if (is_set)
+        mCamera->formatSet(fmt);
+    else
+        mCamera->formatTry(fmt);
+
+    configToXen(&aResp.resp.config);
+}
+
+void CameraHandler::configSet(domid_t domId, const xencamera_req& aReq,
+                              xencamera_resp& aResp)
+{
+    std::lock_guard<std::mutex> lock(mLock);
+
+    DLOG(mLog, DEBUG) << "Handle command [CONFIG SET] dom " <<
+        std::to_string(domId);
+
+    if (mFormatSet) {
+        NodeUser *user = getNodeUser(domId);
+
+        if (user && user->hasBuffers)
+            throw XenBackend::Exception(
+                "Can't change format while buffers are in use", EBUSY);
+
+        nodeRelease(domId);
+
+        if (nodeAssign(domId, aReq.req.config)) {
+            configToXen(&aResp.resp.config);
+            frontendConfigToXen(domId, &aResp.resp.config);
+            return;
+        }
+
+        v4l2_pix_format fmt;
+        bool scaled = frontendFormatTry(aReq.req.config, fmt);
+
+        {
+            std::lock_guard<std::mutex> frameLock(mFrameLock);
+
+            if (scaled)
+                mFrontendFormats[domId] = fmt;
+            else
+                mFrontendFormats.erase(domId);
+        }
+
+        configToXen(&aResp.resp.config);
+        frontendConfigToXen(domId, &aResp.resp.config);
+    } else {
+        FormatNegotiator::Match match;
+        xencamera_req req = aReq;
+        uint32_t hwPixelFormat = req.req.config.pixel_format;
+
+        /* Set what CONFIG_VALIDATE told the frontend it would get. */
+        if (configResolve(domId, aReq.req.config, match)) {
+            req.req.config.pixel_format = match.pixelFormat;
+            req.req.config.width = match.width;
+            req.req.config.height = match.height;
+            hwPixelFormat = match.hwPixelFormat;
+        }
+
+        configSetTry(req, aResp, true, hwPixelFormat);
+        mFormatSet = true;
+
+        /* Only needed until the format is set. */
+        mConfigMatches.clear();
+        mConversions.clear();
+
+        /* The frontend's format is converted from what HW runs at. */
+        v4l2_pix_format fmt;
+
+        if (hwPixelFormat != req.req.config.pixel_format &&
+            frontendFormatTry(req.req.config, fmt)) {
+            {
+                std::lock_guard<std::mutex> frameLock(mFrameLock);
+
+                mFrontendFormats[domId] = fmt;
+            }
+
+            frontendConfigToXen(domId, &aResp.resp.config);
+        }
+    }
+}
+
+void CameraHandler::configValidate(domid_t domId, const xencamera_req& aReq,
+                                   xencamera_resp& aResp)
+{
+    std::lock_guard<std::mutex> lock(mLock);
+
+    DLOG(mLog, DEBUG) << "Handle command [CONFIG VALIDATE] dom " <<
+        std::to_string(domId);
+
+    if (mFormatSet) {
+        v4l2_pix_format fmt;
+
+        configToXen(&aResp.resp.config);
+
+        /* What CONFIG_SET would do: a sibling node first. */
+        if (nodeAssign(domId, aReq.req.config, &fmt) ||
+            frontendFormatTry(aReq.req.config, fmt))
+            frontendFormatToXen(fmt, &aResp.resp.config);
+    } else {
+        FormatNegotiator::Match match;
+
+        if (!configResolve(domId, aReq.req.config, match)) {
+            configSetTry(aReq, aResp, false);
+            return;
+        }
+
+        xencamera_config_resp *cfg_resp = &aResp.resp.config;
+
+        configToXen(cfg_resp);
+
+        cfg_resp->pixel_format = match.pixelFormat;
+        cfg_resp->width = match.width;
+        cfg_resp->height = match.height;
+        cfg_resp->frame_rate_numer = match.frameRate.numerator;
+        cfg_resp->frame_rate_denom = match.frameRate.denominator;
+    }
+}
+
+/*
+ * Must be called with mLock held. CONFIG_VALIDATE and the first
+ * CONFIG_SET resolve a configuration the same way, so the frontend gets
+ * what it was told it would.
+ */
+bool CameraHandler::configResolve(domid_t domId,
+                                  const xencamera_config_req& req,
+                                  FormatNegotiator::Match& match)
+{
+    auto key = std::make_tuple(req.pixel_format, req.width, req.height);
+    auto it = mConfigMatches.find(key);
+
+    if (it != mConfigMatches.end()) {
+        match = it->second;
+    } else {
+        FormatNegotiator negotiator(mCamera->getFormats(), mBusBandwidth);
+        v4l2_pix_format fmt {0};
+
+        fmt.pixelformat = req.pixel_format;
+        fmt.width = req.width;
+        fmt.height = req.height;
+        fmt.field = V4L2_FIELD_NONE;
+
+        if (!negotiator.findNearest(fmt, bind(&CameraHandler::isConvertible,
+                                              this, _1, _2), match))
+            return false;
+
+        DLOG(mLog, DEBUG) << "Best match for " << req.width << "x" <<
+            req.height << ": " << match.width << "x" << match.height;
+
+        mConfigMatches[key] = match;
+    }
+
+    /* Another HW format might sustain the frame rate wanted better. */
+    if (match.pixelFormat == req.pixel_format) {
+        xencamera_config_req nearest = req;
+        uint32_t hwPixelFormat;
+
+        nearest.width = match.width;
+        nearest.height = match.height;
+
+        if (formatNegotiate(domId, nearest, hwPixelFormat))
+            match.hwPixelFormat = hwPixelFormat;
+    }
+
+    return true;
+}
+
+void CameraHandler::configGet(domid_t domId, const xencamera_req& aReq,
+                              xencamera_resp& aResp)
+{
+    std::lock_guard<std::mutex> lock(mLock);
+
+    DLOG(mLog, DEBUG) << "Handle command [CONFIG GET] dom " <<
+        std::to_string(domId);
+
+    configToXen(&aResp.resp.config);
+    frontendConfigToXen(domId, &aResp.resp.config);
+}
+
+void CameraHandler::frameRateSet(domid_t domId, const xencamera_req& aReq,
+                                 xencamera_resp& aResp)
+{
+    std::lock_guard<std::mutex> lock(mLock);
+    const xencamera_frame_rate_req *req = &aReq.req.frame_rate;
+
+    DLOG(mLog, DEBUG) << "Handle command [FRAME RATE SET] dom " <<
+        std::to_string(domId);
+
+    if (!req->frame_rate_numer || !req->frame_rate_denom)
+        throw XenBackend::Exception("Wrong frame rate " +
+                                    std::to_string(req->frame_rate_numer) +
+                                    "/" +
+                                    std::to_string(req->frame_rate_denom),
+                                    EINVAL);
+
+    {
+        std::lock_guard<std::mutex> frameLock(mFrameLock);
+
+        FrameRate& frameRate = mFrameRates[domId];
+
+        frameRate.rate.numerator = req->frame_rate_numer;
+        frameRate.rate.denominator = req->frame_rate_denom;
+        frameRate.intervalUs = 1000000ull * req->frame_rate_denom /
+            req->frame_rate_numer;
+        frameRate.nextUs = 0;
+    }
+
+    frameRateApply();
+}
+
+/*
+ * Must be called with mLock held: the HW runs at the highest rate of the
+ * frontends streaming now, so it goes down again when they stop.
+ */
+void CameraHandler::frameRateApply()
+{
+    v4l2_fract maxRate = { 0, 1 };
+
+    {
+        std::lock_guard<std::mutex> frameLock(mFrameLock);
+
+        for (auto const& streaming: mStreamingNow) {
+            auto it = mFrameRates.find(streaming.first);
+
+            if (it == mFrameRates.end())
+                continue;
+
+            const v4l2_fract& rate = it->second.rate;
+
+            if (static_cast<uint64_t>(rate.numerator) * maxRate.denominator >
+                static_cast<uint64_t>(maxRate.numerator) * rate.denominator)
+                maxRate = rate;
+        }
+    }
+
+    if (!maxRate.numerator ||
+        (maxRate.numerator == mHwFrameRate.numerator &&
+         maxRate.denominator == mHwFrameRate.denominator))
+        return;
+
+    /*
+     * Some drivers refuse to change the frame rate while streaming:
+     * keep the current one then, the frames will still be decimated.
+     */
+    try {
+        mCamera->frameRateSet(maxRate.numerator, maxRate.denominator);
+    } catch (const std::exception& e) {
+        LOG(mLog, WARNING) << "Failed to set frame rate " <<
+            maxRate.numerator << "/" << maxRate.denominator << ": " <<
+            e.what();
+        return;
+    }
+
+    mHwFrameRate = mCamera->frameRateGet();
+
+    std::lock_guard<std::mutex> frameLock(mFrameLock);
+
+    mHwFrameIntervalUs = mHwFrameRate.numerator ?
+        1000000ull * mHwFrameRate.denominator / mHwFrameRate.numerator : 0;
+}
+
+bool CameraHandler::isFrameDue(domid_t domId, uint64_t timestampUs)
+{
+    auto it = mFrameRates.find(domId);
+
+    if (it == mFrameRates.end())
+        return true;
+
+    const FrameRate& frameRate = it->second;
+
+    /* Allow half of the HW frame period of jitter. */
+    return !frameRate.nextUs ||
+        timestampUs + mHwFrameIntervalUs / 2 >= frameRate.nextUs;
+}
+
+/*
+ * Called once a due frame is delivered: a frame dropped, e.g. for lack
+ * of a buffer, doesn't count, so the next one is due right away.
+ */
+void CameraHandler::frameRateAdvance(domid_t domId, uint64_t timestampUs)
+{
+    auto it = mFrameRates.find(domId);
+
+    if (it == mFrameRates.end())
+        return;
+
+    FrameRate& frameRate = it->second;
+
+    /* Keep the cadence unless we fell behind, then resync. */
+    if (frameRate.nextUs &&
+        timestampUs < frameRate.nextUs + frameRate.intervalUs)
+        frameRate.nextUs += frameRate.intervalUs;
+    else
+        frameRate.nextUs = timestampUs + frameRate.intervalUs;
+}
+
+void CameraHandler::bufGetLayout(domid_t domId, const xencamera_req& aReq,
+                                 xencamera_resp& aResp)
+{
+    std::lock_guard<std::mutex> lock(mLock);
+    xencamera_buf_get_layout_resp *resp = &aResp.resp.buf_layout;
+
+    DLOG(mLog, DEBUG) << "Handle command [BUF GET LAYOUT] dom " <<
+        std::to_string(domId);
+
+    v4l2_pix_format fmt;
+
+    if (!frontendFormatGet(domId, fmt))
+        fmt = mCamera->formatGet().fmt.pix;
+
+    DLOG(mLog, DEBUG) << "Handle command [BUF GET LAYOUT] size " <<
+        fmt.sizeimage;
+
+    /* XXX: Single plane only. */
+    resp->num_planes = 1;
+    resp->size = fmt.sizeimage;
+    resp->plane_size[0] = fmt.sizeimage;
+    resp->plane_stride[0] = fmt.bytesperline;
+}
+
+v4l2_pix_format CameraHandler::bufGetFormat(domid_t domId)
+{
+    std::lock_guard<std::mutex> lock(mLock);
+
+    v4l2_pix_format fmt;
+
+    if (!frontendFormatGet(domId, fmt))
+        fmt = mCamera->formatGet().fmt.pix;
+
+    return fmt;
+}
+
+void CameraHandler::ctrlEnum(domid_t domId, const xencamera_req& aReq,
+                             xencamera_resp& aResp, int type)
+{
+    const xencamera_index *req = &aReq.req.index;
+    xencamera_ctrl_enum_resp *resp = &aResp.resp.ctrl_enum;
+
+    auto info = mCamera->controlEnum(V4L2ToXen::ctrlToV4L2(type));
+
+    resp->index = req->index;
+    resp->type = type;
+    resp->flags = V4L2ToXen::ctrlFlagsToXen(info.flags);
+    resp->min = info.minimum;
+    resp->max = info.maximum;
+    resp->step = info.step;
+    resp->def_val = info.default_value;
+}
+
+void CameraHandler::ctrlSet(domid_t domId, const xencamera_req& aReq,
+                            xencamera_resp& aResp, int type)
+{
+    /*
+     * The request is acknowledged right away: the camera writes the value
+     * at the next frame boundary, so mLock is not needed.
+     *
+     * FIXME: for V4L2 frontends there could be a circular depependecy
+     * here: when a frontend recievs "control changed" event it will
+     * inject it into the V4L2 framework with v4l2_ctrl_s_ctrl,
+     * which internally calls driver's s_ctrl callback. This callback
+     * is implemented in a way that it sends "set control" request to
+     * the backend, which is expected to send events to the rest
+     * of the frontends.
+     * Work this around by checking if this "set control" request
+     * has control's value different from the current and only send
+     * events if so: the camera tells that from its control cache.
+     */
+    DLOG(mLog, DEBUG) << "Handle command [SET CTRL] dom " <<
+        std::to_string(domId) << " control " << type << " requested: " <<
+        std::to_string(aReq.req.ctrl_value.value);
+
+    if (!mCamera->controlSetValue(V4L2ToXen::ctrlToV4L2(type),
+                                  aReq.req.ctrl_value.value)) {
+        DLOG(mLog, DEBUG) << "Skip command [SET CTRL] dom " <<
+            std::to_string(domId) << " control " << type << " requested: " <<
+            std::to_string(aReq.req.ctrl_value.value);
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mFrameLock);
+
+    /* Send ctrl change event to the rest of frontends, but current. */
+    controlEventPost(type, aReq.req.ctrl_value.value, domId);
+}
+
+void CameraHandler::ctrlGet(domid_t domId, const xencamera_req& aReq,
+                            xencamera_resp& aResp, int type)
+{
+    DLOG(mLog, DEBUG) << "Handle command [GET CTRL] dom " <<
+        std::to_string(domId) << " control " << type;
+
+    aResp.resp.ctrl_value.type = type;
+    aResp.resp.ctrl_value.value =
+        mCamera->controlGetValue(V4L2ToXen::ctrlToV4L2(type));
+}
+
+/*
+ * Called from the camera's event thread, or when a control read while
+ * the camera is idle was changed by others.
+ */
+void CameraHandler::onControlChangeCallback(int v4l2_cid, int64_t value)
+{
+    int type = V4L2ToXen::ctrlFindXen(v4l2_cid);
+
+    /* Not a control frontends know of. */
+    if (type < 0)
+        return;
+
+    std::lock_guard<std::mutex> lock(mFrameLock);
+
+    controlEventPost(type, value, -1);
+}
+
+/* Called with mFrameLock held. */
+void CameraHandler::controlEventPost(int type, int64_t value, int source)
+{
+    mControlEvents[type] = { value, source };
+
+    if (mControlEventsScheduled)
+        return;
+
+    auto due = mControlEventsSent +
+        std::chrono::milliseconds(cControlEventIntervalMs);
+
+    if (std::chrono::steady_clock::now() >= due) {
+        controlEventsFlush();
+        return;
+    }
+
+    mControlEventsScheduled = true;
+
+    mWorkQueue->postAt([this]() {
+        std::lock_guard<std::mutex> lock(mFrameLock);
+
+        mControlEventsScheduled = false;
+        controlEventsFlush();
+    }, due);
+}
+
+/* Called with mFrameLock held. */
+void CameraHandler::controlEventsFlush()
+{
+    for (auto const& event : mControlEvents)
+        for (auto &listener : mListeners)
+            if (listener.first != event.second.source)
+                listener.second.control(event.first, event.second.value);
+
+    mControlEvents.clear();
+    mControlEventsSent = std::chrono::steady_clock::now();
+}
+
+void CameraHandler::scaledFrameInit(ScaledFrame& frame,
+                                    const v4l2_pix_format& fmt, bool useM2M)
+{
+    frame.sequence = 0;
+    frame.m2mMisses = 0;
+
+    if (useM2M && !mConfig.m2mDevice.empty()) {
+        try {
+            frame.m2m.reset(new M2MDevice(mConfig.m2mDevice, mStreamFormat,
+                                          fmt, mNumBuffersAllocated));
+
+            /* The frontend's buffers are laid out as negotiated. */
+            if (frame.m2m->getFormat().bytesperline == fmt.bytesperline &&
+                frame.m2m->getFormat().sizeimage <= fmt.sizeimage)
+                return;
+
+            LOG(mLog, WARNING) << "Mem2mem device changed the layout of " <<
+                fmt.width << "x" << fmt.height;
+        } catch (const std::exception& e) {
+            LOG(mLog, WARNING) << "Mem2mem device can't produce " <<
+                fmt.width << "x" << fmt.height << ": " << e.what();
+        }
+
+        frame.m2m.reset();
+    }
+
+    if (JpegDecoder::isSupported(mStreamFormat.pixelformat, fmt.pixelformat)) {
+        auto decoded = getDecodedFormat(fmt);
+
+        /* Smaller sizes are scaled from the decoded frame. */
+        if (decoded.width != fmt.width || decoded.height != fmt.height) {
+            LOG(mLog, DEBUG) << "Decode and scale " << fmt.width << "x" <<
+                fmt.height << " with CPU";
+
+            frame.scaler.reset(new Scaler(decoded, fmt.width, fmt.height));
+            frame.buffer.resize(frame.scaler->getFormat().sizeimage);
+        } else {
+            LOG(mLog, DEBUG) << "Decode " << fmt.width << "x" << fmt.height <<
+                " with CPU";
+
+            frame.decoder.reset(new JpegDecoder(fmt.pixelformat,
+                                                mStreamFormat.width,
+                                                mStreamFormat.height));
+            frame.buffer.resize(frame.decoder->getFormat().sizeimage);
+        }
+
+        frame.data = frame.buffer.data();
+        frame.size = frame.buffer.size();
+        return;
+    }
+
+    /* The CPU can only scale. */
+    if (fmt.pixelformat != mStreamFormat.pixelformat)
+        throw XenBackend::Exception("Can't convert frames without mem2mem",
+                                    ENOTSUP);
+
+    LOG(mLog, DEBUG) << "Scale " << fmt.width << "x" << fmt.height <<
+        " with CPU";
+
+    frame.scaler.reset(new Scaler(mStreamFormat, fmt.width, fmt.height));
+    frame.buffer.resize(frame.scaler->getFormat().sizeimage);
+    frame.data = frame.buffer.data();
+    frame.size = frame.buffer.size();
+}
+
+v4l2_pix_format CameraHandler::getDecodedFormat(const v4l2_pix_format& fmt)
+{
+    return Scaler::getPixFormat(fmt.pixelformat, mStreamFormat.width,
+                                mStreamFormat.height);
+}
+
+CameraHandler::ScaledFrame *CameraHandler::getScaledFrame(
+    const v4l2_pix_format& fmt, int index, const uint8_t *data, size_t size)
+{
+    auto key = getScaledFrameKey(fmt);
+    auto& frame = mScaledFrames[key];
+
+    try {
+        if (!frame.m2m && !frame.decoder && !frame.scaler)
+            scaledFrameInit(frame, fmt, true);
+
+        if (frame.sequence == mFrameSequence)
+            return &frame;
+
+        if (frame.m2m) {
+            try {
+                auto result = frame.m2m->process(index,
+                                                 mCamera->bufferGetFd(index),
+                                                 mCamera->bufferGetSize(index),
+                                                 size, frame.size,
+                                                 getM2MTimeoutMs());
+
+                /*
+                 * Don't hold the camera thread: the frame is dropped for
+                 * this format and the device is given another chance.
+                 */
+                if (!result) {
+                    if (++frame.m2mMisses < cM2MMaxMisses)
+                        return nullptr;
+
+                    throw XenBackend::Exception("Device can't keep up",
+                                                ETIMEDOUT);
+                }
+
+                frame.m2mMisses = 0;
+                frame.data = result;
+            } catch (const std::exception& e) {
+                LOG(mLog, ERROR) << "Mem2mem device failed, fall back to CPU: "
+                    << e.what();
+
+                frame.m2m.reset();
+                scaledFrameInit(frame, fmt, false);
+            }
+        }
+
+        if (frame.decoder)
+            frame.decoder->decode(data, size, frame.buffer.data());
+
+        if (frame.scaler) {
+            const uint8_t *src = data;
+
+            /* Decoded frames are shared by all sizes of the format. */
+            if (FormatNegotiator::isCompressed(mStreamFormat.pixelformat)) {
+                auto decoded = getScaledFrame(getDecodedFormat(fmt), index,
+                                              data, size);
+
+                /* Dropped or failed, the latter is already logged. */
+                if (!decoded)
+                    return nullptr;
+
+                src = decoded->data;
+            }
+
+            frame.scaler->scale(src, frame.buffer.data());
+        }
+
+        frame.sequence = mFrameSequence;
+    } catch (const std::exception& e) {
+        LOG(mLog, ERROR) << "Failed to scale frame to " << fmt.width <<
+            "x" << fmt.height << ": " << e.what();
+
+        mScaledFrames.erase(key);
+        return nullptr;
+    }
+
+    return &frame;
+}
+
+int CameraHandler::getM2MTimeoutMs()
+{
+    /* A frame which is late for the next one is not worth waiting for. */
+    if (!mHwFrameIntervalUs)
+        return cM2MTimeoutMs;
+
+    return std::max<uint64_t>(mHwFrameIntervalUs / 1000, 1);
+}
+
+bool CameraHandler::stageFrame(const uint8_t *data, size_t size,
+                               size_t numConsumers)
+{
+    if (mConfig.staging == Config::Staging::NEVER)
+        return false;
+
+    if (mConfig.staging == Config::Staging::AUTO) {
+        /* Consumers read cached memory already. */
+        if (numConsumers < 2 || mCamera->bufferIsCached())
+            return false;
+
+        /*
+         * Staging costs one more read of the V4L2 buffer, but then every
+         * consumer reads cached memory: it pays off if cached memory is
+         * faster by more than numConsumers / (numConsumers - 1).
+         */
+        if (mStagingGain && mStagingGain <= static_cast<double>(
+            numConsumers) / (numConsumers - 1))
+            return false;
+    }
+
+    /* Allocated at stream start, never on the camera thread. */
+    if (!mStagingBuffer || mStagingBuffer->size() < size)
+        return false;
+
+    if (mConfig.staging == Config::Staging::AUTO && !mStagingGain) {
+        if (!mStagingProbe || mStagingProbe->size() < size)
+            return false;
+
+        /*
+         * The staging buffer is overwritten by the frame right after, so
+         * it is the destination of both copies. The probe goes first as
+         * reading the V4L2 buffer would pull the destination into cache.
+         */
+        mStagingCachedTime += StagingBuffer::copyMeasure(
+            mStagingBuffer->get(), mStagingProbe->get(), size);
+        mStagingV4L2Time += StagingBuffer::copyMeasure(
+            mStagingBuffer->get(), data, size);
+        mStagingBytes += size;
+
+        if (++mStagingSamples < cStagingSamples)
+            return true;
+
+        double v4l2Bandwidth = mStagingV4L2Time > 0 ?
+            mStagingBytes / mStagingV4L2Time : 0;
+        double cachedBandwidth = mStagingCachedTime > 0 ?
+            mStagingBytes / mStagingCachedTime : 0;
+
+        mStagingGain = v4l2Bandwidth && cachedBandwidth ?
+            cachedBandwidth / v4l2Bandwidth : 1;
+
+        LOG(mLog, INFO) << "Copy bandwidth from V4L2 buffer " <<
+            static_cast<uint64_t>(v4l2Bandwidth / 1000000) <<
+            " MB/s, from cached memory " <<
+            static_cast<uint64_t>(cachedBandwidth / 1000000) << " MB/s";
+
+        /* The probe is not needed anymore. */
+        mStagingProbe.reset();
+
+        return true;
+    }
+
+    memcpy(mStagingBuffer->get(), data, size);
+
+    return true;
 }
 
-void CameraHandler::listenerSet(domid_t domId, Listeners listeners)
-{
-    std::lock_guard<std::mutex> lock(mLock);
+bool CameraHandler::frameDeliver(int index, int size,
+                                 const timeval& timestamp)
+{
+    std::lock_guard<std::mutex> lock(mFrameLock);
+    auto data = static_cast<const uint8_t *>(mCamera->bufferGetData(index));
+    uint64_t timestampUs = timestamp.tv_sec * 1000000ull + timestamp.tv_usec;
+
+    mTimestampMonotonic = mCamera->isTimestampMonotonic();
+
+    DLOG(mLog, DEBUG) << "Frame " << std::to_string(index) <<
+        " backend index " << std::to_string(index);
+
+    mFrameSequence++;
+    mFrameTargets.clear();
+
+    if (mConfig.idleFrames) {
+        if (isAnyFrontendReady())
+            mIdleFrames = 0;
+        else if (++mIdleFrames == mConfig.idleFrames)
+            mWorkQueue->post(std::bind(&CameraHandler::streamSuspend, this));
+    }
+
+    bool held = false;
+
+    for (auto &listener : mListeners) {
+        if (mNodeUsers.count(listener.first) ||
+            !isFrameDue(listener.first, timestampUs))
+            continue;
+
+        if (mSharedUsers.count(listener.first)) {
+            held |= sharedFrameDeliver(listener.first, listener.second,
+                                       index, size, timestampUs);
+            continue;
+        }
+
+        mFrameTargets.push_back({ listener.first, &listener.second.frame,
+                                  data, static_cast<size_t>(size) });
+    }
+
+    bool staged = !mFrameTargets.empty() &&
+        stageFrame(data, size, mFrameTargets.size());
+
+    if (staged)
+        data = mStagingBuffer->get();
+
+    /*
+     * The mailbox delivers from the history: it is only pushed to for
+     * that if there is somebody to deliver the frame to later.
+     */
+    if (!mListeners.empty() &&
+        (mConfig.historyMaxBytes || isAnyTargetStarved()))
+        mHistory.push(data, size, mFrameSequence,
+                      mTimestampMonotonic ? timestampUs : 0);
+
+    if (mFrameTargets.empty())
+        return !held;
+
+    for (auto &target : mFrameTargets) {
+        auto fmt = mFrontendFormats.find(target.domId);
+
+        if (fmt == mFrontendFormats.end()) {
+            target.data = data;
+            continue;
+        }
+
+        auto frame = getScaledFrame(fmt->second, index, data, size);
 
-    mListeners.emplace(domId, listeners);
-}
+        target.data = frame ? frame->data : nullptr;
+        target.size = frame ? frame->size : 0;
+    }
 
-void CameraHandler::listenerReset(domid_t domId)
-{
-    std::lock_guard<std::mutex> lock(mLock);
+    /*
+     * Everything needed is read out of the V4L2 buffer by now,
+     * so give it back to the driver before copying to the frontends.
+     * Frontends holding the buffer can only queue it back once we are
+     * done: that takes mFrameLock.
+     */
+    if (staged && !held) {
+        mCamera->bufferQueue(index);
+        mRequeueTime = std::chrono::steady_clock::now();
+    }
 
-    mListeners.erase(domId);
+    for (auto const& target : mFrameTargets)
+        if (target.data &&
+            (*target.listener)(target.data, target.size, timestampUs)) {
+            mLastSequences[target.domId] = mFrameSequence;
+            frameRateAdvance(target.domId, timestampUs);
+        }
+
+    return !staged && !held;
 }
 
-void CameraHandler::configToXen(xencamera_config_resp *cfg_resp)
+/* Must be called with mFrameLock held. */
+bool CameraHandler::sharedFrameDeliver(domid_t domId,
+                                       const Listeners& listeners,
+                                       int index, int size,
+                                       uint64_t timestampUs)
 {
-    v4l2_format fmt = mCamera->formatGet();
+    if (static_cast<int>(mSharedHolders.size()) < mCamera->bufferGetCount())
+        mSharedHolders.resize(mCamera->bufferGetCount());
 
-    cfg_resp->pixel_format = fmt.fmt.pix.pixelformat;
-    cfg_resp->width = fmt.fmt.pix.width;
-    cfg_resp->height = fmt.fmt.pix.height;
+    auto& holders = mSharedHolders[index];
 
-    cfg_resp->colorspace = V4L2ToXen::colorspaceToXen(fmt.fmt.pix.colorspace);
+    /* Frontends may not take so many buffers the driver runs dry. */
+    if (holders.empty()) {
+        int numHeld = 0;
 
-    cfg_resp->xfer_func = V4L2ToXen::xferToXen(fmt.fmt.pix.xfer_func);
+        for (auto const& buffer : mSharedHolders)
+            numHeld += !buffer.empty();
 
-    cfg_resp->ycbcr_enc = V4L2ToXen::ycbcrToXen(fmt.fmt.pix.ycbcr_enc);
+        if (numHeld + 1 > mCamera->bufferGetCount() - mNumBuffersMin) {
+            DLOG(mLog, DEBUG) << "Too many buffers held, skip frame for dom "
+                << std::to_string(domId);
+            return false;
+        }
+    }
 
-    cfg_resp->quantization = V4L2ToXen::quantizationToXen(fmt.fmt.pix.quantization);
+    if (!listeners.shared(index, size, timestampUs))
+        return false;
 
-    /* TODO: This needs to be properly handled. */
-    cfg_resp->displ_asp_ratio_numer = 1;
-    cfg_resp->displ_asp_ratio_denom = 1;
+    holders.insert(domId);
+    mLastSequences[domId] = mFrameSequence;
+    frameRateAdvance(domId, timestampUs);
 
-    v4l2_fract frameRate = mCamera->frameRateGet();
+    return true;
+}
 
-    cfg_resp->frame_rate_numer = frameRate.numerator;
-    cfg_resp->frame_rate_denom = frameRate.denominator;
+/* Must be called with mFrameLock held. */
+void CameraHandler::sharedHoldsReset()
+{
+    for (auto& holders : mSharedHolders)
+        holders.clear();
 }
 
-void CameraHandler::configSetTry(const xencamera_req& aReq,
-                                 xencamera_resp& aResp, bool is_set)
+int CameraHandler::sharedBufRequest(domid_t domId)
 {
-    const xencamera_config_req *cfg_req = &aReq.req.config;
+    std::lock_guard<std::mutex> lock(mLock);
+    std::lock_guard<std::mutex> frameLock(mFrameLock);
 
-    v4l2_format fmt {0};
+    /* Frames of those are not what the V4L2 buffers hold. */
+    if (mNodeUsers.count(domId) || mFrontendFormats.count(domId) ||
+        !mListeners.count(domId) || !mListeners[domId].shared)
+        return 0;
 
-    fmt.fmt.pix.pixelformat = cfg_req->pixel_format;
-    fmt.fmt.pix.width = cfg_req->width;
-    fmt.fmt.pix.height = cfg_req->height;
+    /*
+     * The frontend can write to the buffers it shares, so unless
+     * frontends trust each other it must be the camera's only one.
+     */
+    if (!mConfig.sharedBuffersTrusted && mListeners.size() > 1) {
+        LOG(mLog, DEBUG) << "Dom " << std::to_string(domId) <<
+            " can't share buffers: camera has other frontends";
 
-    if (is_set)
-        mCamera->formatSet(fmt);
-    else
-        mCamera->formatTry(fmt);
+        return 0;
+    }
 
-    configToXen(&aResp.resp.config);
+    mSharedUsers.insert(domId);
+
+    DLOG(mLog, DEBUG) << "Dom " << std::to_string(domId) << " shares " <<
+        mCamera->bufferGetCount() << " buffers";
+
+    return mCamera->bufferGetCount();
 }
 
-void CameraHandler::configSet(domid_t domId, const xencamera_req& aReq,
-                              xencamera_resp& aResp)
+void CameraHandler::sharedBufGet(int index, int& fd, size_t& size)
 {
     std::lock_guard<std::mutex> lock(mLock);
 
-    DLOG(mLog, DEBUG) << "Handle command [CONFIG SET] dom " <<
-        std::to_string(domId);
-
-    if (mFormatSet) {
-        configToXen(&aResp.resp.config);
-    } else {
-        configSetTry(aReq, aResp, true);
-        mFormatSet = true;
-    }
+    fd = mCamera->bufferGetFd(index);
+    size = mCamera->bufferGetSize(index);
 }
 
-void CameraHandler::configValidate(domid_t domId, const xencamera_req& aReq,
-                                   xencamera_resp& aResp)
+void CameraHandler::sharedBufQueue(domid_t domId, int index)
 {
-    std::lock_guard<std::mutex> lock(mLock);
+    std::lock_guard<std::mutex> frameLock(mFrameLock);
 
-    DLOG(mLog, DEBUG) << "Handle command [CONFIG VALIDATE] dom " <<
-        std::to_string(domId);
+    if (index < 0 || index >= static_cast<int>(mSharedHolders.size()))
+        return;
 
-    if (mFormatSet)
-        configToXen(&aResp.resp.config);
-    else
-        configSetTry(aReq, aResp, false);
+    auto& holders = mSharedHolders[index];
+
+    /* Not held: the HW stream has been restarted meanwhile. */
+    if (!holders.erase(domId) || !holders.empty())
+        return;
+
+    DLOG(mLog, DEBUG) << "Buffer " << index << " released by all frontends";
+
+    mCamera->bufferQueue(index);
 }
 
-void CameraHandler::configGet(domid_t domId, const xencamera_req& aReq,
-                              xencamera_resp& aResp)
+void CameraHandler::sharedBufQueueAll(domid_t domId)
 {
-    std::lock_guard<std::mutex> lock(mLock);
+    std::lock_guard<std::mutex> frameLock(mFrameLock);
 
-    DLOG(mLog, DEBUG) << "Handle command [CONFIG GET] dom " <<
-        std::to_string(domId);
-
-    configToXen(&aResp.resp.config);
+    sharedHoldsDrop(domId);
 }
 
-void CameraHandler::frameRateSet(domid_t domId, const xencamera_req& aReq,
-                                 xencamera_resp& aResp)
+void CameraHandler::sharedBufRelease(domid_t domId)
 {
-    std::lock_guard<std::mutex> lock(mLock);
-    const xencamera_frame_rate_req *req = &aReq.req.frame_rate;
+    std::lock_guard<std::mutex> frameLock(mFrameLock);
 
-    DLOG(mLog, DEBUG) << "Handle command [FRAME RATE SET] dom " <<
-        std::to_string(domId);
+    mSharedUsers.erase(domId);
+    sharedHoldsDrop(domId);
+}
 
-    if (mFramerateSet) {
-    } else {
-        mCamera->frameRateSet(req->frame_rate_numer, req->frame_rate_denom);
-        mFramerateSet = true;
-    }
+/* Must be called with mFrameLock held. */
+void CameraHandler::sharedHoldsDrop(domid_t domId)
+{
+    /* Called on frontend teardown, so this mustn't throw. */
+    for (size_t i = 0; i < mSharedHolders.size(); i++)
+        if (mSharedHolders[i].erase(domId) && mSharedHolders[i].empty()) {
+            try {
+                mCamera->bufferQueue(i);
+            } catch (const std::exception& e) {
+                LOG(mLog, ERROR) << e.what();
+            }
+        }
 }
 
-void CameraHandler::bufGetLayout(domid_t domId, const xencamera_req& aReq,
-                                 xencamera_resp& aResp)
+bool CameraHandler::onFrameDoneCallback(int index, int size,
+                                        const timeval& timestamp)
 {
-    std::lock_guard<std::mutex> lock(mLock);
-    xencamera_buf_get_layout_resp *resp = &aResp.resp.buf_layout;
+    auto start = std::chrono::steady_clock::now();
 
-    DLOG(mLog, DEBUG) << "Handle command [BUF GET LAYOUT] dom " <<
-        std::to_string(domId);
+    mRequeueTime = {};
 
-    v4l2_format fmt = mCamera->formatGet();
+    bool requeue = frameDeliver(index, size, timestamp);
 
-    DLOG(mLog, DEBUG) << "Handle command [BUF GET LAYOUT] size " <<
-        fmt.fmt.pix.sizeimage;
+    /*
+     * The buffer is held from dequeue to requeue: the latter is right
+     * after we return or was done by frameDeliver() already. Buffers
+     * held by frontends sharing them are not counted, the pool never
+     * grows while sharing.
+     */
+    auto end = requeue ? std::chrono::steady_clock::now() : mRequeueTime;
 
-    /* XXX: Single plane only. */
-    resp->num_planes = 1;
-    resp->size = fmt.fmt.pix.sizeimage;
-    resp->plane_size[0] = fmt.fmt.pix.sizeimage;
-    resp->plane_stride[0] = fmt.fmt.pix.bytesperline;
+    if (end != std::chrono::steady_clock::time_point())
+        bufferDepthUpdate(std::chrono::duration_cast<
+            std::chrono::microseconds>(end - start).count());
+
+    return requeue;
 }
 
-size_t CameraHandler::bufGetImageSize(domid_t domId)
+/* Must be called with mFrameLock held. */
+bool CameraHandler::isAnyTargetStarved()
 {
-    std::lock_guard<std::mutex> lock(mLock);
+    if (!mConfig.mailbox)
+        return false;
 
-    v4l2_format fmt = mCamera->formatGet();
+    for (auto const& target : mFrameTargets) {
+        auto listener = mListeners.find(target.domId);
+
+        if (listener != mListeners.end() && listener->second.ready &&
+            !listener->second.ready())
+            return true;
+    }
 
-    return fmt.fmt.pix.sizeimage;
+    return false;
 }
 
-void CameraHandler::ctrlEnum(domid_t domId, const xencamera_req& aReq,
-                             xencamera_resp& aResp,std::string name)
+void CameraHandler::frameHistoryDeliver(domid_t domId, bool missed)
 {
-    const xencamera_index *req = &aReq.req.index;
-    xencamera_ctrl_enum_resp *resp = &aResp.resp.ctrl_enum;
+    std::unique_lock<std::mutex> lock(mFrameLock);
 
-    auto info = mCamera->controlEnum(name);
+    /* The history might only be kept for the mailbox. */
+    if (!missed && !mConfig.historyMaxBytes)
+        return;
 
-    resp->index = req->index;
-    resp->type = V4L2ToXen::ctrlToXen(info.v4l2_cid);
-    resp->flags = V4L2ToXen::ctrlFlagsToXen(info.flags);
-    resp->min = info.minimum;
-    resp->max = info.maximum;
-    resp->step = info.step;
-    resp->def_val = info.default_value;
-}
+    auto frame = mHistory.getLatest();
 
-void CameraHandler::ctrlSet(domid_t domId, const xencamera_req& aReq,
-                            xencamera_resp& aResp, std::string name)
-{
-    std::lock_guard<std::mutex> lock(mLock);
+    /* Frontends on other nodes get nothing from this stream. */
+    /* Frontends sharing buffers only get frames in the V4L2 buffers. */
+    if (!frame || mNodeUsers.count(domId) || mSharedUsers.count(domId))
+        return;
 
-    /*
-     * FIXME: for V4L2 frontends there could be a circular depependecy
-     * here: when a frontend recievs "control changed" event it will
-     * inject it into the V4L2 framework with v4l2_ctrl_s_ctrl,
-     * which internally calls driver's s_ctrl callback. This callback
-     * is implemented in a way that it sends "set control" request to
-     * the backend, which is expected to send events to the rest
-     * of the frontends.
-     * Work this around by checking if this "set control" request
-     * has control's value different from the current and only send
-     * events if so.
-     */
-    auto curVal = mCamera->controlGetValue(name);
+    auto isWanted = [&]() {
+        auto last = mLastSequences[domId];
 
-    DLOG(mLog, DEBUG) << "Handle command [SET CTRL] dom " <<
-        std::to_string(domId) << " control " << name << " current: " <<
-        std::to_string(curVal) << " requested: " <<
-        std::to_string(aReq.req.ctrl_value.value);
+        return missed ? frame->sequence > last : last == 0;
+    };
 
-    if (curVal == aReq.req.ctrl_value.value) {
-        DLOG(mLog, DEBUG) << "Skip command [SET CTRL] dom " <<
-            std::to_string(domId) << " control " << name << " current: " <<
-            std::to_string(curVal) << " requested: " <<
-            std::to_string(aReq.req.ctrl_value.value);
+    if (!isWanted() || !mListeners.count(domId))
         return;
-    }
 
-    mCamera->controlSetValue(name, aReq.req.ctrl_value.value);
+    const uint8_t *data = frame->data.data();
+    size_t size = frame->size;
+    std::vector<uint8_t> scaled;
+    auto fmt = mFrontendFormats.find(domId);
 
-    /* Send ctrl change event to the rest of frontends, but current. */
-    for (auto &listener : mListeners) {
-        if (listener.first != domId)
-            listener.second.control(name, aReq.req.ctrl_value.value);
+    if (fmt != mFrontendFormats.end()) {
+        /* Converted frames need the V4L2 buffer, which is long gone. */
+        if (fmt->second.pixelformat != mStreamFormat.pixelformat)
+            return;
+
+        v4l2_pix_format from = mStreamFormat;
+        v4l2_pix_format to = fmt->second;
+
+        /*
+         * Scaling takes a while, so the camera thread isn't held meanwhile.
+         * The frame is ours: the history doesn't reuse it while it's held.
+         */
+        lock.unlock();
+
+        try {
+            Scaler scaler(from, to.width, to.height);
+
+            scaled.resize(scaler.getFormat().sizeimage);
+            scaler.scale(data, scaled.data());
+        } catch (const std::exception& e) {
+            LOG(mLog, ERROR) << "Failed to scale frame from history: " <<
+                e.what();
+            return;
+        }
+
+        lock.lock();
+
+        /* The frontend might have been configured or gone since. */
+        fmt = mFrontendFormats.find(domId);
+
+        if (fmt == mFrontendFormats.end() || !isSameFormat(fmt->second, to) ||
+            !isSameFormat(mStreamFormat, from) || !isWanted())
+            return;
+
+        data = scaled.data();
+        size = scaled.size();
     }
-}
 
-void CameraHandler::onFrameDoneCallback(int index, int size)
-{
-    auto data = mCamera->bufferGetData(index);
+    auto listener = mListeners.find(domId);
 
-    DLOG(mLog, DEBUG) << "Frame " << std::to_string(index) <<
-        " backend index " << std::to_string(index);
+    if (listener == mListeners.end())
+        return;
 
-    for (auto &listener : mListeners)
-        listener.second.frame(static_cast<uint8_t *>(data), size);
+    DLOG(mLog, DEBUG) << "Deliver frame " << frame->sequence <<
+        " from history to dom " << std::to_string(domId);
+
+    /* Frames only keep their timestamp if it is monotonic. */
+    mTimestampMonotonic = frame->timestampUs != 0;
+
+    if (listener->second.frame(data, size, frame->timestampUs))
+        mLastSequences[domId] = frame->sequence;
 }
 
 void CameraHandler::bufRequest(domid_t domId, const xencamera_req& aReq,
@@ -272,14 +1829,17 @@ void CameraHandler::bufRequest(domid_t domId, const xencamera_req& aReq,
         std::to_string(domId) << " requested num_bufs " <<
         std::to_string(req->num_bufs);
 
+    if (nodeBufRequest(domId, aReq, aResp))
+        return;
+
     /*
-     * If no buffers are allocated yet in the HW device (backend buffers)
-     * then request buffers now.
+     * If no frontend uses buffers of the HW device (backend buffers)
+     * yet then make sure those are allocated for the current format:
+     * the pool of the previous cycle is reused if the format is the same.
      * This must not be less than max(frontend[i].max_buffers).
      */
     if (!mBuffersAllocated.size())
-        /* TODO: use config for BE_CONFIG_NUM_BUFFERS. */
-        mNumBuffersAllocated = mCamera->streamAlloc(BE_CONFIG_NUM_BUFFERS);
+        poolAlloc(mNumBuffersWanted);
 
     if (req->num_bufs > mNumBuffersAllocated)
         resp->num_bufs = mNumBuffersAllocated;
@@ -299,9 +1859,142 @@ void CameraHandler::bufRelease(domid_t domId)
     DLOG(mLog, DEBUG) << "Frontend dom " << std::to_string(domId) <<
         " has released all buffers";
 
+    if (nodeBufRelease(domId))
+        return;
+
+    /* The pool is kept for the next cycle, see poolAlloc. */
     mBuffersAllocated.erase(domId);
-    if (!mBuffersAllocated.size())
-        mCamera->streamRelease();
+}
+
+/* Must be called with mLock held. */
+void CameraHandler::streamHwStart()
+{
+    {
+        std::lock_guard<std::mutex> frameLock(mFrameLock);
+
+        /* The HW format might have changed since the last run. */
+        mStreamFormat = mCamera->formatGet().fmt.pix;
+        mScaledFrames.clear();
+        mIdleFrames = 0;
+
+        stagingInit();
+    }
+
+    mHwFrameRate = mCamera->frameRateGet();
+    mHwFrameIntervalUs = mHwFrameRate.numerator ?
+        1000000ull * mHwFrameRate.denominator / mHwFrameRate.numerator : 0;
+
+    cameraStreamStart();
+}
+
+/* Must be called with mFrameLock held while not streaming. */
+void CameraHandler::stagingInit()
+{
+    mStagingBuffer.reset();
+    mStagingProbe.reset();
+    mStagingGain = 0;
+    mStagingV4L2Time = 0;
+    mStagingCachedTime = 0;
+    mStagingBytes = 0;
+    mStagingSamples = 0;
+
+    if (mConfig.staging == Config::Staging::NEVER)
+        return;
+
+    /* Consumers read cached memory already. */
+    if (mConfig.staging == Config::Staging::AUTO && mCamera->bufferIsCached())
+        return;
+
+    try {
+        mStagingBuffer.reset(new StagingBuffer(mStreamFormat.sizeimage));
+
+        if (mConfig.staging == Config::Staging::AUTO)
+            mStagingProbe.reset(new StagingBuffer(mStreamFormat.sizeimage));
+    } catch (const std::exception& e) {
+        LOG(mLog, WARNING) << "Frames won't be staged: " << e.what();
+
+        mStagingBuffer.reset();
+        mStagingProbe.reset();
+    }
+}
+
+/* Must be called with mLock held. */
+void CameraHandler::cameraStreamStart()
+{
+    {
+        std::lock_guard<std::mutex> frameLock(mFrameLock);
+
+        /* All the buffers go to the driver. */
+        sharedHoldsReset();
+    }
+
+    mCamera->streamStart(bind(&CameraHandler::onFrameDoneCallback,
+                              this, _1, _2, _3));
+}
+
+/* Runs on the work queue. */
+void CameraHandler::streamSuspend()
+{
+    std::lock_guard<std::mutex> lock(mLock);
+
+    if (mSuspended || (!mStreamingNow.size() && !mLingering))
+        return;
+
+    {
+        std::lock_guard<std::mutex> frameLock(mFrameLock);
+
+        /*
+         * A buffer might have been queued meanwhile: its frontend will
+         * resume the stream once we are done otherwise.
+         */
+        if (isAnyFrontendReady())
+            return;
+    }
+
+    LOG(mLog, DEBUG) << "No frontend has buffers for " << mIdleFrames <<
+        " frames, pause streaming";
+
+    mCamera->streamStop();
+    mSuspended = true;
+
+    std::lock_guard<std::mutex> frameLock(mFrameLock);
+
+    sharedHoldsReset();
+}
+
+void CameraHandler::streamResume()
+{
+    if (!mConfig.idleFrames)
+        return;
+
+    std::lock_guard<std::mutex> lock(mLock);
+
+    if (!mSuspended)
+        return;
+
+    LOG(mLog, DEBUG) << "Resume streaming";
+
+    mSuspended = false;
+
+    {
+        std::lock_guard<std::mutex> frameLock(mFrameLock);
+
+        mIdleFrames = 0;
+    }
+
+    /* The V4L2 buffers are still there, so this is just STREAMON. */
+    cameraStreamStart();
+}
+
+/* Must be called with mFrameLock held. */
+bool CameraHandler::isAnyFrontendReady()
+{
+    for (auto &listener : mListeners)
+        if (!mNodeUsers.count(listener.first) &&
+            listener.second.ready && listener.second.ready())
+            return true;
+
+    return false;
 }
 
 void CameraHandler::streamStart(domid_t domId, const xencamera_req& aReq,
@@ -312,10 +2005,40 @@ void CameraHandler::streamStart(domid_t domId, const xencamera_req& aReq,
     DLOG(mLog, DEBUG) << "Handle command [STREAM START] dom " <<
         std::to_string(domId);
 
-    if (!mStreamingNow.size())
-        mCamera->streamStart(bind(&CameraHandler::onFrameDoneCallback,
-                                  this, _1, _2));
+    if (nodeStreamStart(domId))
+        return;
+
+    bool wasStreaming = mStreamingNow.size();
+
     mStreamingNow.emplace(domId, true);
+
+    /* Before STREAMON if possible: not all drivers change it while on. */
+    frameRateApply();
+
+    if (!wasStreaming && mLingering) {
+        LOG(mLog, DEBUG) << "Reattach to the lingering stream";
+
+        mLingering = false;
+        mLingerCondVar.notify_all();
+
+        if (mSuspended) {
+            mSuspended = false;
+            cameraStreamStart();
+        }
+    } else if (!wasStreaming) {
+        streamHwStart();
+    }
+
+    {
+        std::lock_guard<std::mutex> frameLock(mFrameLock);
+
+        auto it = mFrameRates.find(domId);
+
+        if (it != mFrameRates.end())
+            it->second.nextUs = 0;
+
+        mLastSequences[domId] = 0;
+    }
 }
 
 void CameraHandler::streamStop(domid_t domId, const xencamera_req& aReq,
@@ -326,14 +2049,71 @@ void CameraHandler::streamStop(domid_t domId, const xencamera_req& aReq,
     DLOG(mLog, DEBUG) << "Handle command [STREAM STOP] dom " <<
         std::to_string(domId);
 
+    if (nodeStreamStop(domId))
+        return;
+
     mStreamingNow.erase(domId);
+    frameRateApply();
+
     if (!mStreamingNow.size())
-        mCamera->streamStop();
+        streamHwRelease();
+}
+
+/* Must be called with mLock held once the last frontend stops streaming. */
+void CameraHandler::streamHwRelease()
+{
+    if (mConfig.lingerMs) {
+        mLingering = true;
+        mLingerDeadline = std::chrono::steady_clock::now() +
+            std::chrono::milliseconds(mConfig.lingerMs);
+        mLingerCondVar.notify_all();
+    } else {
+        lingerFlush();
+    }
 }
 
 void CameraHandler::release()
 {
-    mCamera->streamStop();
-    mCamera->streamRelease();
+    if (mLingerThread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(mLock);
+
+            mLingerTerminate = true;
+        }
+
+        mLingerCondVar.notify_all();
+        mLingerThread.join();
+    }
+
+    /*
+     * Camera threads post to the work queue, so they are stopped first.
+     * They take mFrameLock, so it mustn't be held meanwhile.
+     */
+    for (auto& node: mVideoNodes)
+        if (node.camera)
+            node.camera->streamStop();
+
+    if (mCamera)
+        mCamera->streamStop();
+
+    {
+        /* Work still pending finds nothing to do then. */
+        std::lock_guard<std::mutex> lock(mLock);
+
+        mStreamingNow.clear();
+        mLingering = false;
+        mSuspended = false;
+    }
+
+    mWorkQueue.reset();
+
+    for (auto& node: mVideoNodes)
+        if (node.camera) {
+            node.camera->streamRelease();
+            node.camera.reset();
+        }
+
+    if (mCamera)
+        mCamera->streamRelease();
 }
 
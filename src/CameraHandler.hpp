@@ -8,7 +8,11 @@
 #ifndef SRC_CAMERAHANDLER_HPP_
 #define SRC_CAMERAHANDLER_HPP_
 
+#include <chrono>
+#include <condition_variable>
 #include <map>
+#include <set>
+#include <thread>
 #include <unordered_map>
 
 #include <xen/be/Log.hpp>
@@ -17,17 +21,37 @@
 #include <xen/io/cameraif.h>
 
 #include "Camera.hpp"
+#include "Config.hpp"
+#include "FormatNegotiator.hpp"
+#include "FrameHistory.hpp"
 #include "FrontendBuffer.hpp"
+#include "JpegDecoder.hpp"
+#include "M2MDevice.hpp"
+#include "Scaler.hpp"
+#include "StagingBuffer.hpp"
+#include "WorkQueue.hpp"
 
 class CameraHandler
 {
 public:
-    CameraHandler(std::string uniqueId);
+    CameraHandler(std::string uniqueId, const Config& config);
     ~CameraHandler();
 
+    const Config& getConfig() const {
+        return mConfig;
+    }
+
+    /*
+     * Whether frame timestamps are CLOCK_MONOTONIC, so the age of a
+     * frame can be told: must be called with the frame being delivered.
+     */
+    bool isTimestampMonotonic() const {
+        return mTimestampMonotonic;
+    }
+
     void configToXen(xencamera_config_resp *cfg_resp);
     void configSetTry(const xencamera_req& aReq, xencamera_resp& aResp,
-                      bool is_set);
+                      bool is_set, uint32_t hwPixelFormat = 0);
 
     void configSet(domid_t domId, const xencamera_req& aReq,
                    xencamera_resp& aResp);
@@ -44,28 +68,67 @@ public:
     void bufRequest(domid_t domId, const xencamera_req& aReq,
                     xencamera_resp& aResp);
     void bufRelease(domid_t domId);
-    size_t bufGetImageSize(domid_t domId);
+    v4l2_pix_format bufGetFormat(domid_t domId);
 
+    /* Controls are identified by their Xen control type. */
     void ctrlEnum(domid_t domId, const xencamera_req& aReq,
-                  xencamera_resp& aResp, std::string name);
+                  xencamera_resp& aResp, int type);
     void ctrlSet(domid_t domId, const xencamera_req& aReq,
-                 xencamera_resp& aResp,std::string name);
+                 xencamera_resp& aResp, int type);
     void ctrlGet(domid_t domId, const xencamera_req& aReq,
-                 xencamera_resp& aResp, std::string name);
+                 xencamera_resp& aResp, int type);
 
     void streamStart(domid_t domId, const xencamera_req& aReq,
                      xencamera_resp& aResp);
     void streamStop(domid_t domId, const xencamera_req& aReq,
                     xencamera_resp& aResp);
 
-    /* data, size */
-    typedef std::function<void(uint8_t *, size_t)> FrameListener;
-    /* name, value */
-    typedef std::function<void(const std::string, int64_t)> ControlListener;
+    /*
+     * Frontends reading frames right from the V4L2 buffers instead of
+     * getting copies. Request returns the number of buffers the frontend
+     * can share, 0 if its frames are converted or come from another node,
+     * Get tells a buffer's DMABUF, Queue gives a buffer back, which is
+     * requeued once every frontend holding it has, QueueAll gives all the
+     * frontend's buffers back and Release also ends sharing.
+     */
+    int sharedBufRequest(domid_t domId);
+    void sharedBufGet(int index, int& fd, size_t& size);
+    void sharedBufQueue(domid_t domId, int index);
+    void sharedBufQueueAll(domid_t domId);
+    void sharedBufRelease(domid_t domId);
+
+    /*
+     * Give a frontend, which has no frames yet, the most recent frame.
+     * If missed then give it the most recent frame if it is newer than
+     * the last one the frontend got, for mailbox delivery.
+     */
+    void frameHistoryDeliver(domid_t domId, bool missed = false);
+
+    /* A frontend has queued a buffer: resume the HW stream if paused. */
+    void streamResume();
+
+    /*
+     * data, size, capture timestamp: returns true if the frame
+     * was delivered.
+     */
+    typedef std::function<bool(const uint8_t *, size_t, uint64_t)>
+        FrameListener;
+    /* Xen control type, value */
+    typedef std::function<void(int, int64_t)> ControlListener;
+    /* Returns true if the frontend is streaming and has a buffer queued. */
+    typedef std::function<bool()> ReadyListener;
+    /*
+     * V4L2 buffer index, size, capture timestamp: returns true if the
+     * frontend holds the buffer until it queues it back.
+     */
+    typedef std::function<bool(int, size_t, uint64_t)> SharedFrameListener;
 
     struct Listeners {
         FrameListener frame;
         ControlListener control;
+        ReadyListener ready;
+        /* Only for frontends which can share buffers. */
+        SharedFrameListener shared;
     };
 
     void listenerSet(domid_t domId, Listeners listeners);
@@ -75,6 +138,8 @@ private:
     XenBackend::Log mLog;
     std::mutex mLock;
 
+    Config mConfig;
+
     CameraPtr mCamera;
 
     /*
@@ -97,21 +162,326 @@ private:
      * only accept the very first set format and then emulate it to the rest.
      */
     bool mFormatSet;
-    bool mFramerateSet;
     int mNumBuffersAllocated;
 
+    /*
+     * Frontends asking for a configuration the main node doesn't run at
+     * are routed to another capture node of the same device, if one can
+     * produce it natively: ISPs scale for free. Each such node runs its
+     * own stream and buffers, frames go straight to its frontends.
+     */
+    struct VideoNode {
+        std::string name;
+        /* Opened on first use. */
+        CameraPtr camera;
+        bool failed;
+        v4l2_pix_format format;
+        int numUsers;
+        int numBufferUsers;
+        int numStreaming;
+        int numBuffers;
+    };
+
+    std::vector<VideoNode> mVideoNodes;
+
+    struct NodeUser {
+        size_t node;
+        bool hasBuffers;
+        bool streaming;
+    };
+
+    /* Written with both mLock and mFrameLock held. */
+    std::unordered_map<domid_t, NodeUser> mNodeUsers;
+
+    /* Bus bandwidth in bytes per second, 0 if not limited. */
+    uint64_t mBusBandwidth;
+
+    /*
+     * Nearest configurations found before any format is set, per
+     * requested pixel format, width and height: guests validate lots of
+     * configurations on start up. They only depend on the format table
+     * and the conversions the backend does, neither of which changes:
+     * anything depending on the frame rate is negotiated every time.
+     */
+    typedef std::tuple<uint32_t, uint32_t, uint32_t> ConfigKey;
+
+    std::map<ConfigKey, FormatNegotiator::Match> mConfigMatches;
+
+    /*
+     * HW pixel format, frontend's pixel format: whether the backend
+     * converts, probed once per pair as it opens the mem2mem device.
+     */
+    std::map<std::pair<uint32_t, uint32_t>, bool> mConversions;
+
     std::unordered_map<domid_t, int> mBuffersAllocated;
     std::unordered_map<domid_t, bool> mStreamingNow;
 
-    /* TODO: This needs to be a configuration option of the backend. */
-    static const int BE_CONFIG_NUM_BUFFERS = 4;
+    /*
+     * Once the last frontend has stopped streaming, the HW stream and its
+     * buffers linger for Config::lingerMs, so a frontend restarting its
+     * pipeline doesn't pay for STREAMOFF, REQBUFS, mmap and STREAMON.
+     * The linger thread stops the stream when the window expires.
+     */
+    bool mLingering;
+    bool mLingerTerminate;
+    std::chrono::steady_clock::time_point mLingerDeadline;
+    std::condition_variable mLingerCondVar;
+    std::thread mLingerThread;
+
+    /*
+     * The HW stream is paused if no frontend has had a buffer for
+     * Config::idleFrames frames: it is stopped from the work queue, as the
+     * camera's event thread can't join itself, and the V4L2 buffers are
+     * kept for resuming. The work queue also sends delayed control events.
+     */
+    bool mSuspended;
+    unsigned int mIdleFrames;
+    WorkQueuePtr mWorkQueue;
+
+    /*
+     * Number of V4L2 buffers: either fixed or, in adaptive mode, grown
+     * while streaming if frames are held for close to the frame period
+     * and shrunk when the pool is reallocated after a quiet run.
+     */
+    Config::BufferDepth mBufferDepth;
+    int mNumBuffersMin;
+    int mNumBuffersWanted;
+
+    /* Frames to wait for after growing the pool before growing it again. */
+    static const int cBufferDepthSettleFrames = 30;
+
+    /* Accessed from the camera's event thread. */
+    struct BufferStats {
+        uint64_t holdUs;
+        uint64_t maxHoldUs;
+        uint64_t frames;
+        uint64_t sinceGrowth;
+        int grown;
+        bool growFailed;
+        bool growPending;
+    } mBufferStats;
+
+    /* When frameDeliver() queued the buffer back itself, if it did. */
+    std::chrono::steady_clock::time_point mRequeueTime;
+
+    /*
+     * V4L2 buffer pool: it outlives frontends' buffer request/release
+     * cycles and is only reallocated if the HW format or the number of
+     * buffers wanted changes.
+     */
+    bool mPoolAllocated;
+    v4l2_pix_format mPoolFormat;
+    int mPoolNumRequested;
+
+    /*
+     * Frame fan-out state: this is accessed from the camera's event thread,
+     * so it is protected with its own lock, not mLock: the latter is held
+     * while the event thread is joined on stream stop.
+     */
+    std::mutex mFrameLock;
 
     std::unordered_map<domid_t, Listeners> mListeners;
 
+    /*
+     * Control change events are merged per control, the last value wins,
+     * and sent at most every cControlEventIntervalMs, so a guest dragging
+     * a slider doesn't flood the other frontends' event rings.
+     */
+    struct ControlEvent {
+        int64_t value;
+        /* Frontend which set the value, -1 if changed by the driver. */
+        int source;
+    };
+
+    static const int cControlEventIntervalMs = 50;
+
+    /* Xen control type to event. */
+    std::map<int, ControlEvent> mControlEvents;
+    bool mControlEventsScheduled;
+    std::chrono::steady_clock::time_point mControlEventsSent;
+
+    /*
+     * Frontends which asked for a smaller size than the one the HW camera
+     * runs at get their frames downscaled. If a mem2mem device is
+     * configured, scaling and format conversion are offloaded to it,
+     * otherwise (or if it fails to do so) frames are scaled by the CPU.
+     * MJPEG frames are decoded by the CPU into every raw format asked
+     * for, once per HW frame, and then scaled if needed.
+     * Scaled frames are cached per distinct format, so every format
+     * is only produced once per HW frame.
+     */
+    std::unordered_map<domid_t, v4l2_pix_format> mFrontendFormats;
+
+    struct ScaledFrame {
+        M2MDevicePtr m2m;
+        JpegDecoderPtr decoder;
+        ScalerPtr scaler;
+        std::vector<uint8_t> buffer;
+        const uint8_t *data;
+        size_t size;
+        uint64_t sequence;
+        /* Frames in a row the mem2mem device didn't make in time. */
+        int m2mMisses;
+    };
+
+    /* Wait for mem2mem this long if the frame interval is not known. */
+    static const int cM2MTimeoutMs = 40;
+    /* Give up on a mem2mem device which keeps missing frames. */
+    static const int cM2MMaxMisses = 8;
+
+    int getM2MTimeoutMs();
+
+    bool isAnyTargetStarved();
+
+    typedef std::tuple<uint32_t, uint32_t, uint32_t> ScaledFrameKey;
+
+    std::map<ScaledFrameKey, ScaledFrame> mScaledFrames;
+
+    v4l2_pix_format mStreamFormat;
+    uint64_t mFrameSequence;
+
+    /*
+     * Frame rates requested by the frontends: the HW camera runs at the
+     * highest of those and frames are decimated for the rest, based on
+     * capture timestamps, so skipped frames are neither copied nor
+     * signalled.
+     */
+    struct FrameRate {
+        v4l2_fract rate;
+        uint64_t intervalUs;
+        uint64_t nextUs;
+    };
+
+    std::unordered_map<domid_t, FrameRate> mFrameRates;
+
+    v4l2_fract mHwFrameRate;
+    uint64_t mHwFrameIntervalUs;
+
+    /* Frontends a frame is delivered to and what they get. */
+    struct FrameTarget {
+        domid_t domId;
+        FrameListener *listener;
+        const uint8_t *data;
+        size_t size;
+    };
+
+    std::vector<FrameTarget> mFrameTargets;
+
+    StagingBufferPtr mStagingBuffer;
+    /*
+     * Source of the cached memory copies measured against V4L2 ones:
+     * only written when allocated, so it is not in the CPU cache.
+     */
+    StagingBufferPtr mStagingProbe;
+    /* How much faster cached memory is read than V4L2 buffers, if known. */
+    double mStagingGain;
+
+    /* Seconds spent copying from V4L2 buffers and cached memory. */
+    double mStagingV4L2Time;
+    double mStagingCachedTime;
+    size_t mStagingBytes;
+    int mStagingSamples;
+
+    /* Frames copied both ways before deciding whether to stage. */
+    static const int cStagingSamples = 16;
+
+    void stagingInit();
+
+    /* Clock of the frame being delivered, accessed with mFrameLock held. */
+    bool mTimestampMonotonic;
+
+    FrameHistory mHistory;
+    /* History memory if it is only kept for mailbox delivery. */
+    static const size_t cMailboxMaxBytes = 64 * 1024 * 1024;
+
+    /* Sequence of the last frame delivered to the frontend, 0 if none. */
+    std::unordered_map<domid_t, uint64_t> mLastSequences;
+
+    /*
+     * Frontends sharing the V4L2 buffers and, per buffer, those holding
+     * it: written with mFrameLock held. Buffers held by frontends are
+     * only given back to the driver once the last one is done, so a few
+     * are always left to the driver. STREAMOFF takes all the buffers
+     * back, so holds end with the HW stream.
+     */
+    std::set<domid_t> mSharedUsers;
+    std::vector<std::set<domid_t>> mSharedHolders;
+
+    bool sharedFrameDeliver(domid_t domId, const Listeners& listeners,
+                            int index, int size, uint64_t timestampUs);
+    void sharedHoldsReset();
+    void sharedHoldsDrop(domid_t domId);
+
+    void cameraStreamStart();
+
     void init(std::string uniqueId);
     void release();
 
-    void onFrameDoneCallback(int index, int size);
+    void lingerThread();
+    void lingerFlush();
+    void streamHwRelease();
+
+    bool nodeAssign(domid_t domId, const xencamera_config_req& req,
+                    v4l2_pix_format *probed = nullptr);
+    void nodeRelease(domid_t domId);
+    NodeUser *getNodeUser(domid_t domId);
+    bool nodeBufRequest(domid_t domId, const xencamera_req& aReq,
+                        xencamera_resp& aResp);
+    bool nodeBufRelease(domid_t domId);
+    bool nodeStreamStart(domid_t domId);
+    bool nodeStreamStop(domid_t domId);
+    bool onNodeFrameDoneCallback(size_t node, int index, int size,
+                                 const timeval& timestamp);
+
+    void streamHwStart();
+    void streamSuspend();
+    bool isAnyFrontendReady();
+
+    static bool isSameFormat(const v4l2_pix_format& a,
+                             const v4l2_pix_format& b);
+    void poolAlloc(int numBuffers);
+    void poolRelease();
+
+    void bufferDepthUpdate(uint64_t holdUs);
+    void bufferDepthAdapt();
+    void bufferGrow();
+
+    bool isConvertible(uint32_t hwPixelFormat, const v4l2_pix_format& fmt);
+    bool conversionProbe(uint32_t hwPixelFormat, const v4l2_pix_format& fmt);
+    bool formatNegotiate(domid_t domId, const xencamera_config_req& req,
+                         uint32_t& hwPixelFormat);
+    bool configResolve(domid_t domId, const xencamera_config_req& req,
+                       FormatNegotiator::Match& match);
+
+    bool frontendFormatGet(domid_t domId, v4l2_pix_format& fmt);
+    bool frontendFormatTry(const xencamera_config_req& req,
+                           v4l2_pix_format& fmt);
+    void frontendFormatToXen(const v4l2_pix_format& fmt,
+                             xencamera_config_resp *cfg_resp);
+    void frontendConfigToXen(domid_t domId, xencamera_config_resp *cfg_resp);
+
+    void frameRateApply();
+    bool isFrameDue(domid_t domId, uint64_t timestampUs);
+    void frameRateAdvance(domid_t domId, uint64_t timestampUs);
+
+    bool stageFrame(const uint8_t *data, size_t size, size_t numConsumers);
+
+    static ScaledFrameKey getScaledFrameKey(const v4l2_pix_format& fmt) {
+        return std::make_tuple(fmt.pixelformat, fmt.width, fmt.height);
+    }
+
+    v4l2_pix_format getDecodedFormat(const v4l2_pix_format& fmt);
+    void scaledFrameInit(ScaledFrame& frame, const v4l2_pix_format& fmt,
+                         bool useM2M);
+    ScaledFrame *getScaledFrame(const v4l2_pix_format& fmt, int index,
+                                const uint8_t *data, size_t size);
+
+    void onControlChangeCallback(int v4l2_cid, int64_t value);
+    void controlEventPost(int type, int64_t value, int source);
+    void controlEventsFlush();
+
+    bool frameDeliver(int index, int size, const timeval& timestamp);
+    bool onFrameDoneCallback(int index, int size, const timeval& timestamp);
 };
 
 typedef std::shared_ptr<CameraHandler> CameraHandlerPtr;
@@ -12,8 +12,9 @@
 
 using XenBackend::Exception;
 
-CameraManager::CameraManager():
-    mLog("CameraManager")
+CameraManager::CameraManager(const Config& config):
+    mLog("CameraManager"),
+    mConfig(config)
 {
 }
 
@@ -23,7 +24,7 @@ CameraManager::~CameraManager()
 
 CameraHandlerPtr CameraManager::getNewCameraHandler(const std::string devName)
 {
-    return CameraHandlerPtr(new CameraHandler(devName));
+    return CameraHandlerPtr(new CameraHandler(devName, mConfig));
 }
 
 CameraHandlerPtr CameraManager::getCameraHandler(std::string uniqueId)
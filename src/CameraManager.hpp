@@ -13,11 +13,12 @@
 #include <xen/be/Log.hpp>
 
 #include "CameraHandler.hpp"
+#include "Config.hpp"
 
 class CameraManager
 {
 public:
-    CameraManager();
+    CameraManager(const Config& config);
     ~CameraManager();
 
     CameraHandlerPtr getCameraHandler(std::string uniqueId);
@@ -26,6 +27,8 @@ private:
     XenBackend::Log mLog;
     std::mutex mLock;
 
+    Config mConfig;
+
     std::unordered_map<std::string, CameraHandlerWeakPtr> mCameraHandlers;
 
     CameraHandlerPtr getNewCameraHandler(const std::string devName);
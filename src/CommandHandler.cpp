@@ -7,7 +7,7 @@
  * Copyright (C) 2018 EPAM Systems Inc.
  */
 
-#include <algorithm>
+#include <chrono>
 #include <iomanip>
 
 #include <xen/be/Exception.hpp>
@@ -39,11 +39,11 @@ std::unordered_map<int, CommandHandler::CommandFn> CommandHandler::sCmdTable =
 CtrlRingBuffer::CtrlRingBuffer(EventRingBufferPtr eventBuffer,
                                domid_t domId, evtchn_port_t port,
                                grant_ref_t ref,
-                               std::string ctrls,
+                               const FrontendConfig& config,
                                CameraHandlerPtr cameraHandler) :
     RingBufferInBase<xen_cameraif_back_ring, xen_cameraif_sring,
                      xencamera_req, xencamera_resp>(domId, port, ref),
-    mCommandHandler(domId, eventBuffer, ctrls, cameraHandler),
+    mCommandHandler(domId, eventBuffer, config, cameraHandler),
     mLog("CamCtrlRing")
 {
     LOG(mLog, DEBUG) << "Create ctrl ring buffer";
@@ -75,18 +75,26 @@ EventRingBuffer::EventRingBuffer(domid_t domId, evtchn_port_t port,
 
 CommandHandler::CommandHandler(domid_t domId,
                                EventRingBufferPtr eventBuffer,
-                               std::string ctrls,
+                               const FrontendConfig& config,
                                CameraHandlerPtr cameraHandler) :
     mDomId(domId),
     mEventBuffer(eventBuffer),
 	mEventId(0),
     mCameraHandler(cameraHandler),
-    mLog("CommandHandler")
+    mLog("CommandHandler"),
+    mControlMask(0),
+    mSharing(false),
+    mSequence(0),
+    mStreaming(false),
+    mLatencyBudgetUs(0),
+    mStats {0},
+    mMailboxFull(false),
+    mGrantCopyFailed(false)
 {
     LOG(mLog, DEBUG) << "Create command handler";
 
     try {
-        init(ctrls);
+        init(config);
     } catch (...) {
         release();
         throw;
@@ -100,27 +108,77 @@ CommandHandler::~CommandHandler()
     release();
 }
 
-void CommandHandler::init(std::string ctrls)
+void CommandHandler::init(const FrontendConfig& config)
 {
-    std::stringstream ss(ctrls);
+    std::stringstream ss(config.controls);
     std::string item;
 
     while (std::getline(ss, item, XENCAMERA_LIST_SEPARATOR[0])) {
+        int type;
+
+        try {
+            type = V4L2ToXen::ctrlGetTypeXen(item);
+        } catch (const std::exception& e) {
+            LOG(mLog, WARNING) << "Skipping unknown control: " << item;
+            continue;
+        }
+
+        if (isControlAssigned(type))
+            continue;
+
         LOG(mLog, DEBUG) << "Assigned control: " << item;
-        mControls.push_back(item);
+        mControls.push_back(type);
+        mControlMask |= 1u << type;
+    }
+
+    mLatencyBudgetUs = config.latencyBudgetMs * 1000ull;
+
+    if (mLatencyBudgetUs)
+        LOG(mLog, DEBUG) << "Latency budget: " << config.latencyBudgetMs <<
+            " ms";
+
+    if (mCameraHandler->getConfig().mailbox)
+        mWorkQueue.reset(new WorkQueue("CommandWorker"));
+
+    if (mCameraHandler->getConfig().softControls)
+        mImageAdjust.reset(new ImageAdjust());
+
+    mDirectoryReader.reset(new XenGrantCopier());
+
+    /* Buffers are never mapped then, so there is nothing to cache. */
+    if (mCameraHandler->getConfig().grantCopy) {
+        mGrantCopier.reset(new XenGrantCopier());
+    } else {
+        if (mCameraHandler->getConfig().grantCacheMaxBytes)
+            mGrantMapCache.reset(new GrantMapCache(
+                mDomId, mCameraHandler->getConfig().grantCacheMaxBytes));
+
+        mGrantMapBudget = config.mapBudget;
     }
 
+    if (config.sharedBuffers)
+        mSharedBuffers.reset(new SharedBuffers(mDomId,
+                                               config.sharedBuffersPublish));
+
     mCameraHandler->listenerSet(mDomId,
         CameraHandler::Listeners {
             .frame = bind(&CommandHandler::onFrameDoneCallback,
-                          this, _1, _2),
+                          this, _1, _2, _3),
             .control = bind(&CommandHandler::onCtrlChangeCallback,
                             this, _1, _2),
+            .ready = std::bind(&CommandHandler::isReady, this),
+            .shared = mSharedBuffers ?
+                CameraHandler::SharedFrameListener(
+                    bind(&CommandHandler::onSharedFrameCallback,
+                         this, _1, _2, _3)) : nullptr,
         });
 }
 
 void CommandHandler::release()
 {
+    if (mSharedBuffers)
+        mCameraHandler->sharedBufRelease(mDomId);
+
     mCameraHandler->listenerReset(mDomId);
 }
 
@@ -169,6 +227,11 @@ int CommandHandler::processCommand(const xencamera_req& req,
 void CommandHandler::configSet(const xencamera_req& req,
                                xencamera_resp& resp)
 {
+    /* They are mapped at the size of the current format. */
+    if (mBuffers.size())
+        throw XenBackend::Exception(
+            "Can't change format while buffers are in use", EBUSY);
+
     mCameraHandler->configSet(mDomId, req, resp);
 }
 
@@ -200,6 +263,63 @@ void CommandHandler::bufRequest(const xencamera_req& req,
                                 xencamera_resp& resp)
 {
     mCameraHandler->bufRequest(mDomId, req, resp);
+
+    if (mSharedBuffers)
+        sharedBufRequest(req, resp);
+}
+
+void CommandHandler::sharedBufRequest(const xencamera_req& req,
+                                      xencamera_resp& resp)
+{
+    /* Whatever was shared in the previous cycle goes. */
+    mCameraHandler->sharedBufRelease(mDomId);
+
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+
+        mSharing = false;
+    }
+
+    mSharedBuffers->clear();
+
+    if (!req.req.buf_request.num_bufs) {
+        mCameraHandler->bufRelease(mDomId);
+        return;
+    }
+
+    int count = mCameraHandler->sharedBufRequest(mDomId);
+
+    /* The frontend uses its own buffers then. */
+    if (!count) {
+        LOG(mLog, DEBUG) << "Dom " << std::to_string(mDomId) <<
+            " can't share buffers in this configuration";
+        return;
+    }
+
+    try {
+        for (int i = 0; i < count; i++) {
+            int fd;
+            size_t size;
+
+            mCameraHandler->sharedBufGet(i, fd, size);
+            mSharedBuffers->add(i, fd, size);
+        }
+    } catch (const std::exception& e) {
+        LOG(mLog, ERROR) << "Can't share buffers with dom " <<
+            std::to_string(mDomId) << ": " << e.what();
+
+        mCameraHandler->sharedBufRelease(mDomId);
+        mSharedBuffers->clear();
+        return;
+    }
+
+    mSharedBuffers->publish();
+
+    resp.resp.buf_request.num_bufs = count;
+
+    std::lock_guard<std::mutex> lock(mLock);
+
+    mSharing = true;
 }
 
 void CommandHandler::bufCreate(const xencamera_req& req,
@@ -212,11 +332,31 @@ void CommandHandler::bufCreate(const xencamera_req& req,
         std::to_string(create->index) << " offset " <<
         std::to_string(create->plane_offset[0]);
 
-    size_t imageSize = mCameraHandler->bufGetImageSize(mDomId);
+    auto fmt = mCameraHandler->bufGetFormat(mDomId);
+    GrantCopier *copier;
+
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+
+        copier = isGrantCopy() ? mGrantCopier.get() : nullptr;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    mBuffers[create->index] = FrontendBufferPtr(
+        new FrontendBuffer(mDomId, fmt.sizeimage, req, mGrantMapCache,
+                           mGrantMapBudget, copier, mDirectoryReader.get()));
+
+    /* Mapping the grants is what takes time here. */
+    DLOG(mLog, DEBUG) << "Buffer " << std::to_string(create->index) <<
+        " mapped in " << std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count() << " us";
 
-    mBuffers[create->index] = FrontendBufferPtr(new FrontendBuffer(mDomId,
-                                                                   imageSize,
-                                                                   req));
+    if (mImageAdjust) {
+        std::lock_guard<std::mutex> lock(mLock);
+
+        mImageAdjust->setFormat(fmt);
+    }
 }
 
 void CommandHandler::bufDestroy(const xencamera_req& req,
@@ -239,13 +379,71 @@ void CommandHandler::bufDestroy(const xencamera_req& req,
 void CommandHandler::bufQueue(const xencamera_req& req,
                               xencamera_resp& resp)
 {
-    std::lock_guard<std::mutex> lock(mLock);
     size_t index = static_cast<size_t>(req.req.index.index);
 
     DLOG(mLog, DEBUG) << "Handle command [BUF QUEUE] dom " <<
         std::to_string(mDomId) << " index " << std::to_string(index);
 
-    mQueuedBuffers.push_back(index);
+    bool mailbox;
+    bool sharing;
+
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+
+        sharing = mSharing;
+
+        if (!sharing)
+            mQueuedBuffers.push_back(index);
+
+        mailbox = mMailboxFull;
+    }
+
+    /* The frontend is done with the frame: frame delivery takes our lock. */
+    if (sharing) {
+        mCameraHandler->sharedBufQueue(mDomId, index);
+        return;
+    }
+
+    /* The HW stream might be paused as nobody had buffers. */
+    mCameraHandler->streamResume();
+
+    if (mailbox) {
+        mWorkQueue->post(std::bind(&CommandHandler::mailboxDeliver, this));
+        return;
+    }
+
+    /*
+     * Frame delivery takes our lock, so do not hold it here.
+     * This is a no-op if the frontend has already got a frame.
+     */
+    if (mStreaming)
+        mCameraHandler->frameHistoryDeliver(mDomId);
+}
+
+bool CommandHandler::isReady()
+{
+    std::lock_guard<std::mutex> lock(mLock);
+
+    return mStreaming && (mSharing || !mQueuedBuffers.empty());
+}
+
+void CommandHandler::mailboxDeliver()
+{
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+
+        /* A fresher frame might have been delivered meanwhile. */
+        if (!mMailboxFull || mQueuedBuffers.empty())
+            return;
+
+        DLOG(mLog, DEBUG) << "Deliver frame from mailbox dom " <<
+            std::to_string(mDomId);
+
+        mMailboxFull = false;
+    }
+
+    /* Frame delivery takes our lock, so do not hold it here. */
+    mCameraHandler->frameHistoryDeliver(mDomId, true);
 }
 
 void CommandHandler::bufDequeue(const xencamera_req& req,
@@ -260,18 +458,49 @@ void CommandHandler::bufDequeue(const xencamera_req& req,
     mQueuedBuffers.remove(index);
 }
 
-void CommandHandler::onFrameDoneCallback(uint8_t *data, size_t size)
+bool CommandHandler::onFrameDoneCallback(const uint8_t *data, size_t size,
+                                         uint64_t timestampUs)
 {
     std::lock_guard<std::mutex> lock(mLock);
-    int index;
 
-    if (mQueuedBuffers.empty())
-        return;
+    /*
+     * The HW stream may still run for other frontends or linger after
+     * this one has stopped.
+     */
+    if (!mStreaming)
+        return false;
 
-    index = mQueuedBuffers.front();
+    if (mQueuedBuffers.empty()) {
+        mStats.droppedNoBuffer++;
+
+        /* The frame is in the camera handler's history. */
+        if (mWorkQueue)
+            mMailboxFull = true;
+
+        return false;
+    }
+
+    mMailboxFull = false;
+
+    return frameSend(data, size, timestampUs);
+}
+
+bool CommandHandler::onSharedFrameCallback(int index, size_t size,
+                                           uint64_t timestampUs)
+{
+    std::lock_guard<std::mutex> lock(mLock);
+
+    if (!mStreaming || !mSharing || isStale(timestampUs))
+        return false;
+
+    /* Added to the pool after the buffers were shared. */
+    if (!mSharedBuffers->has(index)) {
+        mStats.droppedNoBuffer++;
+        return false;
+    }
 
     DLOG(mLog, DEBUG) << "Send event [FRAME] dom " <<
-        std::to_string(mDomId) << " index " << std::to_string(index);
+        std::to_string(mDomId) << " shared index " << std::to_string(index);
 
     xencamera_evt event {0};
 
@@ -281,9 +510,134 @@ void CommandHandler::onFrameDoneCallback(uint8_t *data, size_t size)
     event.evt.frame_avail.seq_num = mSequence++;
     event.id = mEventId++;
 
-    mBuffers[index]->copyBuffer(data, size);
+    mEventBuffer->sendEvent(event);
+
+    mStats.delivered++;
+
+    return true;
+}
+
+/*
+ * Drop frames which are too old by now. The age can only be told if the
+ * driver stamps frames with CLOCK_MONOTONIC, as vb2 based ones do.
+ */
+bool CommandHandler::isStale(uint64_t timestampUs)
+{
+    if (!mLatencyBudgetUs || !timestampUs ||
+        !mCameraHandler->isTimestampMonotonic())
+        return false;
+
+    timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    uint64_t nowUs = now.tv_sec * 1000000ull + now.tv_nsec / 1000;
+
+    if (nowUs <= timestampUs + mLatencyBudgetUs)
+        return false;
+
+    DLOG(mLog, DEBUG) << "Drop stale frame dom " <<
+        std::to_string(mDomId) << " age " <<
+        std::to_string(nowUs - timestampUs) << " us";
+
+    mStats.droppedStale++;
+
+    return true;
+}
+
+bool CommandHandler::frameSend(const uint8_t *data, size_t size,
+                               uint64_t timestampUs)
+{
+    if (isStale(timestampUs))
+        return false;
+
+    int index = mQueuedBuffers.front();
+    auto start = std::chrono::steady_clock::now();
+    bool copied;
+
+    if (mImageAdjust && isGrantCopy()) {
+        if (mAdjusted.size() < size)
+            mAdjusted.resize(size);
+
+        mImageAdjust->copy(data, mAdjusted.data(), size);
+        copied = mBuffers[index]->copyBuffer(mAdjusted.data(), size);
+    } else if (mImageAdjust) {
+        copied = mBuffers[index]->copyBuffer(data, size, *mImageAdjust);
+    } else {
+        copied = mBuffers[index]->copyBuffer(data, size);
+    }
+
+    if (isGrantCopy() && !mBuffers[index]->isGrantCopy())
+        grantCopyDisable();
+
+    /* The buffer stays queued for the frames to come. */
+    if (!copied) {
+        mStats.droppedCopyFailed++;
+        return false;
+    }
+
+    mStats.copyUs += std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    mStats.copiedBytes += size;
+
+    DLOG(mLog, DEBUG) << "Send event [FRAME] dom " <<
+        std::to_string(mDomId) << " index " << std::to_string(index);
+
+    xencamera_evt event {0};
+
+    event.type = XENCAMERA_EVT_FRAME_AVAIL;
+    event.evt.frame_avail.index = index;
+    event.evt.frame_avail.used_sz = size;
+    event.evt.frame_avail.seq_num = mSequence++;
+    event.id = mEventId++;
 
     mEventBuffer->sendEvent(event);
+
+    mStats.delivered++;
+
+    return true;
+}
+
+/* Must be called with mLock held. */
+bool CommandHandler::isGrantCopy()
+{
+    return mGrantCopier && !mGrantCopyFailed;
+}
+
+/*
+ * Must be called with mLock held. GNTTABOP_copy can't pin every source,
+ * e.g. V4L2 MMAP buffers of PFNMAP memory: once it fails, it would fail
+ * for every frame, so the frontend's buffers are mapped instead.
+ */
+void CommandHandler::grantCopyDisable()
+{
+    LOG(mLog, WARNING) << "Grant copy to dom " << std::to_string(mDomId) <<
+        " failed, map its buffers instead";
+
+    mGrantCopyFailed = true;
+
+    for (auto& buffer : mBuffers)
+        buffer.second->grantCopyDisable();
+}
+
+void CommandHandler::statsLog()
+{
+    LOG(mLog, INFO) << "Dom " << std::to_string(mDomId) << " frames: " <<
+        "delivered " << mStats.delivered <<
+        ", dropped (no buffer) " << mStats.droppedNoBuffer <<
+        ", dropped (stale) " << mStats.droppedStale <<
+        ", dropped (copy failed) " << mStats.droppedCopyFailed;
+
+    /* Compares delivery by grant copy and by mapping at the frame size. */
+    if (mStats.delivered)
+        LOG(mLog, INFO) << "Dom " << std::to_string(mDomId) << " " <<
+            (isGrantCopy() ? "grant copy" : "map and copy") << ": " <<
+            mStats.copyUs / mStats.delivered << " us per frame of " <<
+            mStats.copiedBytes / mStats.delivered << " bytes";
+
+    if (mGrantMapBudget)
+        LOG(mLog, INFO) << "Dom " << std::to_string(mDomId) << " mapped " <<
+            mGrantMapBudget->getMappedBytes(mDomId) << " bytes";
 }
 
 void CommandHandler::ctrlEnum(const xencamera_req& req,
@@ -303,6 +657,19 @@ void CommandHandler::ctrlEnum(const xencamera_req& req,
     if (index >= mControls.size())
         throw XenBackend::Exception("No more assigned controls", EINVAL);
 
+    if (mImageAdjust) {
+        auto range = ImageAdjust::getRange(mControls[index]);
+
+        resp.resp.ctrl_enum.index = index;
+        resp.resp.ctrl_enum.type = mControls[index];
+        resp.resp.ctrl_enum.flags = 0;
+        resp.resp.ctrl_enum.min = range.min;
+        resp.resp.ctrl_enum.max = range.max;
+        resp.resp.ctrl_enum.step = range.step;
+        resp.resp.ctrl_enum.def_val = range.def;
+        return;
+    }
+
     mCameraHandler->ctrlEnum(mDomId, req, resp, mControls[index]);
 }
 
@@ -314,14 +681,19 @@ void CommandHandler::ctrlSet(const xencamera_req& req,
     DLOG(mLog, DEBUG) << "Handle command [SET CTRL] dom " <<
         std::to_string(mDomId);
 
-    auto ctrlName = V4L2ToXen::ctrlGetNameXen(type);
-
-    if (std::find(mControls.begin(), mControls.end(), ctrlName) ==
-        mControls.end())
+    if (!isControlAssigned(type))
         throw XenBackend::Exception("Wrong control type " +
                                     std::to_string(type), EINVAL);
 
-    mCameraHandler->ctrlSet(mDomId, req, resp, ctrlName);
+    /* Only this frontend sees the change: no events for the rest. */
+    if (mImageAdjust) {
+        std::lock_guard<std::mutex> lock(mLock);
+
+        mImageAdjust->setValue(type, req.req.ctrl_value.value);
+        return;
+    }
+
+    mCameraHandler->ctrlSet(mDomId, req, resp, type);
 }
 
 void CommandHandler::ctrlGet(const xencamera_req& req,
@@ -332,12 +704,19 @@ void CommandHandler::ctrlGet(const xencamera_req& req,
     DLOG(mLog, DEBUG) << "Handle command [GET CTRL] dom " <<
         std::to_string(mDomId);
 
-    auto ctrlName = V4L2ToXen::ctrlGetNameXen(type);
-
-    if (std::find(mControls.begin(), mControls.end(), ctrlName) ==
-        mControls.end())
+    if (!isControlAssigned(type))
         throw XenBackend::Exception("Wrong control type " +
                                     std::to_string(type), EINVAL);
+
+    if (mImageAdjust) {
+        std::lock_guard<std::mutex> lock(mLock);
+
+        resp.resp.ctrl_value.type = type;
+        resp.resp.ctrl_value.value = mImageAdjust->getValue(type);
+        return;
+    }
+
+    mCameraHandler->ctrlGet(mDomId, req, resp, type);
 }
 
 void CommandHandler::streamStart(const xencamera_req& req,
@@ -345,19 +724,44 @@ void CommandHandler::streamStart(const xencamera_req& req,
 {
     mSequence = 0;
     mCameraHandler->streamStart(mDomId, req, resp);
+
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+
+        mStreaming = true;
+    }
+
+    /* Buffers are usually queued before the stream is started. */
+    mCameraHandler->frameHistoryDeliver(mDomId);
 }
 
 void CommandHandler::streamStop(const xencamera_req& req,
                                 xencamera_resp& resp)
 {
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+
+        mStreaming = false;
+        mMailboxFull = false;
+
+        statsLog();
+        mStats = {0};
+    }
+
+    /* Like STREAMOFF, this gives the frontend's buffers back. */
+    if (mSharedBuffers)
+        mCameraHandler->sharedBufQueueAll(mDomId);
+
     mCameraHandler->streamStop(mDomId, req, resp);
 }
 
-void CommandHandler::onCtrlChangeCallback(const std::string name, int64_t value)
+void CommandHandler::onCtrlChangeCallback(int type, int64_t value)
 {
-    auto ctrl = std::find(mControls.begin(), mControls.end(), name);
+    /* HW controls are not what the frontend controls then. */
+    if (mImageAdjust)
+        return;
 
-    if (ctrl == mControls.end()) {
+    if (!isControlAssigned(type)) {
         DLOG(mLog, DEBUG) << "Not supported control for change event, skipping";
         return;
     }
@@ -368,7 +772,7 @@ void CommandHandler::onCtrlChangeCallback(const std::string name, int64_t value)
     xencamera_evt event {0};
 
     event.type = XENCAMERA_EVT_CTRL_CHANGE;
-    event.evt.ctrl_value.type = V4L2ToXen::ctrlGetTypeXen(name);
+    event.evt.ctrl_value.type = type;
     event.evt.ctrl_value.value = value;
     event.id = mEventId++;
 
@@ -18,6 +18,11 @@
 #include <xen/io/cameraif.h>
 
 #include "CameraHandler.hpp"
+#include "GrantCopier.hpp"
+#include "GrantMapCache.hpp"
+#include "ImageAdjust.hpp"
+#include "SharedBuffers.hpp"
+#include "WorkQueue.hpp"
 
 class EventRingBuffer : public XenBackend::RingBufferOutBase<
                         xencamera_event_page, xencamera_evt>
@@ -36,7 +41,8 @@ class CommandHandler
 {
 public:
     CommandHandler(domid_t domId, EventRingBufferPtr eventBuffer,
-                   std::string ctrls, CameraHandlerPtr cameraHandler);
+                   const FrontendConfig& config,
+                   CameraHandlerPtr cameraHandler);
     ~CommandHandler();
 
     int processCommand(const xencamera_req& req, xencamera_resp& resp);
@@ -58,8 +64,24 @@ private:
     XenBackend::Log mLog;
     std::mutex mLock;
 
-    std::vector<std::string> mControls;
+    /*
+     * Xen types of the controls assigned, in the order they are
+     * enumerated, and the same as a mask of (1 << type).
+     */
+    std::vector<int> mControls;
+    uint32_t mControlMask;
+
+    /* Software image controls, if enabled: protected with mLock. */
+    ImageAdjustPtr mImageAdjust;
+    /* Frames are adjusted here first if they are copied by grant. */
+    std::vector<uint8_t> mAdjusted;
+    /* Must outlive the buffers. */
+    GrantCopierPtr mGrantCopier;
+    /* Reads page directories, whether frames are copied or not. */
+    GrantCopierPtr mDirectoryReader;
     std::unordered_map<int, FrontendBufferPtr> mBuffers;
+    GrantMapCachePtr mGrantMapCache;
+    GrantMapBudgetPtr mGrantMapBudget;
 
     /*
      * Buffer management
@@ -72,9 +94,46 @@ private:
      */
     std::list<int> mQueuedBuffers;
 
+    /*
+     * With shared buffers the frontend reads frames from the V4L2 buffers:
+     * frame events carry their indices and queueing a buffer gives it
+     * back. mSharing tells if buffers are shared in this buffer request
+     * cycle, otherwise the frontend's own buffers are used.
+     */
+    SharedBuffersPtr mSharedBuffers;
+    bool mSharing;
+
     uint32_t mSequence;
+    bool mStreaming;
+
+    /* Frames older than this are not delivered, 0 if no limit. */
+    uint64_t mLatencyBudgetUs;
+
+    struct Stats {
+        uint64_t delivered;
+        uint64_t droppedNoBuffer;
+        uint64_t droppedStale;
+        uint64_t droppedCopyFailed;
+        /* Time spent copying delivered frames into frontend buffers. */
+        uint64_t copyUs;
+        uint64_t copiedBytes;
+    };
+
+    Stats mStats;
 
-    void init(std::string ctrls);
+    /*
+     * Mailbox delivery: a frame came while no buffer was queued. The
+     * camera handler keeps it in its history and the worker delivers
+     * the latest frame from there once a buffer is queued.
+     */
+    bool mMailboxFull;
+    /* A grant copy failed: buffers are mapped instead. */
+    bool mGrantCopyFailed;
+
+    /* Must be the last one, so it is stopped before the rest goes away. */
+    WorkQueuePtr mWorkQueue;
+
+    void init(const FrontendConfig& config);
     void release();
 
     void configSet(const xencamera_req& aReq, xencamera_resp& aResp);
@@ -97,8 +156,24 @@ private:
     void streamStart(const xencamera_req& aReq, xencamera_resp& aResp);
     void streamStop(const xencamera_req& aReq, xencamera_resp& aResp);
 
-    void onFrameDoneCallback(uint8_t *data, size_t size);
-    void onCtrlChangeCallback(const std::string name, int64_t value);
+    void sharedBufRequest(const xencamera_req& aReq, xencamera_resp& aResp);
+
+    bool isStale(uint64_t timestampUs);
+    bool frameSend(const uint8_t *data, size_t size, uint64_t timestampUs);
+    void statsLog();
+    bool isGrantCopy();
+    void grantCopyDisable();
+    void mailboxDeliver();
+    bool isReady();
+
+    bool onFrameDoneCallback(const uint8_t *data, size_t size,
+                             uint64_t timestampUs);
+    bool onSharedFrameCallback(int index, size_t size, uint64_t timestampUs);
+    bool isControlAssigned(int type) const {
+        return type >= 0 && type < 32 && (mControlMask & (1u << type));
+    }
+
+    void onCtrlChangeCallback(int type, int64_t value);
 };
 
 /***************************************************************************//**
@@ -110,7 +185,8 @@ class CtrlRingBuffer : public XenBackend::RingBufferInBase<xen_cameraif_back_rin
 public:
     CtrlRingBuffer(EventRingBufferPtr eventBuffer, domid_t domId,
                    evtchn_port_t port, grant_ref_t ref,
-                   std::string ctrls, CameraHandlerPtr cameraHandler);
+                   const FrontendConfig& config,
+                   CameraHandlerPtr cameraHandler);
 
 private:
     CommandHandler mCommandHandler;
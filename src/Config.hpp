@@ -0,0 +1,183 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2018 EPAM Systems Inc.
+ */
+#ifndef SRC_CONFIG_HPP_
+#define SRC_CONFIG_HPP_
+
+#include <map>
+#include <string>
+
+#include "GrantMapBudget.hpp"
+#include "SharedBuffers.hpp"
+
+/* Backend configuration, filled in from the command line. */
+struct Config {
+    /*
+     * V4L2 mem2mem device to offload scaling and format conversion to.
+     * If empty or the device can't do the job, this is done by the CPU.
+     */
+    std::string m2mDevice;
+
+    /*
+     * When several frontends read the same frame it can be copied once
+     * into a cached backend buffer, so the V4L2 buffer is given back to
+     * the driver right away and the frontends read cached memory. In auto
+     * mode this is done if measured bandwidths show it pays off.
+     */
+    enum class Staging {
+        AUTO,
+        ALWAYS,
+        NEVER,
+    };
+
+    Staging staging = Staging::AUTO;
+
+    /*
+     * Memory the frames kept by the backend may take, so frontends
+     * joining a running stream get a frame immediately. It must fit at
+     * least two frames, the latest and the next one being copied, or
+     * none are kept. Zero disables the history.
+     */
+    size_t historyMaxBytes = 0;
+
+    /*
+     * Keep the latest frame a frontend had no buffer for and deliver it
+     * as soon as the frontend queues one, instead of dropping it.
+     */
+    bool mailbox = false;
+
+    /*
+     * Frames older than this at the time they are copied to a frontend
+     * are dropped, 0 means no limit. Can be overridden per frontend.
+     */
+    unsigned int latencyBudgetMs = 0;
+
+    /*
+     * Keep the HW stream running and its buffers allocated for this many ms
+     * after the last frontend has stopped streaming, so a frontend
+     * restarting its pipeline reattaches instantly. 0 stops immediately.
+     */
+    unsigned int lingerMs = 0;
+
+    /*
+     * Pause the HW stream after this many frames in a row for which no
+     * frontend had a buffer queued and resume it once one is queued.
+     * 0 never pauses.
+     */
+    unsigned int idleFrames = 0;
+
+    /*
+     * Bandwidth in Mbit/s the camera bus can carry video at, used to pick
+     * a HW format which sustains the requested frame rate. 0 detects it
+     * for USB cameras and assumes no limit for the rest.
+     */
+    unsigned int busBandwidthMbps = 0;
+
+    /*
+     * Emulate brightness, contrast, saturation and hue per frontend in
+     * software instead of setting the HW controls shared by all of them.
+     */
+    bool softControls = false;
+
+    /*
+     * Memory of frontend buffers kept mapped after they are destroyed, per
+     * frontend, so recreating the same buffers needs no grant mapping.
+     * 0 unmaps buffers as soon as they are destroyed.
+     */
+    size_t grantCacheMaxBytes = 0;
+
+    /*
+     * Map frontend buffers when the first frame is delivered to them
+     * rather than when they are created, within address space shared by
+     * all the frontends, and unmap buffers not used for idleMs. 0 means
+     * no limit and no idle unmapping respectively.
+     */
+    struct MapBudget {
+        bool enabled = false;
+        size_t maxBytes = 0;
+        unsigned int idleMs = 0;
+    };
+
+    MapBudget mapBudget;
+
+    /*
+     * Deliver frames with hypervisor grant copies into the frontends'
+     * pages instead of mapping the buffers and copying with the CPU, which
+     * saves the mappings and the TLB flushes when buffers are unmapped.
+     * The grant cache and the map budget don't apply then, not even once
+     * a copy failed, e.g. from PFNMAP camera memory the hypervisor can't
+     * take, and the frontend's buffers are mapped instead.
+     */
+    bool grantCopy = false;
+
+    /*
+     * Capture into cached memfd memory the backend allocates and imports
+     * into V4L2 as DMABUFs through /dev/udmabuf, rather than into driver
+     * memory, which may be uncached. The same fds go to the mem2mem
+     * device. Cameras which can't import DMABUFs keep driver buffers.
+     */
+    bool udmabuf = false;
+
+    /*
+     * Offer frontends to read frames right from the V4L2 buffers granted
+     * to them, instead of getting a copy in buffers of their own.
+     * The buffers are granted writable, so a frontend is only given them
+     * if it is the camera's only one when it requests buffers. Frontends
+     * which come later are never refused, but a frontend already sharing
+     * keeps its grants until its next buffer request.
+     */
+    bool sharedBuffers = false;
+
+    /*
+     * Frontends trust each other: several of them can share the buffers
+     * of a camera, each able to change the frames the others get.
+     */
+    bool sharedBuffersTrusted = false;
+
+    /*
+     * Number of V4L2 buffers of a camera. In adaptive mode this is the
+     * initial number: the pool grows up to maxBuffers if frames are held
+     * for close to the frame period and shrinks back when the camera is
+     * idle, but never below what the driver needs.
+     */
+    struct BufferDepth {
+        unsigned int numBuffers = 4;
+        bool adaptive = false;
+        unsigned int maxBuffers = 8;
+    };
+
+    BufferDepth bufferDepth;
+    /* Per camera overrides, camera unique id to depth. */
+    std::map<std::string, BufferDepth> cameraBufferDepths;
+
+    const BufferDepth& getBufferDepth(const std::string& uniqueId) const {
+        auto it = cameraBufferDepths.find(uniqueId);
+
+        if (it != cameraBufferDepths.end())
+            return it->second;
+
+        return bufferDepth;
+    }
+};
+
+/* Per frontend configuration, read from XenStore. */
+struct FrontendConfig {
+    /* Controls assigned to the frontend. */
+    std::string controls;
+
+    unsigned int latencyBudgetMs;
+
+    /* Shared by all the frontends, if enabled. */
+    GrantMapBudgetPtr mapBudget;
+
+    /* Both the backend and the frontend support shared buffers. */
+    bool sharedBuffers;
+    /* Tells the frontend the buffers shared with it. */
+    SharedBuffers::PublishCallback sharedBuffersPublish;
+};
+
+#endif /* SRC_CONFIG_HPP_ */
@@ -0,0 +1,257 @@
+// SPDX-License-Identifier: GPL-2.0
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2018 EPAM Systems Inc.
+ */
+
+#include <algorithm>
+#include <cmath>
+
+#include "FormatNegotiator.hpp"
+
+FormatNegotiator::FormatNegotiator(const std::vector<Camera::Format>& formats,
+                                   uint64_t busBandwidth) :
+    mLog("FormatNegotiator"),
+    mFormats(formats),
+    mBusBandwidth(busBandwidth)
+{
+}
+
+bool FormatNegotiator::isCompressed(uint32_t pixelFormat)
+{
+    switch (pixelFormat) {
+    case V4L2_PIX_FMT_MJPEG:
+    case V4L2_PIX_FMT_JPEG:
+    case V4L2_PIX_FMT_H264:
+    case V4L2_PIX_FMT_HEVC:
+    case V4L2_PIX_FMT_MPEG:
+    case V4L2_PIX_FMT_VP8:
+    case V4L2_PIX_FMT_VP9:
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+uint64_t FormatNegotiator::getFrameSize(uint32_t pixelFormat,
+                                        uint32_t width, uint32_t height)
+{
+    uint64_t pixels = static_cast<uint64_t>(width) * height;
+
+    if (isCompressed(pixelFormat))
+        return pixels * 2 / cCompressionRatio;
+
+    switch (pixelFormat) {
+    case V4L2_PIX_FMT_GREY:
+        return pixels;
+
+    case V4L2_PIX_FMT_NV12:
+    case V4L2_PIX_FMT_NV21:
+    case V4L2_PIX_FMT_YUV420:
+    case V4L2_PIX_FMT_YVU420:
+        return pixels * 3 / 2;
+
+    case V4L2_PIX_FMT_RGB24:
+    case V4L2_PIX_FMT_BGR24:
+        return pixels * 3;
+
+    case V4L2_PIX_FMT_RGB32:
+    case V4L2_PIX_FMT_BGR32:
+    case V4L2_PIX_FMT_ABGR32:
+    case V4L2_PIX_FMT_XBGR32:
+    case V4L2_PIX_FMT_ARGB32:
+    case V4L2_PIX_FMT_XRGB32:
+        return pixels * 4;
+
+    default:
+        /* YUYV and friends, NV16, RGB565 etc. */
+        return pixels * 2;
+    }
+}
+
+const Camera::FormatSize *FormatNegotiator::getFormatSize(
+    const Camera::Format& format, uint32_t width, uint32_t height)
+{
+    for (auto const& size: format.size)
+        if (static_cast<uint32_t>(size.width) == width &&
+            static_cast<uint32_t>(size.height) == height)
+            return &size;
+
+    return nullptr;
+}
+
+float FormatNegotiator::getMaxFps(const Camera::FormatSize& size)
+{
+    float maxFps = 0;
+
+    /* These are frame intervals. */
+    for (auto const& interval: size.fps)
+        if (interval.numerator)
+            maxFps = std::max(maxFps, static_cast<float>(interval.denominator) /
+                              interval.numerator);
+
+    return maxFps;
+}
+
+float FormatNegotiator::getSustainedFps(uint32_t pixelFormat,
+                                        const Camera::FormatSize& size)
+{
+    float fps = getMaxFps(size);
+
+    if (!mBusBandwidth)
+        return fps;
+
+    uint64_t frameSize = getFrameSize(pixelFormat, size.width, size.height);
+
+    return std::min(fps, static_cast<float>(mBusBandwidth) / frameSize);
+}
+
+bool FormatNegotiator::negotiate(const v4l2_pix_format& fmt, float fps,
+                                 ConvertCheck isConvertible, Choice& choice)
+{
+    const Camera::FormatSize *requested = nullptr;
+
+    for (auto const& format: mFormats)
+        if (format.pixelFormat == fmt.pixelformat)
+            requested = getFormatSize(format, fmt.width, fmt.height);
+
+    if (!requested)
+        return false;
+
+    if (!fps)
+        fps = getMaxFps(*requested);
+
+    /* A frame or so per second less is fine. */
+    float wanted = fps * 0.95f;
+    int bestCost = 0;
+    bool found = false;
+
+    for (auto const& format: mFormats) {
+        auto size = getFormatSize(format, fmt.width, fmt.height);
+
+        if (!size)
+            continue;
+
+        bool converted = format.pixelFormat != fmt.pixelformat;
+
+        if (converted && !isConvertible(format.pixelFormat, fmt))
+            continue;
+
+        /* Prefer no conversion, then raw conversion, then decoding. */
+        int cost = !converted ? 0 : isCompressed(format.pixelFormat) ? 2 : 1;
+        float sustained = getSustainedFps(format.pixelFormat, *size);
+
+        DLOG(mLog, DEBUG) << format.description << " " << fmt.width << "x" <<
+            fmt.height << " sustains " << sustained << " fps";
+
+        bool better;
+
+        if (!found)
+            better = true;
+        else if ((sustained >= wanted) != (choice.fps >= wanted))
+            better = sustained >= wanted;
+        else if (sustained >= wanted)
+            better = cost < bestCost;
+        else
+            better = sustained > choice.fps ||
+                (sustained == choice.fps && cost < bestCost);
+
+        if (better) {
+            choice = { format.pixelFormat, sustained, converted };
+            bestCost = cost;
+            found = true;
+        }
+    }
+
+    if (found && choice.converted)
+        LOG(mLog, DEBUG) << "Run HW at " << choice.pixelFormat <<
+            " for " << choice.fps << " fps instead of " << fmt.pixelformat <<
+            " to deliver " << fps << " fps";
+
+    return found;
+}
+
+float FormatNegotiator::getSizeDistance(const v4l2_pix_format& fmt,
+                                        const Camera::FormatSize& size)
+{
+    float area = static_cast<float>(size.width) * size.height;
+    float wanted = static_cast<float>(fmt.width) * fmt.height;
+    float aspect = static_cast<float>(size.width) / size.height;
+    float wantedAspect = static_cast<float>(fmt.width) / fmt.height;
+
+    /* Octaves of area plus relative aspect ratio mismatch. */
+    float distance = std::fabs(std::log2(area / wanted)) +
+        std::fabs(aspect - wantedAspect) / wantedAspect;
+
+    /* Bigger frames can be scaled down, smaller ones can't be scaled up. */
+    if (static_cast<uint32_t>(size.width) < fmt.width ||
+        static_cast<uint32_t>(size.height) < fmt.height)
+        distance += 0.5f;
+
+    return distance;
+}
+
+bool FormatNegotiator::findNearest(const v4l2_pix_format& fmt,
+                                   ConvertCheck isConvertible, Match& match)
+{
+    if (!fmt.width || !fmt.height)
+        return false;
+
+    float bestFps = 0;
+
+    for (auto const& format: mFormats)
+        for (auto const& size: format.size)
+            bestFps = std::max(bestFps,
+                               getSustainedFps(format.pixelFormat, size));
+
+    float bestScore = 0;
+    bool found = false;
+
+    for (auto const& format: mFormats) {
+        bool same = format.pixelFormat == fmt.pixelformat;
+
+        for (auto const& size: format.size) {
+            v4l2_pix_format out = fmt;
+
+            out.width = size.width;
+            out.height = size.height;
+
+            /* Formats not deliverable as asked are the last resort. */
+            bool converted = !same &&
+                isConvertible(format.pixelFormat, out);
+            float cost = same ? 0 : !converted ? 3 :
+                isCompressed(format.pixelFormat) ? 1 : 0.5f;
+            float fps = getSustainedFps(format.pixelFormat, size);
+            float score = 4 * getSizeDistance(fmt, size) + cost +
+                (bestFps ? 2 * (1 - fps / bestFps) : 0);
+
+            if (found && score >= bestScore)
+                continue;
+
+            v4l2_fract rate = { 0, 1 };
+
+            for (auto const& interval: size.fps)
+                if (interval.numerator && static_cast<uint64_t>(
+                        interval.denominator) * rate.denominator >
+                    static_cast<uint64_t>(rate.numerator) *
+                        interval.numerator)
+                    rate = { interval.denominator, interval.numerator };
+
+            match = {
+                format.pixelFormat,
+                same || converted ? fmt.pixelformat : format.pixelFormat,
+                static_cast<uint32_t>(size.width),
+                static_cast<uint32_t>(size.height),
+                rate
+            };
+
+            bestScore = score;
+            found = true;
+        }
+    }
+
+    return found;
+}
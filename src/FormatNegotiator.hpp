@@ -0,0 +1,90 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2018 EPAM Systems Inc.
+ */
+#ifndef SRC_FORMATNEGOTIATOR_HPP_
+#define SRC_FORMATNEGOTIATOR_HPP_
+
+#include <functional>
+
+#include <xen/be/Log.hpp>
+
+#include "Camera.hpp"
+
+/*
+ * Picks the HW format to run the camera at for a frontend's request.
+ * Drivers silently lower the frame rate if the bus can't carry the
+ * requested format, e.g. UVC cameras only make 1080p30 over USB 2.0 in
+ * MJPEG. So every format the camera offers at the requested size is rated
+ * by the frame rate it sustains on the bus and the requested one is only
+ * replaced if another format the backend can convert from does better.
+ */
+class FormatNegotiator
+{
+public:
+    /* HW pixel format, frontend's format: true if the backend converts. */
+    typedef std::function<bool(uint32_t, const v4l2_pix_format&)>
+        ConvertCheck;
+
+    struct Choice {
+        uint32_t pixelFormat;
+        /* Frame rate the choice sustains, frames per second. */
+        float fps;
+        bool converted;
+    };
+
+    FormatNegotiator(const std::vector<Camera::Format>& formats,
+                     uint64_t busBandwidth);
+
+    /*
+     * Returns false if the camera doesn't offer the requested size,
+     * fps of 0 means as fast as the requested format is listed for.
+     */
+    bool negotiate(const v4l2_pix_format& fmt, float fps,
+                   ConvertCheck isConvertible, Choice& choice);
+
+    /* The closest configuration the camera can deliver. */
+    struct Match {
+        uint32_t hwPixelFormat;
+        /* Format the frontend gets, converted from the HW one if needed. */
+        uint32_t pixelFormat;
+        uint32_t width;
+        uint32_t height;
+        /* Highest frame rate listed for the size. */
+        v4l2_fract frameRate;
+    };
+
+    /*
+     * Scores every size of every format by the distance to the requested
+     * size, the frame rate it sustains and the cost of converting it to
+     * the requested format: returns false if the camera lists nothing.
+     */
+    bool findNearest(const v4l2_pix_format& fmt, ConvertCheck isConvertible,
+                     Match& match);
+
+    static bool isCompressed(uint32_t pixelFormat);
+    /* Estimated size of a frame, compressed ones included. */
+    static uint64_t getFrameSize(uint32_t pixelFormat,
+                                 uint32_t width, uint32_t height);
+
+private:
+    /* Typical MJPEG compression of a YUYV frame. */
+    static const unsigned int cCompressionRatio = 6;
+
+    XenBackend::Log mLog;
+
+    const std::vector<Camera::Format>& mFormats;
+    uint64_t mBusBandwidth;
+
+    const Camera::FormatSize *getFormatSize(const Camera::Format& format,
+                                            uint32_t width, uint32_t height);
+    float getMaxFps(const Camera::FormatSize& size);
+    float getSustainedFps(uint32_t pixelFormat, const Camera::FormatSize& size);
+    static float getSizeDistance(const v4l2_pix_format& fmt,
+                                 const Camera::FormatSize& size);
+};
+
+#endif /* SRC_FORMATNEGOTIATOR_HPP_ */
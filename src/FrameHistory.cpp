@@ -0,0 +1,79 @@
+// SPDX-License-Identifier: GPL-2.0
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2018 EPAM Systems Inc.
+ */
+
+#include <cstring>
+
+#include "FrameHistory.hpp"
+
+FrameHistory::FrameHistory(size_t maxBytes) :
+    mMaxBytes(maxBytes)
+{
+}
+
+void FrameHistory::push(const uint8_t *data, size_t size, uint64_t sequence,
+                        uint64_t timestampUs)
+{
+    size_t maxFrames = size ? mMaxBytes / size : 0;
+
+    /*
+     * The latest frame stays while the next one is written, so unless
+     * two fit no frames are kept at all.
+     */
+    if (maxFrames < 2) {
+        mFrames.clear();
+        mLatest.reset();
+        return;
+    }
+
+    /* Frame size might have grown since: let the extra frames go. */
+    if (mFrames.size() > maxFrames)
+        mFrames.resize(maxFrames);
+
+    std::shared_ptr<Frame> frame;
+
+    /* The latest frame is held by mLatest, so it is never overwritten. */
+    for (auto& slot : mFrames)
+        if (slot.use_count() == 1) {
+            frame = slot;
+            break;
+        }
+
+    /*
+     * Otherwise a new frame if there is room for it. If not, all the
+     * frames are held and this one is skipped: the latest stays.
+     */
+    if (!frame) {
+        if (mFrames.size() >= maxFrames)
+            return;
+
+        frame = std::make_shared<Frame>();
+        mFrames.push_back(frame);
+    }
+
+    if (frame->data.size() < size)
+        frame->data.resize(size);
+
+    memcpy(frame->data.data(), data, size);
+
+    frame->size = size;
+    frame->sequence = sequence;
+    frame->timestampUs = timestampUs;
+
+    mLatest = frame;
+}
+
+FramePtr FrameHistory::getLatest() const
+{
+    return mLatest;
+}
+
+void FrameHistory::clear()
+{
+    mFrames.clear();
+    mLatest.reset();
+}
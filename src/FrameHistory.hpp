@@ -0,0 +1,56 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2018 EPAM Systems Inc.
+ */
+#ifndef SRC_FRAMEHISTORY_HPP_
+#define SRC_FRAMEHISTORY_HPP_
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/* A copy of a HW frame kept by the backend. */
+struct Frame {
+    std::vector<uint8_t> data;
+    size_t size;
+    uint64_t sequence;
+    /* Capture time, CLOCK_MONOTONIC, or 0 if the clock is unknown. */
+    uint64_t timestampUs;
+};
+
+typedef std::shared_ptr<const Frame> FramePtr;
+
+/*
+ * The most recent HW frame kept by the backend, so frontends joining a
+ * running stream can be given a frame right away instead of waiting for
+ * the next one from the sensor. Frames are shared: whoever holds one
+ * keeps it while newer ones are pushed, frames nobody holds anymore are
+ * reused, all within the memory given. Unless it fits two frames, none
+ * are kept.
+ */
+class FrameHistory
+{
+public:
+    FrameHistory(size_t maxBytes);
+
+    bool isEnabled() const {
+        return mMaxBytes;
+    }
+
+    void push(const uint8_t *data, size_t size, uint64_t sequence,
+              uint64_t timestampUs);
+    FramePtr getLatest() const;
+    void clear();
+
+private:
+    const size_t mMaxBytes;
+
+    /* Frames to reuse, some of them might still be held. */
+    std::vector<std::shared_ptr<Frame>> mFrames;
+    std::shared_ptr<Frame> mLatest;
+};
+
+#endif /* SRC_FRAMEHISTORY_HPP_ */
@@ -13,14 +13,21 @@
 using XenBackend::Exception;
 
 FrontendBuffer::FrontendBuffer(domid_t domId, size_t size,
-                               const xencamera_req& req) :
+                               const xencamera_req& req,
+                               GrantMapCachePtr cache,
+                               GrantMapBudgetPtr budget,
+                               GrantCopier *copier,
+                               GrantCopier *reader) :
     mLog("FrontendBuffer"),
-    mDomId(domId)
+    mDomId(domId),
+    mCache(cache),
+    mBudget(budget),
+    mCopier(copier)
 {
     LOG(mLog, DEBUG) << "Create camera buffer, domId " << std::to_string(domId);
 
     try {
-        init(req, size);
+        init(req, size, reader);
     } catch (...) {
         release();
         throw;
@@ -32,10 +39,10 @@ FrontendBuffer::~FrontendBuffer()
     release();
 }
 
-void FrontendBuffer::init(const xencamera_req& req, size_t size)
+void FrontendBuffer::init(const xencamera_req& req, size_t size,
+                          GrantCopier *reader)
 {
     const xencamera_buf_create_req& aReq = req.req.buf_create;
-    std::vector<grant_ref_t> refs;
 
     mIndex = aReq.index;
     mOffset = aReq.plane_offset[0];
@@ -43,20 +50,104 @@ void FrontendBuffer::init(const xencamera_req& req, size_t size)
     /* Real size of the buffer will be bigger if there is offset. */
     size += mOffset;
 
-    getBufferRefs(aReq.gref_directory, size, refs);
+    getBufferRefs(aReq.gref_directory, size, mRefs, reader);
 
-    mBuffer.reset(new XenBackend::XenGnttabBuffer(mDomId, refs.data(),
-                                                  refs.size(),
-                                                  PROT_READ | PROT_WRITE));
+    /* Guests which never stream don't take address space at all. */
+    if (!mBudget && !mCopier)
+        map();
 }
 
 void FrontendBuffer::release()
 {
     DLOG(mLog, DEBUG) << "Release buffer " << mIndex;
+
+    /* Before the mapping goes, so the budget doesn't try to unmap it. */
+    if (mBudget)
+        mBudget->release(this);
+
+    mBuffer.reset();
+
+    if (mCache)
+        mCache->trim();
+}
+
+bool FrontendBuffer::map()
+{
+    if (mBuffer) {
+        if (mBudget)
+            mBudget->touch(this);
+
+        return true;
+    }
+
+    if (mBudget && !mBudget->reserve(this, mDomId,
+                                     mRefs.size() * XC_PAGE_SIZE))
+        return false;
+
+    try {
+        if (mCache)
+            mBuffer = mCache->get(mRefs);
+        else
+            mBuffer.reset(new XenBackend::XenGnttabBuffer(
+                mDomId, mRefs.data(), mRefs.size(), PROT_READ | PROT_WRITE));
+    } catch (const std::exception& e) {
+        /* Unlike at creation, frames are delivered from camera threads. */
+        if (!mBudget)
+            throw;
+
+        mBudget->release(this);
+
+        LOG(mLog, ERROR) << e.what();
+        return false;
+    }
+
+    return true;
+}
+
+bool FrontendBuffer::isFit(size_t size)
+{
+    if (mOffset + size <= mRefs.size() * XC_PAGE_SIZE)
+        return true;
+
+    LOG(mLog, ERROR) << "Frame of " << size << " bytes doesn't fit buffer " <<
+        mIndex;
+
+    return false;
+}
+
+bool FrontendBuffer::grantCopy(const void *data, size_t size)
+{
+    try {
+        mCopier->copy(mDomId, mRefs, mOffset, data, size);
+    } catch (const std::exception& e) {
+        /* The frontend's handler tells once for all its buffers. */
+        DLOG(mLog, DEBUG) << "Buffer " << mIndex << ": " << e.what();
+        return false;
+    }
+
+    return true;
+}
+
+bool FrontendBuffer::tryUnmap()
+{
+    std::unique_lock<std::mutex> lock(mLock, std::try_to_lock);
+
+    if (!lock.owns_lock())
+        return false;
+
+    DLOG(mLog, DEBUG) << "Unmap buffer " << mIndex;
+
+    mBuffer.reset();
+
+    if (mCache)
+        mCache->trim();
+
+    return true;
 }
 
 void FrontendBuffer::getBufferRefs(grant_ref_t startDirectory, uint32_t size,
-                                   std::vector<grant_ref_t>& refs)
+                                   std::vector<grant_ref_t>& refs,
+                                   GrantCopier *reader)
 {
     refs.clear();
 
@@ -66,17 +157,31 @@ void FrontendBuffer::getBufferRefs(grant_ref_t startDirectory, uint32_t size,
         << ", size: " << size
         << ", in grefs: " << requestedNumGrefs;
 
+    if (reader) {
+        reader->readDirectory(mDomId, startDirectory, requestedNumGrefs, refs);
+
+        DLOG(mLog, DEBUG) << "Get buffer refs, num refs: " << refs.size();
+
+        return;
+    }
+
+    const size_t grefsPerPage =
+        (XC_PAGE_SIZE - offsetof(xencamera_page_directory, gref)) /
+            sizeof(uint32_t);
+
+    /*
+     * The directory is a chain: the grant of the next page is only
+     * known once the current one is read, so pages are mapped one by one.
+     */
     while(startDirectory != 0)
     {
+        XenBackend::XenGnttabBuffer pageBuffer(mDomId, startDirectory,
+                                               PROT_READ);
 
-        XenBackend::XenGnttabBuffer pageBuffer(mDomId, startDirectory);
-
-        xencamera_page_directory* pageDirectory =
-            static_cast<xencamera_page_directory*>(pageBuffer.get());
+        auto pageDirectory =
+            static_cast<xencamera_page_directory *>(pageBuffer.get());
 
-        size_t numGrefs = std::min(requestedNumGrefs,
-            (XC_PAGE_SIZE - offsetof(xencamera_page_directory, gref)) /
-                sizeof(uint32_t));
+        size_t numGrefs = std::min(requestedNumGrefs, grefsPerPage);
 
         DLOG(mLog, DEBUG) << "Gref address: " << pageDirectory->gref
             << ", numGrefs " << numGrefs;
@@ -92,10 +197,57 @@ void FrontendBuffer::getBufferRefs(grant_ref_t startDirectory, uint32_t size,
     DLOG(mLog, DEBUG) << "Get buffer refs, num refs: " << refs.size();
 }
 
-void FrontendBuffer::copyBuffer(void *data, size_t size)
+bool FrontendBuffer::copyBuffer(const void *data, size_t size)
 {
+    std::lock_guard<std::mutex> lock(mLock);
+
     DLOG(mLog, DEBUG) << "Copy, size: " << size;
 
+    if (!isFit(size))
+        return false;
+
+    if (mCopier) {
+        if (grantCopy(data, size))
+            return true;
+
+        /* Not every source can be copied from: map from then on. */
+        mCopier = nullptr;
+    }
+
+    if (!map())
+        return false;
+
     memcpy(static_cast<uint8_t *>(mBuffer->get()) + mOffset, data, size);
+
+    return true;
 }
 
+bool FrontendBuffer::copyBuffer(const void *data, size_t size,
+                                ImageAdjust& adjust)
+{
+    std::lock_guard<std::mutex> lock(mLock);
+
+    DLOG(mLog, DEBUG) << "Copy adjusted, size: " << size;
+
+    if (!isFit(size) || !map())
+        return false;
+
+    adjust.copy(static_cast<const uint8_t *>(data),
+                static_cast<uint8_t *>(mBuffer->get()) + mOffset, size);
+
+    return true;
+}
+
+bool FrontendBuffer::isGrantCopy()
+{
+    std::lock_guard<std::mutex> lock(mLock);
+
+    return mCopier;
+}
+
+void FrontendBuffer::grantCopyDisable()
+{
+    std::lock_guard<std::mutex> lock(mLock);
+
+    mCopier = nullptr;
+}
@@ -9,23 +9,59 @@
 #define SRC_FRONTENDBUFFER_HPP_
 
 #include <memory>
+#include <mutex>
+#include <vector>
 
 #include <xen/be/Log.hpp>
 #include <xen/be/XenGnttab.hpp>
 
 #include <xen/io/cameraif.h>
 
+#include "GrantCopier.hpp"
+#include "GrantMapBudget.hpp"
+#include "GrantMapCache.hpp"
+#include "ImageAdjust.hpp"
+
 class FrontendBuffer
 {
 public:
-    FrontendBuffer(domid_t domId, size_t size, const xencamera_req& req);
+    /*
+     * The buffer is mapped through the cache if one is given. With a budget
+     * it is only mapped on the first copy and may be unmapped in between.
+     * With a copier it is never mapped, frames are copied by grant.
+     * With a reader the page directory is read by grant copy rather than
+     * mapped.
+     */
+    FrontendBuffer(domid_t domId, size_t size, const xencamera_req& req,
+                   GrantMapCachePtr cache = nullptr,
+                   GrantMapBudgetPtr budget = nullptr,
+                   GrantCopier *copier = nullptr,
+                   GrantCopier *reader = nullptr);
     ~FrontendBuffer();
 
     int getIndex() {
         return mIndex;
     }
 
-    void copyBuffer(void *data, size_t size);
+    /*
+     * Return false if the frame doesn't fit the buffer or the buffer
+     * couldn't be mapped within the budget. If the grant copy fails the
+     * buffer is mapped instead, and so from then on.
+     */
+    bool copyBuffer(const void *data, size_t size);
+    /* Copy with the frontend's software image controls applied. */
+    bool copyBuffer(const void *data, size_t size, ImageAdjust& adjust);
+
+    /*
+     * Called by the budget: unmap the buffer unless a copy into it is in
+     * progress.
+     */
+    bool tryUnmap();
+
+    /* False once a grant copy failed or if there is no copier. */
+    bool isGrantCopy();
+    /* Map the buffer to copy frames into it from now on. */
+    void grantCopyDisable();
 
 private:
     XenBackend::Log mLog;
@@ -35,13 +71,22 @@ private:
     int mIndex;
     unsigned long mOffset;
 
-    std::unique_ptr<XenBackend::XenGnttabBuffer> mBuffer;
+    GrantMapCachePtr mCache;
+    GrantMapBudgetPtr mBudget;
+    GrantCopier *mCopier;
+    GrantMappingPtr mBuffer;
+    std::vector<grant_ref_t> mRefs;
 
-    void init(const xencamera_req& req, size_t size);
+    void init(const xencamera_req& req, size_t size, GrantCopier *reader);
     void release();
 
+    bool map();
+    bool isFit(size_t size);
+    bool grantCopy(const void *data, size_t size);
+
     void getBufferRefs(grant_ref_t startDirectory, uint32_t size,
-                       std::vector<grant_ref_t>& refs);
+                       std::vector<grant_ref_t>& refs,
+                       GrantCopier *reader);
 };
 
 typedef std::unique_ptr<FrontendBuffer> FrontendBufferPtr;
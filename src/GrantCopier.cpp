@@ -0,0 +1,172 @@
+// SPDX-License-Identifier: GPL-2.0
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2018 EPAM Systems Inc.
+ */
+
+#include <cstddef>
+#include <cstring>
+
+#include <xen/grant_table.h>
+
+#include <xen/be/Exception.hpp>
+
+#include <xen/io/cameraif.h>
+
+#include "GrantCopier.hpp"
+
+using XenBackend::Exception;
+
+XenGrantCopier::XenGrantCopier() :
+    mLog("GrantCopier")
+{
+    mHandle = xengnttab_open(nullptr, 0);
+
+    if (!mHandle)
+        throw Exception("Can't open gnttab device", errno);
+}
+
+XenGrantCopier::~XenGrantCopier()
+{
+    xengnttab_close(mHandle);
+}
+
+void XenGrantCopier::copy(domid_t domId, const std::vector<grant_ref_t>& refs,
+                          size_t offset, const void *data, size_t size)
+{
+    if (offset + size > refs.size() * XC_PAGE_SIZE)
+        throw Exception("Frame doesn't fit the buffer", EINVAL);
+
+    auto src = static_cast<const uint8_t *>(data);
+
+    mSegments.clear();
+
+    while (size) {
+        size_t pageOffset = offset % XC_PAGE_SIZE;
+        size_t len = std::min<size_t>(size, XC_PAGE_SIZE - pageOffset);
+        xengnttab_grant_copy_segment_t seg {};
+
+        seg.source.virt = const_cast<uint8_t *>(src);
+        seg.dest.foreign.ref = refs[offset / XC_PAGE_SIZE];
+        seg.dest.foreign.offset = pageOffset;
+        seg.dest.foreign.domid = domId;
+        seg.len = len;
+        seg.flags = GNTCOPY_dest_gref;
+
+        mSegments.push_back(seg);
+
+        src += len;
+        offset += len;
+        size -= len;
+    }
+
+    DLOG(mLog, DEBUG) << "Copy, segments: " << mSegments.size();
+
+    if (xengnttab_grant_copy(mHandle, mSegments.size(), mSegments.data()))
+        throw Exception("Grant copy failed", errno);
+
+    for (auto& seg : mSegments)
+        if (seg.status != GNTST_okay)
+            throw Exception("Grant copy failed, status " +
+                            std::to_string(seg.status), EIO);
+}
+
+void XenGrantCopier::read(domid_t domId, grant_ref_t ref, size_t offset,
+                          void *data, size_t size)
+{
+    if (offset + size > XC_PAGE_SIZE)
+        throw Exception("Read crosses the page", EINVAL);
+
+    xengnttab_grant_copy_segment_t seg {};
+
+    seg.source.foreign.ref = ref;
+    seg.source.foreign.offset = offset;
+    seg.source.foreign.domid = domId;
+    seg.dest.virt = data;
+    seg.len = size;
+    seg.flags = GNTCOPY_source_gref;
+
+    if (xengnttab_grant_copy(mHandle, 1, &seg))
+        throw Exception("Grant copy failed", errno);
+
+    if (seg.status != GNTST_okay)
+        throw Exception("Grant copy failed, status " +
+                        std::to_string(seg.status), EIO);
+}
+
+LocalGrantCopier::LocalGrantCopier(PageResolver resolve) :
+    mResolve(resolve)
+{
+}
+
+void LocalGrantCopier::copy(domid_t domId,
+                            const std::vector<grant_ref_t>& refs,
+                            size_t offset, const void *data, size_t size)
+{
+    if (offset + size > refs.size() * XC_PAGE_SIZE)
+        throw Exception("Frame doesn't fit the buffer", EINVAL);
+
+    auto src = static_cast<const uint8_t *>(data);
+
+    while (size) {
+        size_t pageOffset = offset % XC_PAGE_SIZE;
+        size_t len = std::min<size_t>(size, XC_PAGE_SIZE - pageOffset);
+        uint8_t *page = mResolve(domId, refs[offset / XC_PAGE_SIZE]);
+
+        if (!page)
+            throw Exception("Grant copy failed, bad ref " +
+                            std::to_string(refs[offset / XC_PAGE_SIZE]), EIO);
+
+        memcpy(page + pageOffset, src, len);
+
+        src += len;
+        offset += len;
+        size -= len;
+    }
+}
+
+void LocalGrantCopier::read(domid_t domId, grant_ref_t ref, size_t offset,
+                            void *data, size_t size)
+{
+    if (offset + size > XC_PAGE_SIZE)
+        throw Exception("Read crosses the page", EINVAL);
+
+    uint8_t *page = mResolve(domId, ref);
+
+    if (!page)
+        throw Exception("Grant copy failed, bad ref " + std::to_string(ref),
+                        EIO);
+
+    memcpy(data, page + offset, size);
+}
+
+void GrantCopier::readDirectory(domid_t domId, grant_ref_t startDirectory,
+                                size_t numRefs,
+                                std::vector<grant_ref_t>& refs)
+{
+    const size_t headerSize = offsetof(xencamera_page_directory, gref);
+    const size_t refsPerPage = (XC_PAGE_SIZE - headerSize) /
+        sizeof(grant_ref_t);
+
+    /* Only the part of a page in use is read. */
+    std::vector<uint8_t> page(XC_PAGE_SIZE);
+    auto directory = reinterpret_cast<xencamera_page_directory *>(
+        page.data());
+
+    refs.clear();
+
+    /* Pages past the size of the buffer are of no use. */
+    while (startDirectory != 0 && numRefs) {
+        size_t num = std::min(numRefs, refsPerPage);
+
+        read(domId, startDirectory, 0, page.data(),
+             headerSize + num * sizeof(grant_ref_t));
+
+        refs.insert(refs.end(), directory->gref, directory->gref + num);
+
+        numRefs -= num;
+        startDirectory = directory->gref_dir_next_page;
+    }
+}
@@ -0,0 +1,102 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2018 EPAM Systems Inc.
+ */
+#ifndef SRC_GRANTCOPIER_HPP_
+#define SRC_GRANTCOPIER_HPP_
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <xen/be/Log.hpp>
+#include <xen/be/XenGnttab.hpp>
+
+extern "C" {
+#include <xengnttab.h>
+}
+
+/*
+ * Copies backend memory into pages granted by a frontend without mapping
+ * them, so delivering a frame costs neither the map nor the TLB flush on
+ * unmap. Implementations other than the hypervisor one can stand in where
+ * there is no Xen.
+ */
+class GrantCopier
+{
+public:
+    virtual ~GrantCopier() {}
+
+    /*
+     * Copy size bytes of data at offset into the buffer made of the pages
+     * granted with refs: throws on failure.
+     */
+    virtual void copy(domid_t domId, const std::vector<grant_ref_t>& refs,
+                      size_t offset, const void *data, size_t size) = 0;
+
+    /*
+     * Copy size bytes at offset of the page granted with ref into data:
+     * throws on failure.
+     */
+    virtual void read(domid_t domId, grant_ref_t ref, size_t offset,
+                      void *data, size_t size) = 0;
+
+    /*
+     * Read the refs of a buffer of numRefs pages from the chain of page
+     * directories starting at startDirectory. The chain can't be read in
+     * one go, as each page names the next, but reading a page takes a
+     * single copy where mapping it takes a map and an unmap.
+     */
+    void readDirectory(domid_t domId, grant_ref_t startDirectory,
+                       size_t numRefs, std::vector<grant_ref_t>& refs);
+};
+
+typedef std::unique_ptr<GrantCopier> GrantCopierPtr;
+
+/* Batched GNTTABOP_copy through gntdev. */
+class XenGrantCopier : public GrantCopier
+{
+public:
+    XenGrantCopier();
+    ~XenGrantCopier();
+
+    void copy(domid_t domId, const std::vector<grant_ref_t>& refs,
+              size_t offset, const void *data, size_t size) override;
+    void read(domid_t domId, grant_ref_t ref, size_t offset,
+              void *data, size_t size) override;
+
+private:
+    XenBackend::Log mLog;
+
+    xengnttab_handle *mHandle;
+
+    /* A segment may not cross a page, so a frame takes one per page. */
+    std::vector<xengnttab_grant_copy_segment_t> mSegments;
+};
+
+/*
+ * Stand-in for where there is no Xen: refs name pages of local memory.
+ * Frames are cut into page segments the same way as for the hypervisor,
+ * only the hypercall is missing.
+ */
+class LocalGrantCopier : public GrantCopier
+{
+public:
+    /* Page domId granted with ref, nullptr if there is none. */
+    typedef std::function<uint8_t *(domid_t, grant_ref_t)> PageResolver;
+
+    LocalGrantCopier(PageResolver resolve);
+
+    void copy(domid_t domId, const std::vector<grant_ref_t>& refs,
+              size_t offset, const void *data, size_t size) override;
+    void read(domid_t domId, grant_ref_t ref, size_t offset,
+              void *data, size_t size) override;
+
+private:
+    PageResolver mResolve;
+};
+
+#endif /* SRC_GRANTCOPIER_HPP_ */
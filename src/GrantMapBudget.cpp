@@ -0,0 +1,157 @@
+// SPDX-License-Identifier: GPL-2.0
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2018 EPAM Systems Inc.
+ */
+
+#include "FrontendBuffer.hpp"
+#include "GrantMapBudget.hpp"
+
+GrantMapBudget::GrantMapBudget(size_t maxBytes, unsigned int idleMs) :
+    mLog("GrantMapBudget"),
+    mMaxBytes(maxBytes),
+    mIdle(idleMs),
+    mBytes(0),
+    mTerminate(false)
+{
+    if (idleMs)
+        mThread = std::thread(&GrantMapBudget::idleThread, this);
+}
+
+GrantMapBudget::~GrantMapBudget()
+{
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+
+        mTerminate = true;
+    }
+
+    mCondVar.notify_all();
+
+    if (mThread.joinable())
+        mThread.join();
+}
+
+std::list<GrantMapBudget::Entry>::iterator GrantMapBudget::find(
+    FrontendBuffer *buffer)
+{
+    for (auto it = mEntries.begin(); it != mEntries.end(); ++it)
+        if (it->buffer == buffer)
+            return it;
+
+    return mEntries.end();
+}
+
+/*
+ * Called with mLock held: buffers take their own lock and then this one,
+ * so theirs can only be tried here.
+ */
+bool GrantMapBudget::unmap(std::list<Entry>::iterator it)
+{
+    if (!it->buffer->tryUnmap())
+        return false;
+
+    DLOG(mLog, DEBUG) << "Unmapped " << it->bytes << " bytes, dom " <<
+        std::to_string(it->domId) << " has " <<
+        mDomainBytes[it->domId] - it->bytes << " mapped";
+
+    mBytes -= it->bytes;
+    mDomainBytes[it->domId] -= it->bytes;
+
+    mEntries.erase(it);
+
+    return true;
+}
+
+bool GrantMapBudget::reserve(FrontendBuffer *buffer, domid_t domId,
+                             size_t bytes)
+{
+    std::lock_guard<std::mutex> lock(mLock);
+
+    if (mMaxBytes) {
+        /* The least recently used are at the end. */
+        auto it = mEntries.end();
+
+        while (mBytes + bytes > mMaxBytes && it != mEntries.begin()) {
+            auto victim = std::prev(it);
+
+            if (victim->buffer == buffer || !unmap(victim))
+                it = victim;
+        }
+
+        if (mBytes + bytes > mMaxBytes) {
+            LOG(mLog, WARNING) << "No room to map " << bytes <<
+                " bytes for dom " << std::to_string(domId) << ", " <<
+                mBytes << " of " << mMaxBytes << " mapped";
+            return false;
+        }
+    }
+
+    mEntries.push_front({ buffer, domId, bytes,
+                          std::chrono::steady_clock::now() });
+    mBytes += bytes;
+    mDomainBytes[domId] += bytes;
+
+    DLOG(mLog, DEBUG) << "Mapped " << bytes << " bytes, dom " <<
+        std::to_string(domId) << " has " << mDomainBytes[domId] <<
+        " mapped, total " << mBytes;
+
+    return true;
+}
+
+void GrantMapBudget::touch(FrontendBuffer *buffer)
+{
+    std::lock_guard<std::mutex> lock(mLock);
+
+    auto it = find(buffer);
+
+    if (it == mEntries.end())
+        return;
+
+    it->lastUse = std::chrono::steady_clock::now();
+    mEntries.splice(mEntries.begin(), mEntries, it);
+}
+
+void GrantMapBudget::release(FrontendBuffer *buffer)
+{
+    std::lock_guard<std::mutex> lock(mLock);
+
+    auto it = find(buffer);
+
+    if (it == mEntries.end())
+        return;
+
+    mBytes -= it->bytes;
+    mDomainBytes[it->domId] -= it->bytes;
+
+    mEntries.erase(it);
+}
+
+size_t GrantMapBudget::getMappedBytes(domid_t domId)
+{
+    std::lock_guard<std::mutex> lock(mLock);
+
+    auto it = mDomainBytes.find(domId);
+
+    return it == mDomainBytes.end() ? 0 : it->second;
+}
+
+void GrantMapBudget::idleThread()
+{
+    std::unique_lock<std::mutex> lock(mLock);
+
+    while (!mTerminate) {
+        mCondVar.wait_for(lock, mIdle / 2);
+
+        auto deadline = std::chrono::steady_clock::now() - mIdle;
+
+        for (auto it = mEntries.begin(); it != mEntries.end(); ) {
+            auto entry = it++;
+
+            if (entry->lastUse < deadline)
+                unmap(entry);
+        }
+    }
+}
@@ -0,0 +1,81 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2018 EPAM Systems Inc.
+ */
+#ifndef SRC_GRANTMAPBUDGET_HPP_
+#define SRC_GRANTMAPBUDGET_HPP_
+
+#include <chrono>
+#include <condition_variable>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#include <xen/be/Log.hpp>
+#include <xen/be/XenGnttab.hpp>
+
+class FrontendBuffer;
+
+/*
+ * Address space all the frontends' buffers may take in the backend.
+ * With the budget in place buffers are only mapped when a frame is first
+ * delivered to them. If mapping one would go over the budget, buffers
+ * of any frontend which are not being written to are unmapped, least
+ * recently used first, and buffers not used for the idle interval are
+ * unmapped in the background, so paused guests don't hold address space.
+ */
+class GrantMapBudget
+{
+public:
+    /* 0 means no limit and no idle unmapping respectively. */
+    GrantMapBudget(size_t maxBytes, unsigned int idleMs);
+    ~GrantMapBudget();
+
+    /*
+     * Called by a buffer about to be mapped, with its lock held: returns
+     * false if the budget can't be met.
+     */
+    bool reserve(FrontendBuffer *buffer, domid_t domId, size_t bytes);
+    /* A frame has been written into the buffer. */
+    void touch(FrontendBuffer *buffer);
+    /* The buffer has been unmapped by its own. */
+    void release(FrontendBuffer *buffer);
+
+    size_t getMappedBytes(domid_t domId);
+
+private:
+    XenBackend::Log mLog;
+    std::mutex mLock;
+
+    const size_t mMaxBytes;
+    const std::chrono::milliseconds mIdle;
+
+    struct Entry {
+        FrontendBuffer *buffer;
+        domid_t domId;
+        size_t bytes;
+        std::chrono::steady_clock::time_point lastUse;
+    };
+
+    /* Mapped buffers, most recently used first. */
+    std::list<Entry> mEntries;
+    size_t mBytes;
+    std::unordered_map<domid_t, size_t> mDomainBytes;
+
+    bool mTerminate;
+    std::condition_variable mCondVar;
+    std::thread mThread;
+
+    std::list<Entry>::iterator find(FrontendBuffer *buffer);
+    bool unmap(std::list<Entry>::iterator it);
+    void idleThread();
+};
+
+typedef std::shared_ptr<GrantMapBudget> GrantMapBudgetPtr;
+
+#endif /* SRC_GRANTMAPBUDGET_HPP_ */
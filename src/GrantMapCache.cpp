@@ -0,0 +1,70 @@
+// SPDX-License-Identifier: GPL-2.0
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2018 EPAM Systems Inc.
+ */
+
+#include "GrantMapCache.hpp"
+
+GrantMapCache::GrantMapCache(domid_t domId, size_t maxBytes) :
+    mLog("GrantMapCache"),
+    mDomId(domId),
+    mMaxBytes(maxBytes),
+    mBytes(0)
+{
+}
+
+GrantMappingPtr GrantMapCache::get(const std::vector<grant_ref_t>& refs)
+{
+    std::lock_guard<std::mutex> lock(mLock);
+
+    for (auto it = mEntries.begin(); it != mEntries.end(); ++it) {
+        /* Still used by another buffer: it can't be shared. */
+        if (it->refs != refs || it->mapping.use_count() > 1)
+            continue;
+
+        DLOG(mLog, DEBUG) << "Reuse mapping of " << refs.size() <<
+            " grants, dom " << std::to_string(mDomId);
+
+        mEntries.splice(mEntries.begin(), mEntries, it);
+
+        return mEntries.front().mapping;
+    }
+
+    GrantMappingPtr mapping(new XenBackend::XenGnttabBuffer(
+        mDomId, refs.data(), refs.size(), PROT_READ | PROT_WRITE));
+
+    mEntries.push_front({ refs, mapping });
+    mBytes += refs.size() * XC_PAGE_SIZE;
+
+    evict();
+
+    return mapping;
+}
+
+void GrantMapCache::trim()
+{
+    std::lock_guard<std::mutex> lock(mLock);
+
+    evict();
+}
+
+void GrantMapCache::evict()
+{
+    auto it = mEntries.end();
+
+    while (mBytes > mMaxBytes && it != mEntries.begin()) {
+        --it;
+
+        if (it->mapping.use_count() > 1)
+            continue;
+
+        DLOG(mLog, DEBUG) << "Unmap " << it->refs.size() <<
+            " grants, dom " << std::to_string(mDomId);
+
+        mBytes -= it->refs.size() * XC_PAGE_SIZE;
+        it = mEntries.erase(it);
+    }
+}
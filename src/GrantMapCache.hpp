@@ -0,0 +1,60 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2018 EPAM Systems Inc.
+ */
+#ifndef SRC_GRANTMAPCACHE_HPP_
+#define SRC_GRANTMAPCACHE_HPP_
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <xen/be/Log.hpp>
+#include <xen/be/XenGnttab.hpp>
+
+typedef std::shared_ptr<XenBackend::XenGnttabBuffer> GrantMappingPtr;
+
+/*
+ * Mappings of a frontend's buffers kept after the buffers are destroyed,
+ * so a guest reconfiguring its stream, which destroys and recreates the
+ * very same buffers, gets them back without mapping them again. Mappings
+ * are looked up by the grant references of the buffer: a grant can't be
+ * reused by the guest while it is mapped, so the same references mean
+ * the same pages. Unused mappings are dropped least recently used first
+ * once they take more than the budget: they keep guest memory pinned.
+ */
+class GrantMapCache
+{
+public:
+    GrantMapCache(domid_t domId, size_t maxBytes);
+
+    GrantMappingPtr get(const std::vector<grant_ref_t>& refs);
+    /* Drop unused mappings over the budget, once a buffer is destroyed. */
+    void trim();
+
+private:
+    XenBackend::Log mLog;
+    std::mutex mLock;
+
+    domid_t mDomId;
+    const size_t mMaxBytes;
+    size_t mBytes;
+
+    struct Entry {
+        std::vector<grant_ref_t> refs;
+        GrantMappingPtr mapping;
+    };
+
+    /* Most recently used first. */
+    std::list<Entry> mEntries;
+
+    void evict();
+};
+
+typedef std::shared_ptr<GrantMapCache> GrantMapCachePtr;
+
+#endif /* SRC_GRANTMAPCACHE_HPP_ */
@@ -0,0 +1,526 @@
+// SPDX-License-Identifier: GPL-2.0
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2018 EPAM Systems Inc.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include <xen/be/Exception.hpp>
+#include <xen/io/cameraif.h>
+
+#include "ImageAdjust.hpp"
+
+using XenBackend::Exception;
+
+namespace {
+
+/* Chroma is centered at 128, the matrix is in 1/128 units. */
+const int cChromaRound = 64 + (128 << 7);
+
+inline uint8_t clampU8(int v)
+{
+    return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+inline void adjustChroma(uint8_t u, uint8_t v, uint8_t *du, uint8_t *dv,
+                         const int *m)
+{
+    int cu = u - 128;
+    int cv = v - 128;
+
+    *du = clampU8((m[0] * cu + m[1] * cv + cChromaRound) >> 7);
+    *dv = clampU8((m[2] * cu + m[3] * cv + cChromaRound) >> 7);
+}
+
+#if defined(__ARM_NEON)
+inline int16x8_t lumaNeon(int16x8_t y, int16x4_t gain, int32x4_t offset)
+{
+    int32x4_t lo = vmlal_s16(offset, vget_low_s16(y), gain);
+    int32x4_t hi = vmlal_s16(offset, vget_high_s16(y), gain);
+
+    return vcombine_s16(vqmovn_s32(vshrq_n_s32(lo, 7)),
+                        vqmovn_s32(vshrq_n_s32(hi, 7)));
+}
+
+inline int16x8_t chromaNeon(int16x8_t u, int16x8_t v, int16_t mu, int16_t mv)
+{
+    const int32x4_t round = vdupq_n_s32(cChromaRound);
+
+    int32x4_t lo = vmlal_n_s16(vmlal_n_s16(round, vget_low_s16(u), mu),
+                               vget_low_s16(v), mv);
+    int32x4_t hi = vmlal_n_s16(vmlal_n_s16(round, vget_high_s16(u), mu),
+                               vget_high_s16(v), mv);
+
+    return vcombine_s16(vqmovn_s32(vshrq_n_s32(lo, 7)),
+                        vqmovn_s32(vshrq_n_s32(hi, 7)));
+}
+
+inline int16x8_t centerNeon(uint8x8_t v)
+{
+    return vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(v)), vdupq_n_s16(128));
+}
+#endif
+
+/*
+ * A row of luma samples: computed in SIMD, the LUT holding the very same
+ * function is used for the rest.
+ */
+void lumaRow(const uint8_t *src, uint8_t *dst, size_t n, int gain,
+             int offset, const uint8_t *lut)
+{
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    /* (Y, 1) . (gain, offset) per 32-bit lane. */
+    const __m128i coef = _mm_setr_epi16(gain, offset, gain, offset,
+                                        gain, offset, gain, offset);
+    const __m128i one = _mm_set1_epi16(1);
+    const __m128i zero = _mm_setzero_si128();
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+        __m128i lo = _mm_unpacklo_epi8(v, zero);
+        __m128i hi = _mm_unpackhi_epi8(v, zero);
+
+        __m128i a0 = _mm_madd_epi16(_mm_unpacklo_epi16(lo, one), coef);
+        __m128i a1 = _mm_madd_epi16(_mm_unpackhi_epi16(lo, one), coef);
+        __m128i a2 = _mm_madd_epi16(_mm_unpacklo_epi16(hi, one), coef);
+        __m128i a3 = _mm_madd_epi16(_mm_unpackhi_epi16(hi, one), coef);
+
+        lo = _mm_packs_epi32(_mm_srai_epi32(a0, 7), _mm_srai_epi32(a1, 7));
+        hi = _mm_packs_epi32(_mm_srai_epi32(a2, 7), _mm_srai_epi32(a3, 7));
+
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i),
+                         _mm_packus_epi16(lo, hi));
+    }
+#elif defined(__ARM_NEON)
+    const int16x4_t g = vdup_n_s16(gain);
+    const int32x4_t k = vdupq_n_s32(offset);
+
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t v = vld1q_u8(src + i);
+
+        int16x8_t lo = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(v)));
+        int16x8_t hi = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(v)));
+
+        vst1q_u8(dst + i, vcombine_u8(vqmovun_s16(lumaNeon(lo, g, k)),
+                                      vqmovun_s16(lumaNeon(hi, g, k))));
+    }
+#endif
+
+    for (; i < n; i++)
+        dst[i] = lut[src[i]];
+}
+
+/* A row of n interleaved chroma pairs, the matrix is in pair order. */
+void chromaPairRow(const uint8_t *src, uint8_t *dst, size_t n, const int *m)
+{
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    const __m128i mu = _mm_setr_epi16(m[0], m[1], m[0], m[1],
+                                      m[0], m[1], m[0], m[1]);
+    const __m128i mv = _mm_setr_epi16(m[2], m[3], m[2], m[3],
+                                      m[2], m[3], m[2], m[3]);
+    const __m128i center = _mm_set1_epi16(128);
+    const __m128i round = _mm_set1_epi32(cChromaRound);
+    const __m128i zero = _mm_setzero_si128();
+
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128(
+            reinterpret_cast<const __m128i *>(src + 2 * i));
+        __m128i out[2];
+
+        for (int h = 0; h < 2; h++) {
+            __m128i uv = _mm_sub_epi16(h ? _mm_unpackhi_epi8(v, zero) :
+                                       _mm_unpacklo_epi8(v, zero), center);
+
+            __m128i u = _mm_srai_epi32(
+                _mm_add_epi32(_mm_madd_epi16(uv, mu), round), 7);
+            __m128i w = _mm_srai_epi32(
+                _mm_add_epi32(_mm_madd_epi16(uv, mv), round), 7);
+
+            out[h] = _mm_packs_epi32(_mm_unpacklo_epi32(u, w),
+                                     _mm_unpackhi_epi32(u, w));
+        }
+
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 2 * i),
+                         _mm_packus_epi16(out[0], out[1]));
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 16 <= n; i += 16) {
+        uint8x16x2_t uv = vld2q_u8(src + 2 * i);
+        uint8x16x2_t out;
+
+        int16x8_t ulo = centerNeon(vget_low_u8(uv.val[0]));
+        int16x8_t uhi = centerNeon(vget_high_u8(uv.val[0]));
+        int16x8_t vlo = centerNeon(vget_low_u8(uv.val[1]));
+        int16x8_t vhi = centerNeon(vget_high_u8(uv.val[1]));
+
+        out.val[0] = vcombine_u8(
+            vqmovun_s16(chromaNeon(ulo, vlo, m[0], m[1])),
+            vqmovun_s16(chromaNeon(uhi, vhi, m[0], m[1])));
+        out.val[1] = vcombine_u8(
+            vqmovun_s16(chromaNeon(ulo, vlo, m[2], m[3])),
+            vqmovun_s16(chromaNeon(uhi, vhi, m[2], m[3])));
+
+        vst2q_u8(dst + 2 * i, out);
+    }
+#endif
+
+    for (; i < n; i++)
+        adjustChroma(src[2 * i], src[2 * i + 1],
+                     &dst[2 * i], &dst[2 * i + 1], m);
+}
+
+/*
+ * A row of n packed macropixels, packed holds the offsets of Y0, Y1, U
+ * and V within one and the matrix is in (U, V) order.
+ */
+void packedRow(const uint8_t *src, uint8_t *dst, size_t n,
+               const int *packed, int gain, int offset, const uint8_t *lut,
+               const int *m)
+{
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    /* Luma is either in the even or in the odd bytes. */
+    bool lumaOdd = packed[0] & 1;
+    /* V first: the matrix in pair order is reversed. */
+    const int swapped[] = { m[3], m[2], m[1], m[0] };
+    const int *p = packed[2] < packed[3] ? m : swapped;
+
+    const __m128i coef = _mm_setr_epi16(gain, offset, gain, offset,
+                                        gain, offset, gain, offset);
+    const __m128i mu = _mm_setr_epi16(p[0], p[1], p[0], p[1],
+                                      p[0], p[1], p[0], p[1]);
+    const __m128i mv = _mm_setr_epi16(p[2], p[3], p[2], p[3],
+                                      p[2], p[3], p[2], p[3]);
+    const __m128i one = _mm_set1_epi16(1);
+    const __m128i center = _mm_set1_epi16(128);
+    const __m128i round = _mm_set1_epi32(cChromaRound);
+    const __m128i low = _mm_set1_epi16(0xff);
+    const __m128i zero = _mm_setzero_si128();
+
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128(
+            reinterpret_cast<const __m128i *>(src + 4 * i));
+        __m128i even = _mm_and_si128(v, low);
+        __m128i odd = _mm_srli_epi16(v, 8);
+        __m128i y = lumaOdd ? odd : even;
+        __m128i c = _mm_sub_epi16(lumaOdd ? even : odd, center);
+
+        __m128i a0 = _mm_madd_epi16(_mm_unpacklo_epi16(y, one), coef);
+        __m128i a1 = _mm_madd_epi16(_mm_unpackhi_epi16(y, one), coef);
+
+        y = _mm_packs_epi32(_mm_srai_epi32(a0, 7), _mm_srai_epi32(a1, 7));
+
+        __m128i u = _mm_srai_epi32(
+            _mm_add_epi32(_mm_madd_epi16(c, mu), round), 7);
+        __m128i w = _mm_srai_epi32(
+            _mm_add_epi32(_mm_madd_epi16(c, mv), round), 7);
+
+        c = _mm_packs_epi32(_mm_unpacklo_epi32(u, w),
+                            _mm_unpackhi_epi32(u, w));
+
+        /* Clamp to bytes and put them back in place. */
+        y = _mm_min_epi16(_mm_max_epi16(y, zero), low);
+        c = _mm_min_epi16(_mm_max_epi16(c, zero), low);
+
+        v = lumaOdd ? _mm_or_si128(c, _mm_slli_epi16(y, 8)) :
+            _mm_or_si128(y, _mm_slli_epi16(c, 8));
+
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 4 * i), v);
+    }
+#elif defined(__ARM_NEON)
+    const int16x4_t g = vdup_n_s16(gain);
+    const int32x4_t k = vdupq_n_s32(offset);
+
+    for (; i + 16 <= n; i += 16) {
+        uint8x16x4_t in = vld4q_u8(src + 4 * i);
+        uint8x16x4_t out;
+
+        for (int l = 0; l < 2; l++) {
+            uint8x16_t v = in.val[packed[l]];
+
+            int16x8_t lo = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(v)));
+            int16x8_t hi = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(v)));
+
+            out.val[packed[l]] = vcombine_u8(
+                vqmovun_s16(lumaNeon(lo, g, k)),
+                vqmovun_s16(lumaNeon(hi, g, k)));
+        }
+
+        int16x8_t ulo = centerNeon(vget_low_u8(in.val[packed[2]]));
+        int16x8_t uhi = centerNeon(vget_high_u8(in.val[packed[2]]));
+        int16x8_t vlo = centerNeon(vget_low_u8(in.val[packed[3]]));
+        int16x8_t vhi = centerNeon(vget_high_u8(in.val[packed[3]]));
+
+        out.val[packed[2]] = vcombine_u8(
+            vqmovun_s16(chromaNeon(ulo, vlo, m[0], m[1])),
+            vqmovun_s16(chromaNeon(uhi, vhi, m[0], m[1])));
+        out.val[packed[3]] = vcombine_u8(
+            vqmovun_s16(chromaNeon(ulo, vlo, m[2], m[3])),
+            vqmovun_s16(chromaNeon(uhi, vhi, m[2], m[3])));
+
+        vst4q_u8(dst + 4 * i, out);
+    }
+#endif
+
+    for (const uint8_t *s = src + 4 * i; i < n; i++, s += 4) {
+        uint8_t *d = dst + 4 * i;
+
+        d[packed[0]] = lut[s[packed[0]]];
+        d[packed[1]] = lut[s[packed[1]]];
+        adjustChroma(s[packed[2]], s[packed[3]],
+                     &d[packed[2]], &d[packed[3]], m);
+    }
+}
+
+/* Rows of separate U and V planes: a plain loop the compiler vectorizes. */
+void chromaPlanarRow(const uint8_t *srcU, const uint8_t *srcV,
+                     uint8_t *dstU, uint8_t *dstV, size_t n, const int *m)
+{
+    for (size_t i = 0; i < n; i++)
+        adjustChroma(srcU[i], srcV[i], &dstU[i], &dstV[i], m);
+}
+
+}
+
+ImageAdjust::ImageAdjust() :
+    mFormat {0},
+    mLayout(Layout::NONE),
+    mSwapUV(false),
+    mChromaVsub(1),
+    mPacked {0}
+{
+    for (int type = 0; type < cNumControls; type++)
+        mValues[type] = getRange(type).def;
+
+    update();
+}
+
+ImageAdjust::Range ImageAdjust::getRange(int type)
+{
+    switch (type) {
+    case XENCAMERA_CTRL_BRIGHTNESS:
+        return { -128, 127, 1, 0 };
+
+    /* 128 is the unity gain. */
+    case XENCAMERA_CTRL_CONTRAST:
+    case XENCAMERA_CTRL_SATURATION:
+        return { 0, 255, 1, 128 };
+
+    /* Degrees. */
+    case XENCAMERA_CTRL_HUE:
+        return { -180, 180, 1, 0 };
+
+    default:
+        break;
+    }
+
+    throw Exception("Unsupported control type for software control " +
+                    std::to_string(type), EINVAL);
+}
+
+void ImageAdjust::setFormat(const v4l2_pix_format& fmt)
+{
+    static const int yuyv[] = { 0, 2, 1, 3 };
+    static const int yvyu[] = { 0, 2, 3, 1 };
+    static const int uyvy[] = { 1, 3, 0, 2 };
+    static const int vyuy[] = { 1, 3, 2, 0 };
+
+    mFormat = fmt;
+    mLayout = Layout::NONE;
+    mSwapUV = false;
+    mChromaVsub = 1;
+
+    switch (fmt.pixelformat) {
+    case V4L2_PIX_FMT_YUYV:
+        mLayout = Layout::PACKED;
+        std::copy(yuyv, yuyv + 4, mPacked);
+        break;
+
+    case V4L2_PIX_FMT_YVYU:
+        mLayout = Layout::PACKED;
+        std::copy(yvyu, yvyu + 4, mPacked);
+        break;
+
+    case V4L2_PIX_FMT_UYVY:
+        mLayout = Layout::PACKED;
+        std::copy(uyvy, uyvy + 4, mPacked);
+        break;
+
+    case V4L2_PIX_FMT_VYUY:
+        mLayout = Layout::PACKED;
+        std::copy(vyuy, vyuy + 4, mPacked);
+        break;
+
+    case V4L2_PIX_FMT_NV21:
+        mSwapUV = true;
+        /* Fall through. */
+    case V4L2_PIX_FMT_NV12:
+        mLayout = Layout::SEMI_PLANAR;
+        mChromaVsub = 2;
+        break;
+
+    case V4L2_PIX_FMT_NV61:
+        mSwapUV = true;
+        /* Fall through. */
+    case V4L2_PIX_FMT_NV16:
+        mLayout = Layout::SEMI_PLANAR;
+        break;
+
+    case V4L2_PIX_FMT_YVU420:
+        mSwapUV = true;
+        /* Fall through. */
+    case V4L2_PIX_FMT_YUV420:
+        mLayout = Layout::PLANAR;
+        mChromaVsub = 2;
+        break;
+
+    case V4L2_PIX_FMT_YUV422P:
+        mLayout = Layout::PLANAR;
+        break;
+
+    case V4L2_PIX_FMT_GREY:
+        mLayout = Layout::GREY;
+        break;
+
+    default:
+        break;
+    }
+}
+
+void ImageAdjust::setValue(int type, int64_t value)
+{
+    auto range = getRange(type);
+
+    mValues[type] = std::min(std::max(value, range.min), range.max);
+
+    update();
+}
+
+int64_t ImageAdjust::getValue(int type) const
+{
+    getRange(type);
+
+    return mValues[type];
+}
+
+void ImageAdjust::update()
+{
+    int brightness = mValues[XENCAMERA_CTRL_BRIGHTNESS];
+    int contrast = mValues[XENCAMERA_CTRL_CONTRAST];
+    int saturation = mValues[XENCAMERA_CTRL_SATURATION];
+    int hue = mValues[XENCAMERA_CTRL_HUE];
+
+    mIdentity = !brightness && contrast == 128 &&
+        saturation == 128 && !hue;
+
+    /* Contrast is applied around the black level, then offset. */
+    mGain = contrast;
+    mOffset = (16 + brightness) * 128 - 16 * contrast + 64;
+
+    for (int y = 0; y < 256; y++)
+        mLut[y] = clampU8((y * mGain + mOffset) >> 7);
+
+    double angle = hue * M_PI / 180;
+    int c = std::lround(saturation * std::cos(angle));
+    int s = std::lround(saturation * std::sin(angle));
+
+    mMatrix[0] = c;
+    mMatrix[1] = -s;
+    mMatrix[2] = s;
+    mMatrix[3] = c;
+}
+
+void ImageAdjust::copy(const uint8_t *src, uint8_t *dst, size_t size)
+{
+    if (mIdentity || mLayout == Layout::NONE || size < mFormat.sizeimage) {
+        memcpy(dst, src, size);
+        return;
+    }
+
+    switch (mLayout) {
+    case Layout::PACKED:
+        copyPacked(src, dst);
+        break;
+
+    case Layout::SEMI_PLANAR:
+        copySemiPlanar(src, dst);
+        break;
+
+    case Layout::PLANAR:
+        copyPlanar(src, dst);
+        break;
+
+    case Layout::GREY:
+        copyLuma(src, dst);
+        break;
+
+    default:
+        break;
+    }
+}
+
+void ImageAdjust::copyLuma(const uint8_t *src, uint8_t *dst)
+{
+    size_t stride = mFormat.bytesperline;
+
+    for (size_t y = 0; y < mFormat.height; y++)
+        lumaRow(src + y * stride, dst + y * stride, mFormat.width,
+                mGain, mOffset, mLut);
+}
+
+void ImageAdjust::copyPacked(const uint8_t *src, uint8_t *dst)
+{
+    size_t stride = mFormat.bytesperline;
+
+    for (size_t y = 0; y < mFormat.height; y++)
+        packedRow(src + y * stride, dst + y * stride, mFormat.width / 2,
+                  mPacked, mGain, mOffset, mLut, mMatrix);
+}
+
+void ImageAdjust::copySemiPlanar(const uint8_t *src, uint8_t *dst)
+{
+    size_t stride = mFormat.bytesperline;
+    size_t offset = stride * mFormat.height;
+    /* V first: the matrix in pair order is reversed. */
+    const int swapped[] = { mMatrix[3], mMatrix[2], mMatrix[1], mMatrix[0] };
+    const int *m = mSwapUV ? swapped : mMatrix;
+
+    copyLuma(src, dst);
+
+    for (size_t y = 0; y < mFormat.height / mChromaVsub; y++)
+        chromaPairRow(src + offset + y * stride, dst + offset + y * stride,
+                      mFormat.width / 2, m);
+}
+
+void ImageAdjust::copyPlanar(const uint8_t *src, uint8_t *dst)
+{
+    size_t stride = mFormat.bytesperline / 2;
+    size_t height = mFormat.height / mChromaVsub;
+    size_t first = mFormat.bytesperline * mFormat.height;
+    size_t second = first + stride * height;
+    size_t offsetU = mSwapUV ? second : first;
+    size_t offsetV = mSwapUV ? first : second;
+
+    copyLuma(src, dst);
+
+    for (size_t y = 0; y < height; y++)
+        chromaPlanarRow(src + offsetU + y * stride, src + offsetV + y * stride,
+                        dst + offsetU + y * stride, dst + offsetV + y * stride,
+                        mFormat.width / 2, mMatrix);
+}
@@ -0,0 +1,89 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2018 EPAM Systems Inc.
+ */
+#ifndef SRC_IMAGEADJUST_HPP_
+#define SRC_IMAGEADJUST_HPP_
+
+#include <cstdint>
+#include <memory>
+
+#include <linux/videodev2.h>
+
+/*
+ * Brightness, contrast, saturation and hue of a single frontend, applied
+ * by the CPU while a frame is copied into the frontend's buffer, so
+ * frontends don't share (and fight over) the HW controls. Luma goes
+ * through a linear map and chroma through a 2x2 matrix scaling and
+ * rotating the (U, V) vector, both vectorized where rows allow it.
+ * The YUV formats the Scaler handles are supported, frames of the rest
+ * are copied as is.
+ */
+class ImageAdjust
+{
+public:
+    struct Range {
+        int64_t min;
+        int64_t max;
+        int64_t step;
+        int64_t def;
+    };
+
+    /* Xen control type to its range: throws for unsupported types. */
+    static Range getRange(int type);
+
+    ImageAdjust();
+
+    void setFormat(const v4l2_pix_format& fmt);
+
+    /* Values out of range are clamped. */
+    void setValue(int type, int64_t value);
+    int64_t getValue(int type) const;
+
+    void copy(const uint8_t *src, uint8_t *dst, size_t size);
+
+private:
+    enum class Layout {
+        NONE,
+        PACKED,
+        SEMI_PLANAR,
+        PLANAR,
+        GREY,
+    };
+
+    static const int cNumControls = 4;
+
+    int64_t mValues[cNumControls];
+
+    v4l2_pix_format mFormat;
+    Layout mLayout;
+    /* Chroma planes or samples come V first. */
+    bool mSwapUV;
+    int mChromaVsub;
+    /* Offsets of Y0, Y1, U and V within a packed macropixel. */
+    int mPacked[4];
+
+    bool mIdentity;
+
+    /* Luma: Y' = (Y * mGain + mOffset) >> 7. */
+    int mGain;
+    int mOffset;
+    uint8_t mLut[256];
+
+    /* Chroma: (U', V') = (mMatrix[0..1] . (U, V), mMatrix[2..3] . (U, V)). */
+    int mMatrix[4];
+
+    void update();
+
+    void copyPacked(const uint8_t *src, uint8_t *dst);
+    void copySemiPlanar(const uint8_t *src, uint8_t *dst);
+    void copyPlanar(const uint8_t *src, uint8_t *dst);
+    void copyLuma(const uint8_t *src, uint8_t *dst);
+};
+
+typedef std::unique_ptr<ImageAdjust> ImageAdjustPtr;
+
+#endif /* SRC_IMAGEADJUST_HPP_ */
@@ -0,0 +1,245 @@
+// SPDX-License-Identifier: GPL-2.0
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2018 EPAM Systems Inc.
+ */
+
+#include <algorithm>
+
+#include <xen/be/Exception.hpp>
+
+#include "JpegDecoder.hpp"
+#include "Scaler.hpp"
+
+using XenBackend::Exception;
+
+/* Number of scanlines asked from libjpeg at once. */
+static const int cNumRows = 16;
+
+JpegDecoder::JpegDecoder(uint32_t pixelFormat, uint32_t width,
+                         uint32_t height) :
+    mFormat(Scaler::getPixFormat(pixelFormat, width, height))
+{
+    if (!isSupported(V4L2_PIX_FMT_MJPEG, pixelFormat))
+        throw Exception("Can't decode MJPEG into " +
+                        std::to_string(pixelFormat), EINVAL);
+
+    mInfo.err = jpeg_std_error(&mError.pub);
+    mError.pub.error_exit = onError;
+    mError.pub.output_message = onMessage;
+
+    jpeg_create_decompress(&mInfo);
+
+    mRows.resize(static_cast<size_t>(cNumRows) * mFormat.width * 3);
+}
+
+JpegDecoder::~JpegDecoder()
+{
+    jpeg_destroy_decompress(&mInfo);
+}
+
+bool JpegDecoder::isSupported(uint32_t hwPixelFormat, uint32_t pixelFormat)
+{
+    if (hwPixelFormat != V4L2_PIX_FMT_MJPEG &&
+        hwPixelFormat != V4L2_PIX_FMT_JPEG)
+        return false;
+
+    switch (pixelFormat) {
+    case V4L2_PIX_FMT_YUYV:
+    case V4L2_PIX_FMT_YVYU:
+    case V4L2_PIX_FMT_UYVY:
+    case V4L2_PIX_FMT_VYUY:
+    case V4L2_PIX_FMT_NV12:
+    case V4L2_PIX_FMT_NV21:
+    case V4L2_PIX_FMT_NV16:
+    case V4L2_PIX_FMT_NV61:
+    case V4L2_PIX_FMT_YUV420:
+    case V4L2_PIX_FMT_YVU420:
+    case V4L2_PIX_FMT_YUV422P:
+    case V4L2_PIX_FMT_GREY:
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+void JpegDecoder::onError(j_common_ptr info)
+{
+    auto error = reinterpret_cast<ErrorManager *>(info->err);
+
+    (*info->err->format_message)(info, error->message);
+
+    longjmp(error->jmpBuf, 1);
+}
+
+void JpegDecoder::onMessage(j_common_ptr info)
+{
+    /*
+     * Warnings about slightly corrupt data are common with MJPEG
+     * cameras: such frames are still good enough, so keep quiet.
+     */
+}
+
+void JpegDecoder::decode(const uint8_t *src, size_t size, uint8_t *dst)
+{
+    /* No C++ objects live in this frame, so it is safe to jump back. */
+    if (setjmp(mError.jmpBuf)) {
+        jpeg_abort_decompress(&mInfo);
+
+        throw Exception(std::string("Failed to decode MJPEG frame: ") +
+                        mError.message, EIO);
+    }
+
+    decodeRows(src, size, dst);
+}
+
+void JpegDecoder::decodeRows(const uint8_t *src, size_t size, uint8_t *dst)
+{
+    /*
+     * UVC cameras may omit Huffman tables in MJPEG frames:
+     * libjpeg falls back to the standard ones then.
+     */
+    jpeg_mem_src(&mInfo, const_cast<uint8_t *>(src), size);
+    jpeg_read_header(&mInfo, TRUE);
+
+    if (mInfo.image_width < mFormat.width ||
+        mInfo.image_height < mFormat.height) {
+        jpeg_abort_decompress(&mInfo);
+
+        throw Exception("MJPEG frame is " + std::to_string(mInfo.image_width) +
+                        "x" + std::to_string(mInfo.image_height) +
+                        ", expected " + std::to_string(mFormat.width) + "x" +
+                        std::to_string(mFormat.height), EINVAL);
+    }
+
+    /* Chroma is subsampled again when packing, so favour speed. */
+    mInfo.out_color_space = JCS_YCbCr;
+    mInfo.dct_method = JDCT_IFAST;
+    mInfo.do_fancy_upsampling = FALSE;
+    mInfo.do_block_smoothing = FALSE;
+
+    jpeg_start_decompress(&mInfo);
+
+    size_t stride = static_cast<size_t>(mInfo.output_width) * 3;
+
+    if (mRows.size() < stride * cNumRows)
+        mRows.resize(stride * cNumRows);
+
+    JSAMPROW rows[cNumRows];
+
+    for (int i = 0; i < cNumRows; i++)
+        rows[i] = &mRows[i * stride];
+
+    while (mInfo.output_scanline < mInfo.output_height) {
+        uint32_t y = mInfo.output_scanline;
+        int num = jpeg_read_scanlines(&mInfo, rows, cNumRows);
+
+        for (int i = 0; i < num && y + i < mFormat.height; i++)
+            packRow(rows[i], y + i, dst);
+    }
+
+    jpeg_finish_decompress(&mInfo);
+}
+
+/* Packs a row of YCbCr triplets into the output format. */
+void JpegDecoder::packRow(const uint8_t *row, uint32_t y, uint8_t *dst)
+{
+    const uint32_t width = mFormat.width;
+    const size_t lumaSize = static_cast<size_t>(width) * mFormat.height;
+
+    switch (mFormat.pixelformat) {
+    case V4L2_PIX_FMT_YUYV:
+    case V4L2_PIX_FMT_YVYU:
+    case V4L2_PIX_FMT_UYVY:
+    case V4L2_PIX_FMT_VYUY:
+    {
+        /* Byte offsets of Y0, Cb, Y1, Cr within a macropixel. */
+        int y0, cb, y1, cr;
+
+        switch (mFormat.pixelformat) {
+        case V4L2_PIX_FMT_YUYV:
+            y0 = 0; cb = 1; y1 = 2; cr = 3;
+            break;
+        case V4L2_PIX_FMT_YVYU:
+            y0 = 0; cr = 1; y1 = 2; cb = 3;
+            break;
+        case V4L2_PIX_FMT_UYVY:
+            cb = 0; y0 = 1; cr = 2; y1 = 3;
+            break;
+        default:
+            cr = 0; y0 = 1; cb = 2; y1 = 3;
+            break;
+        }
+
+        uint8_t *out = dst + static_cast<size_t>(y) * mFormat.bytesperline;
+
+        for (uint32_t x = 0; x < width; x += 2, row += 6, out += 4) {
+            out[y0] = row[0];
+            out[cb] = row[1];
+            out[y1] = row[3];
+            out[cr] = row[2];
+        }
+        break;
+    }
+
+    case V4L2_PIX_FMT_GREY:
+    case V4L2_PIX_FMT_NV12:
+    case V4L2_PIX_FMT_NV21:
+    case V4L2_PIX_FMT_NV16:
+    case V4L2_PIX_FMT_NV61:
+    case V4L2_PIX_FMT_YUV420:
+    case V4L2_PIX_FMT_YVU420:
+    case V4L2_PIX_FMT_YUV422P:
+    {
+        uint8_t *luma = dst + static_cast<size_t>(y) * width;
+
+        for (uint32_t x = 0; x < width; x++)
+            luma[x] = row[3 * x];
+
+        bool is420 = mFormat.pixelformat == V4L2_PIX_FMT_NV12 ||
+            mFormat.pixelformat == V4L2_PIX_FMT_NV21 ||
+            mFormat.pixelformat == V4L2_PIX_FMT_YUV420 ||
+            mFormat.pixelformat == V4L2_PIX_FMT_YVU420;
+
+        if (mFormat.pixelformat == V4L2_PIX_FMT_GREY || (is420 && (y & 1)))
+            break;
+
+        uint32_t cy = is420 ? y / 2 : y;
+        uint8_t *chroma = dst + lumaSize;
+
+        if (mFormat.pixelformat == V4L2_PIX_FMT_NV12 ||
+            mFormat.pixelformat == V4L2_PIX_FMT_NV21 ||
+            mFormat.pixelformat == V4L2_PIX_FMT_NV16 ||
+            mFormat.pixelformat == V4L2_PIX_FMT_NV61) {
+            bool swap = mFormat.pixelformat == V4L2_PIX_FMT_NV21 ||
+                mFormat.pixelformat == V4L2_PIX_FMT_NV61;
+            uint8_t *out = chroma + static_cast<size_t>(cy) * width;
+
+            for (uint32_t x = 0; x < width; x += 2, out += 2) {
+                out[swap] = row[3 * x + 1];
+                out[!swap] = row[3 * x + 2];
+            }
+        } else {
+            size_t planeSize = static_cast<size_t>(width / 2) *
+                (is420 ? mFormat.height / 2 : mFormat.height);
+            bool swap = mFormat.pixelformat == V4L2_PIX_FMT_YVU420;
+            uint8_t *cbOut = chroma + swap * planeSize +
+                static_cast<size_t>(cy) * (width / 2);
+            uint8_t *crOut = chroma + !swap * planeSize +
+                static_cast<size_t>(cy) * (width / 2);
+
+            for (uint32_t x = 0; x < width; x += 2) {
+                *cbOut++ = row[3 * x + 1];
+                *crOut++ = row[3 * x + 2];
+            }
+        }
+        break;
+    }
+
+    default:
+        break;
+    }
+}
@@ -0,0 +1,65 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2018 EPAM Systems Inc.
+ */
+#ifndef SRC_JPEGDECODER_HPP_
+#define SRC_JPEGDECODER_HPP_
+
+#include <csetjmp>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <vector>
+
+#include <jpeglib.h>
+
+#include <linux/videodev2.h>
+
+/*
+ * Decodes MJPEG frames of the hardware stream into a raw YUV format for
+ * frontends which can't take compressed frames. Frames are decoded to
+ * YCbCr scanlines by libjpeg (SIMD accelerated with libjpeg-turbo) and
+ * packed into the frontend's format on the fly. The output is laid out as
+ * Scaler::getPixFormat describes, so it can be scaled further.
+ */
+class JpegDecoder
+{
+public:
+    JpegDecoder(uint32_t pixelFormat, uint32_t width, uint32_t height);
+    ~JpegDecoder();
+
+    const v4l2_pix_format& getFormat() const {
+        return mFormat;
+    }
+
+    void decode(const uint8_t *src, size_t size, uint8_t *dst);
+
+    static bool isSupported(uint32_t hwPixelFormat, uint32_t pixelFormat);
+
+private:
+    struct ErrorManager {
+        jpeg_error_mgr pub;
+        jmp_buf jmpBuf;
+        char message[JMSG_LENGTH_MAX];
+    };
+
+    v4l2_pix_format mFormat;
+
+    jpeg_decompress_struct mInfo;
+    ErrorManager mError;
+
+    std::vector<uint8_t> mRows;
+
+    static void onError(j_common_ptr info);
+    static void onMessage(j_common_ptr info);
+
+    void decodeRows(const uint8_t *src, size_t size, uint8_t *dst);
+    void packRow(const uint8_t *row, uint32_t y, uint8_t *dst);
+};
+
+typedef std::unique_ptr<JpegDecoder> JpegDecoderPtr;
+
+#endif /* SRC_JPEGDECODER_HPP_ */
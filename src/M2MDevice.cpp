@@ -0,0 +1,372 @@
+// SPDX-License-Identifier: GPL-2.0
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2018 EPAM Systems Inc.
+ */
+
+#include <cstring>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include <xen/be/Exception.hpp>
+
+#include "M2MDevice.hpp"
+
+using XenBackend::Exception;
+
+M2MDevice::M2MDevice(const std::string devPath, const v4l2_pix_format& in,
+                     const v4l2_pix_format& out, int numInBuffers) :
+    mLog("M2MDevice"),
+    mDevPath(devPath),
+    mFd(-1),
+    mInFormat(in),
+    mOutFormat(out),
+    mNumInBuffers(numInBuffers),
+    mDequeuedIndex(-1),
+    mPending(false)
+{
+    try {
+        init();
+    } catch (...) {
+        release();
+        throw;
+    }
+}
+
+M2MDevice::~M2MDevice()
+{
+    release();
+}
+
+bool M2MDevice::isSupported(const std::string devPath,
+                            const v4l2_pix_format& in,
+                            v4l2_pix_format& out)
+{
+    try {
+        M2MDevice device(devPath, in, out, 1);
+
+        out = device.getFormat();
+    } catch (const std::exception& e) {
+        LOG("M2MDevice", DEBUG) << "Can't use " << devPath << ": " <<
+            e.what();
+        return false;
+    }
+
+    return true;
+}
+
+void M2MDevice::init()
+{
+    LOG(mLog, DEBUG) << "Initializing mem2mem device " << mDevPath <<
+        " for " << mInFormat.width << "x" << mInFormat.height << " -> " <<
+        mOutFormat.width << "x" << mOutFormat.height;
+
+    open();
+
+    if (!isM2MDevice())
+        throw Exception(mDevPath + " is not a mem2mem device", ENOTTY);
+
+    uint32_t stride = mInFormat.bytesperline;
+    v4l2_pix_format wanted = mOutFormat;
+
+    formatSet(cV4L2OutType, mInFormat);
+
+    /* Frames come from the camera as they are, we can't restride them. */
+    if (mInFormat.bytesperline != stride)
+        throw Exception("Wrong input stride for device " + mDevPath, EINVAL);
+
+    formatSet(cV4L2CapType, mOutFormat);
+
+    if (mOutFormat.pixelformat != wanted.pixelformat ||
+        mOutFormat.width != wanted.width ||
+        mOutFormat.height != wanted.height)
+        throw Exception("Unsupported output format for device " + mDevPath,
+                        EINVAL);
+
+    bufferRequest(cV4L2OutType, V4L2_MEMORY_DMABUF, mNumInBuffers);
+    bufferRequest(cV4L2CapType, V4L2_MEMORY_MMAP, 2);
+
+    for (size_t i = 0; i < mBuffers.size(); i++)
+        bufferQueue(i);
+
+    streamOn();
+}
+
+void M2MDevice::release()
+{
+    if (mFd < 0)
+        return;
+
+    streamOff();
+
+    for (auto const& buffer: mBuffers)
+        munmap(buffer.data, buffer.size);
+
+    mBuffers.clear();
+
+    close();
+}
+
+int M2MDevice::xioctl(int request, void *arg)
+{
+    int ret;
+
+    do {
+        ret = ioctl(mFd, request, arg);
+    } while (ret == -1 && errno == EINTR);
+
+    return ret;
+}
+
+void M2MDevice::open()
+{
+    int fd = ::open(mDevPath.c_str(), O_RDWR | O_NONBLOCK, 0);
+
+    if (fd < 0)
+        throw Exception("Cannot open " + mDevPath + " mem2mem device: " +
+                        strerror(errno), errno);
+
+    mFd = fd;
+}
+
+void M2MDevice::close()
+{
+    if (mFd >= 0)
+        ::close(mFd);
+
+    mFd = -1;
+}
+
+bool M2MDevice::isM2MDevice()
+{
+    v4l2_capability cap {0};
+
+    if (xioctl(VIDIOC_QUERYCAP, &cap) < 0)
+        return false;
+
+    uint32_t caps = cap.capabilities & V4L2_CAP_DEVICE_CAPS ?
+        cap.device_caps : cap.capabilities;
+
+    /* Only single-planar devices are used: multi-planar ones are skipped. */
+    if (!(caps & V4L2_CAP_VIDEO_M2M)) {
+        LOG(mLog, DEBUG) << mDevPath << " is not a single-planar M2M device";
+        return false;
+    }
+
+    if (!(caps & V4L2_CAP_STREAMING)) {
+        LOG(mLog, DEBUG) << mDevPath << " does not support streaming IO";
+        return false;
+    }
+
+    return true;
+}
+
+void M2MDevice::formatSet(v4l2_buf_type type, v4l2_pix_format& pix)
+{
+    v4l2_format fmt {0};
+
+    fmt.type = type;
+    fmt.fmt.pix = pix;
+
+    if (xioctl(VIDIOC_S_FMT, &fmt) < 0)
+        throw Exception("Failed to call [VIDIOC_S_FMT] for device " +
+                        mDevPath, errno);
+
+    pix = fmt.fmt.pix;
+}
+
+void M2MDevice::bufferRequest(v4l2_buf_type type, v4l2_memory memory, int num)
+{
+    v4l2_requestbuffers req {0};
+
+    req.count = num;
+    req.type = type;
+    req.memory = memory;
+
+    if (xioctl(VIDIOC_REQBUFS, &req) < 0)
+        throw Exception("Failed to call [VIDIOC_REQBUFS] for device " +
+                        mDevPath, errno);
+
+    if (type == cV4L2OutType) {
+        mNumInBuffers = req.count;
+        return;
+    }
+
+    for (uint32_t i = 0; i < req.count; i++) {
+        v4l2_buffer buf {0};
+
+        buf.type = type;
+        buf.memory = memory;
+        buf.index = i;
+
+        if (xioctl(VIDIOC_QUERYBUF, &buf) < 0)
+            throw Exception("Failed to call [VIDIOC_QUERYBUF] for device " +
+                            mDevPath, errno);
+
+        void *start = mmap(nullptr, buf.length, PROT_READ | PROT_WRITE,
+                           MAP_SHARED, mFd, buf.m.offset);
+
+        if (start == MAP_FAILED)
+            throw Exception("Failed to mmap buffer for device " +
+                            mDevPath, errno);
+
+        mBuffers.push_back(
+            {
+                .size = static_cast<size_t>(buf.length),
+                .data = start,
+                .bytesUsed = 0
+            }
+        );
+    }
+}
+
+void M2MDevice::bufferQueue(int index)
+{
+    v4l2_buffer buf {0};
+
+    buf.type = cV4L2CapType;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = index;
+
+    if (xioctl(VIDIOC_QBUF, &buf) < 0)
+        throw Exception("Failed to call [VIDIOC_QBUF] for device " +
+                        mDevPath, errno);
+}
+
+void M2MDevice::streamOn()
+{
+    v4l2_buf_type type = cV4L2OutType;
+
+    if (xioctl(VIDIOC_STREAMON, &type) < 0)
+        throw Exception("Failed to start output stream for device " +
+                        mDevPath, errno);
+
+    type = cV4L2CapType;
+
+    if (xioctl(VIDIOC_STREAMON, &type) < 0)
+        throw Exception("Failed to start capture stream for device " +
+                        mDevPath, errno);
+}
+
+void M2MDevice::streamOff()
+{
+    v4l2_buf_type type = cV4L2CapType;
+
+    if (xioctl(VIDIOC_STREAMOFF, &type) < 0)
+        LOG(mLog, ERROR) << "Failed to stop capture stream for " << mDevPath;
+
+    type = cV4L2OutType;
+
+    if (xioctl(VIDIOC_STREAMOFF, &type) < 0)
+        LOG(mLog, ERROR) << "Failed to stop output stream for " << mDevPath;
+}
+
+bool M2MDevice::waitReady(int timeoutMs)
+{
+    pollfd fds {0};
+
+    fds.fd = mFd;
+    fds.events = POLLIN;
+
+    int ret;
+
+    do {
+        ret = poll(&fds, 1, timeoutMs);
+    } while (ret == -1 && errno == EINTR);
+
+    if (ret < 0)
+        throw Exception("Failed to poll device " + mDevPath, errno);
+
+    if (!ret)
+        return false;
+
+    if (fds.revents & POLLERR)
+        throw Exception("Error while processing frame on device " +
+                        mDevPath, EIO);
+
+    return true;
+}
+
+int M2MDevice::dequeue()
+{
+    v4l2_buffer capBuf {0};
+
+    capBuf.type = cV4L2CapType;
+    capBuf.memory = V4L2_MEMORY_MMAP;
+
+    if (xioctl(VIDIOC_DQBUF, &capBuf) < 0)
+        throw Exception("Failed to call [VIDIOC_DQBUF] for device " +
+                        mDevPath, errno);
+
+    mDequeuedIndex = capBuf.index;
+    mBuffers[capBuf.index].bytesUsed = capBuf.bytesused;
+
+    /* The source buffer is done by the time the result is ready. */
+    v4l2_buffer buf {0};
+
+    buf.type = cV4L2OutType;
+    buf.memory = V4L2_MEMORY_DMABUF;
+
+    if (xioctl(VIDIOC_DQBUF, &buf) < 0)
+        throw Exception("Failed to call [VIDIOC_DQBUF] for device " +
+                        mDevPath, errno);
+
+    return capBuf.index;
+}
+
+const uint8_t *M2MDevice::process(int index, int dmabufFd, size_t length,
+                                  size_t bytesUsed, size_t& size,
+                                  int timeoutMs)
+{
+    /*
+     * The frame which timed out last time is stale by now: collect it
+     * if it is done or drop this one as well, the output queue is busy.
+     */
+    if (mPending) {
+        if (!waitReady(0))
+            return nullptr;
+
+        dequeue();
+        mPending = false;
+    }
+
+    /* Give back the result of the previous run. */
+    if (mDequeuedIndex >= 0) {
+        bufferQueue(mDequeuedIndex);
+        mDequeuedIndex = -1;
+    }
+
+    v4l2_buffer buf {0};
+
+    buf.type = cV4L2OutType;
+    buf.memory = V4L2_MEMORY_DMABUF;
+    buf.index = index % mNumInBuffers;
+    buf.m.fd = dmabufFd;
+    buf.length = length;
+    buf.bytesused = bytesUsed;
+    buf.field = V4L2_FIELD_NONE;
+
+    if (xioctl(VIDIOC_QBUF, &buf) < 0)
+        throw Exception("Failed to queue DMABUF to device " + mDevPath, errno);
+
+    if (!waitReady(timeoutMs)) {
+        LOG(mLog, DEBUG) << "Frame is not ready in " << timeoutMs <<
+            " ms on " << mDevPath << ", dropped";
+
+        mPending = true;
+        return nullptr;
+    }
+
+    int capIndex = dequeue();
+
+    size = mBuffers[capIndex].bytesUsed;
+
+    return static_cast<const uint8_t *>(mBuffers[capIndex].data);
+}
@@ -0,0 +1,100 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2018 EPAM Systems Inc.
+ */
+#ifndef SRC_M2MDEVICE_HPP_
+#define SRC_M2MDEVICE_HPP_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <linux/videodev2.h>
+
+#include <xen/be/Log.hpp>
+
+/*
+ * A context of a V4L2 memory-to-memory device, e.g. HW scaler/CSC.
+ * Frames are fed into the device's output queue as DMABUFs exported
+ * from the camera and the result is read from its capture queue.
+ * Every object opens the device anew, so it gets its own M2M context.
+ */
+class M2MDevice
+{
+public:
+    M2MDevice(const std::string devPath, const v4l2_pix_format& in,
+              const v4l2_pix_format& out, int numInBuffers);
+    ~M2MDevice();
+
+    const v4l2_pix_format& getFormat() const {
+        return mOutFormat;
+    }
+
+    /*
+     * Process the frame in the DMABUF given and return the result:
+     * it stays valid until the next call. If the device doesn't finish
+     * within timeoutMs the frame is dropped and nullptr is returned, so
+     * the caller never waits longer than that.
+     */
+    const uint8_t *process(int index, int dmabufFd, size_t length,
+                           size_t bytesUsed, size_t& size, int timeoutMs);
+
+    /*
+     * Check if the device can convert in into out and, if so, update out
+     * with the resulting layout.
+     */
+    static bool isSupported(const std::string devPath,
+                            const v4l2_pix_format& in,
+                            v4l2_pix_format& out);
+
+private:
+    XenBackend::Log mLog;
+
+    const std::string mDevPath;
+    int mFd;
+
+    static const v4l2_buf_type cV4L2OutType = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    static const v4l2_buf_type cV4L2CapType = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    v4l2_pix_format mInFormat;
+    v4l2_pix_format mOutFormat;
+
+    int mNumInBuffers;
+
+    struct Buffer {
+        size_t size;
+        void *data;
+        size_t bytesUsed;
+    };
+
+    std::vector<Buffer> mBuffers;
+
+    int mDequeuedIndex;
+    /* A frame timed out and is still being processed by the device. */
+    bool mPending;
+
+    void init();
+    void release();
+
+    int xioctl(int request, void *arg);
+
+    void open();
+    void close();
+    bool isM2MDevice();
+
+    void formatSet(v4l2_buf_type type, v4l2_pix_format& fmt);
+    void bufferRequest(v4l2_buf_type type, v4l2_memory memory, int num);
+    void bufferQueue(int index);
+    void streamOn();
+    void streamOff();
+
+    bool waitReady(int timeoutMs);
+    int dequeue();
+};
+
+typedef std::unique_ptr<M2MDevice> M2MDevicePtr;
+
+#endif /* SRC_M2MDEVICE_HPP_ */
@@ -0,0 +1,378 @@
+// SPDX-License-Identifier: GPL-2.0
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2018 EPAM Systems Inc.
+ */
+
+#include <algorithm>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include <xen/be/Exception.hpp>
+
+#include "Scaler.hpp"
+
+using XenBackend::Exception;
+
+namespace {
+
+/*
+ * dst = (a * (256 - w) + b * w) / 256, w in [1, 255]: this is the vertical
+ * pass of the bilinear filter, done on whole rows so it vectorizes nicely.
+ */
+void blendRows(const uint8_t *a, const uint8_t *b, uint8_t *dst,
+               size_t n, int w)
+{
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    const __m128i wa = _mm_set1_epi16(256 - w);
+    const __m128i wb = _mm_set1_epi16(w);
+    const __m128i round = _mm_set1_epi16(128);
+    const __m128i zero = _mm_setzero_si128();
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i));
+        __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i));
+
+        __m128i lo = _mm_add_epi16(
+            _mm_mullo_epi16(_mm_unpacklo_epi8(va, zero), wa),
+            _mm_mullo_epi16(_mm_unpacklo_epi8(vb, zero), wb));
+        __m128i hi = _mm_add_epi16(
+            _mm_mullo_epi16(_mm_unpackhi_epi8(va, zero), wa),
+            _mm_mullo_epi16(_mm_unpackhi_epi8(vb, zero), wb));
+
+        lo = _mm_srli_epi16(_mm_add_epi16(lo, round), 8);
+        hi = _mm_srli_epi16(_mm_add_epi16(hi, round), 8);
+
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i),
+                         _mm_packus_epi16(lo, hi));
+    }
+#elif defined(__ARM_NEON)
+    const uint8x8_t wa = vdup_n_u8(256 - w);
+    const uint8x8_t wb = vdup_n_u8(w);
+
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t va = vld1q_u8(a + i);
+        uint8x16_t vb = vld1q_u8(b + i);
+
+        uint16x8_t lo = vmull_u8(vget_low_u8(va), wa);
+        uint16x8_t hi = vmull_u8(vget_high_u8(va), wa);
+
+        lo = vmlal_u8(lo, vget_low_u8(vb), wb);
+        hi = vmlal_u8(hi, vget_high_u8(vb), wb);
+
+        vst1q_u8(dst + i, vcombine_u8(vrshrn_n_u16(lo, 8),
+                                      vrshrn_n_u16(hi, 8)));
+    }
+#endif
+
+    for (; i < n; i++)
+        dst[i] = (a[i] * (256 - w) + b[i] * w + 128) >> 8;
+}
+
+/*
+ * Vertical pass of the box filter: plain loops the compiler vectorizes.
+ * Sums are 32 bit, as a box may span more than 257 rows of 255.
+ */
+void accumulateRow(const uint8_t *row, uint32_t *acc, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        acc[i] += row[i];
+}
+
+/* The rounded reciprocal may overshoot 255 by a little for large boxes. */
+inline uint8_t average(uint32_t sum, uint32_t recip)
+{
+    return std::min<uint64_t>((static_cast<uint64_t>(sum) * recip +
+                               0x8000) >> 16, 255);
+}
+
+void averageRow(const uint32_t *acc, uint8_t *dst, size_t n, uint32_t recip)
+{
+    for (size_t i = 0; i < n; i++)
+        dst[i] = average(acc[i], recip);
+}
+
+}
+
+Scaler::Scaler(const v4l2_pix_format& src, uint32_t width, uint32_t height,
+               Filter filter) :
+    mSrc(src)
+{
+    mDst = getPixFormat(src.pixelformat, width, height);
+
+    mDst.field = src.field;
+    mDst.colorspace = src.colorspace;
+    mDst.ycbcr_enc = src.ycbcr_enc;
+    mDst.quantization = src.quantization;
+    mDst.xfer_func = src.xfer_func;
+
+    init(filter);
+}
+
+bool Scaler::getPlaneInfo(uint32_t pixelFormat,
+                          std::vector<PlaneInfo>& planes)
+{
+    const PlaneInfo luma = { 1, 1, 1, { { 0, 1, 1 } } };
+
+    switch (pixelFormat) {
+    case V4L2_PIX_FMT_YUYV:
+    case V4L2_PIX_FMT_YVYU:
+        planes = { { 1, 2, 1, { { 0, 2, 1 }, { 1, 4, 2 }, { 3, 4, 2 } } } };
+        return true;
+
+    case V4L2_PIX_FMT_UYVY:
+    case V4L2_PIX_FMT_VYUY:
+        planes = { { 1, 2, 1, { { 1, 2, 1 }, { 0, 4, 2 }, { 2, 4, 2 } } } };
+        return true;
+
+    case V4L2_PIX_FMT_NV12:
+    case V4L2_PIX_FMT_NV21:
+        planes = { luma, { 2, 1, 1, { { 0, 2, 2 }, { 1, 2, 2 } } } };
+        return true;
+
+    case V4L2_PIX_FMT_NV16:
+    case V4L2_PIX_FMT_NV61:
+        planes = { luma, { 1, 1, 1, { { 0, 2, 2 }, { 1, 2, 2 } } } };
+        return true;
+
+    case V4L2_PIX_FMT_YUV420:
+    case V4L2_PIX_FMT_YVU420:
+        planes = { luma, { 2, 1, 2, { { 0, 1, 2 } } },
+                   { 2, 1, 2, { { 0, 1, 2 } } } };
+        return true;
+
+    case V4L2_PIX_FMT_YUV422P:
+        planes = { luma, { 1, 1, 2, { { 0, 1, 2 } } },
+                   { 1, 1, 2, { { 0, 1, 2 } } } };
+        return true;
+
+    case V4L2_PIX_FMT_GREY:
+        planes = { luma };
+        return true;
+
+    default:
+        break;
+    }
+
+    return false;
+}
+
+size_t Scaler::getPlaneStride(const PlaneInfo& info, size_t stride)
+{
+    /* For multi-plane formats the luma plane is always 1 byte per pixel. */
+    return stride * info.rowNum / info.rowDen;
+}
+
+bool Scaler::isSupported(uint32_t pixelFormat)
+{
+    std::vector<PlaneInfo> planes;
+
+    return getPlaneInfo(pixelFormat, planes);
+}
+
+v4l2_pix_format Scaler::getPixFormat(uint32_t pixelFormat,
+                                     uint32_t width, uint32_t height)
+{
+    std::vector<PlaneInfo> planes;
+
+    if (!getPlaneInfo(pixelFormat, planes))
+        throw Exception("Unsupported pixel format for scaling " +
+                        std::to_string(pixelFormat), EINVAL);
+
+    /* Subsampled formats need even dimensions. */
+    width &= ~1u;
+    for (auto const& plane: planes)
+        if (plane.vsub > 1)
+            height &= ~1u;
+
+    if (!width || !height)
+        throw Exception("Wrong size to scale to " + std::to_string(width) +
+                        "x" + std::to_string(height), EINVAL);
+
+    v4l2_pix_format fmt {0};
+
+    fmt.pixelformat = pixelFormat;
+    fmt.width = width;
+    fmt.height = height;
+    fmt.field = V4L2_FIELD_NONE;
+    fmt.bytesperline = width * planes[0].rowNum / planes[0].rowDen;
+
+    for (size_t i = 0; i < planes.size(); i++) {
+        size_t stride = i ? getPlaneStride(planes[i], fmt.bytesperline) :
+            fmt.bytesperline;
+
+        fmt.sizeimage += stride * (height / planes[i].vsub);
+    }
+
+    return fmt;
+}
+
+bool Scaler::useBox(Filter filter, int srcSize, int dstSize)
+{
+    if (filter == Filter::AUTO)
+        return srcSize >= 2 * dstSize;
+
+    return filter == Filter::BOX;
+}
+
+std::vector<Scaler::Tap> Scaler::getTaps(int srcSize, int dstSize, bool box)
+{
+    std::vector<Tap> taps(dstSize);
+
+    for (int i = 0; i < dstSize; i++) {
+        Tap& tap = taps[i];
+
+        if (box) {
+            tap.x0 = static_cast<int64_t>(i) * srcSize / dstSize;
+            tap.x1 = std::max(static_cast<int>(
+                static_cast<int64_t>(i + 1) * srcSize / dstSize), tap.x0 + 1);
+            /* Rounded reciprocal of the number of taps in 16.16. */
+            tap.weight = (0x10000 + (tap.x1 - tap.x0) / 2) /
+                (tap.x1 - tap.x0);
+            continue;
+        }
+
+        /* Sample center in 1/256 of the source pixel. */
+        int64_t center = ((2 * static_cast<int64_t>(i) + 1) * srcSize -
+                          dstSize) * 256 / (2 * dstSize);
+
+        center = std::max(center, static_cast<int64_t>(0));
+
+        tap.x0 = center >> 8;
+        tap.weight = center & 0xff;
+
+        if (tap.x0 >= srcSize - 1) {
+            tap.x0 = srcSize - 1;
+            tap.weight = 0;
+        }
+
+        tap.x1 = std::min(tap.x0 + 1, srcSize - 1);
+    }
+
+    return taps;
+}
+
+void Scaler::init(Filter filter)
+{
+    std::vector<PlaneInfo> planes;
+
+    if (!getPlaneInfo(mSrc.pixelformat, planes))
+        throw Exception("Unsupported pixel format for scaling " +
+                        std::to_string(mSrc.pixelformat), EINVAL);
+
+    size_t srcOffset = 0;
+    size_t dstOffset = 0;
+    size_t maxRowBytes = 0;
+
+    for (size_t i = 0; i < planes.size(); i++) {
+        const PlaneInfo& info = planes[i];
+        Plane plane;
+
+        plane.srcStride = i ? getPlaneStride(info, mSrc.bytesperline) :
+            mSrc.bytesperline;
+        plane.srcRowBytes = mSrc.width * info.rowNum / info.rowDen;
+        plane.srcHeight = mSrc.height / info.vsub;
+        plane.srcOffset = srcOffset;
+
+        plane.dstStride = i ? getPlaneStride(info, mDst.bytesperline) :
+            mDst.bytesperline;
+        plane.dstHeight = mDst.height / info.vsub;
+        plane.dstOffset = dstOffset;
+
+        plane.boxV = useBox(filter, plane.srcHeight, plane.dstHeight);
+        plane.rows = getTaps(plane.srcHeight, plane.dstHeight, plane.boxV);
+
+        for (auto const& comp: info.comps) {
+            Plane::Column column;
+            int srcWidth = mSrc.width / comp.hsub;
+            int dstWidth = mDst.width / comp.hsub;
+
+            column.comp = comp;
+            column.boxH = useBox(filter, srcWidth, dstWidth);
+            column.taps = getTaps(srcWidth, dstWidth, column.boxH);
+
+            plane.columns.push_back(column);
+        }
+
+        srcOffset += plane.srcStride * plane.srcHeight;
+        dstOffset += plane.dstStride * plane.dstHeight;
+        maxRowBytes = std::max(maxRowBytes, plane.srcRowBytes);
+
+        mPlanes.push_back(plane);
+    }
+
+    if (srcOffset > mSrc.sizeimage)
+        throw Exception("Source image is too small to scale from", EINVAL);
+
+    mRow.resize(maxRowBytes);
+    mAcc.resize(maxRowBytes);
+}
+
+void Scaler::scale(const uint8_t *src, uint8_t *dst)
+{
+    for (auto const& plane: mPlanes)
+        scalePlane(plane, src + plane.srcOffset, dst + plane.dstOffset);
+}
+
+void Scaler::scalePlane(const Plane& plane, const uint8_t *src, uint8_t *dst)
+{
+    size_t n = plane.srcRowBytes;
+
+    for (int y = 0; y < plane.dstHeight; y++) {
+        const Tap& tap = plane.rows[y];
+        const uint8_t *row = src + tap.x0 * plane.srcStride;
+
+        if (plane.boxV && tap.x1 - tap.x0 > 1) {
+            std::fill(mAcc.begin(), mAcc.begin() + n, 0);
+
+            for (int i = tap.x0; i < tap.x1; i++)
+                accumulateRow(src + i * plane.srcStride, mAcc.data(), n);
+
+            averageRow(mAcc.data(), mRow.data(), n, tap.weight);
+            row = mRow.data();
+        } else if (!plane.boxV && tap.weight) {
+            blendRows(row, src + tap.x1 * plane.srcStride, mRow.data(),
+                      n, tap.weight);
+            row = mRow.data();
+        }
+
+        scaleRow(plane, row, dst + y * plane.dstStride);
+    }
+}
+
+void Scaler::scaleRow(const Plane& plane, const uint8_t *row, uint8_t *dst)
+{
+    for (auto const& column: plane.columns) {
+        const int step = column.comp.step;
+        const uint8_t *in = row + column.comp.offset;
+        uint8_t *out = dst + column.comp.offset;
+        size_t numTaps = column.taps.size();
+
+        if (column.boxH) {
+            for (size_t i = 0; i < numTaps; i++) {
+                const Tap& tap = column.taps[i];
+                uint32_t sum = 0;
+
+                for (int x = tap.x0; x < tap.x1; x++)
+                    sum += in[x * step];
+
+                out[i * step] = average(sum, tap.weight);
+            }
+        } else {
+            for (size_t i = 0; i < numTaps; i++) {
+                const Tap& tap = column.taps[i];
+
+                out[i * step] = (in[tap.x0 * step] * (256 - tap.weight) +
+                                 in[tap.x1 * step] * tap.weight + 128) >> 8;
+            }
+        }
+    }
+}
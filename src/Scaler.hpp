@@ -0,0 +1,115 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2018 EPAM Systems Inc.
+ */
+#ifndef SRC_SCALER_HPP_
+#define SRC_SCALER_HPP_
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <linux/videodev2.h>
+
+/*
+ * Downscales frames of the hardware stream to the size a frontend has
+ * asked for. Both packed (YUYV and friends) and (semi-)planar YUV formats
+ * are supported. Scaling is done in two passes per plane: a vertical pass
+ * which works on whole rows and is vectorized, and a horizontal pass driven
+ * by precomputed per-column tables.
+ */
+class Scaler
+{
+public:
+    enum class Filter {
+        AUTO,
+        BOX,
+        BILINEAR,
+    };
+
+    Scaler(const v4l2_pix_format& src, uint32_t width, uint32_t height,
+           Filter filter = Filter::AUTO);
+
+    const v4l2_pix_format& getFormat() const {
+        return mDst;
+    }
+
+    void scale(const uint8_t *src, uint8_t *dst);
+
+    static bool isSupported(uint32_t pixelFormat);
+
+    /* Layout of a tightly packed image of the given format and size. */
+    static v4l2_pix_format getPixFormat(uint32_t pixelFormat,
+                                        uint32_t width, uint32_t height);
+
+private:
+    /* A component is a run of samples within a row of a plane. */
+    struct Component {
+        int offset;
+        int step;
+        int hsub;
+    };
+
+    struct PlaneInfo {
+        int vsub;
+        /* Row size in bytes as a fraction of the image width. */
+        int rowNum;
+        int rowDen;
+        std::vector<Component> comps;
+    };
+
+    struct Tap {
+        int x0;
+        int x1;
+        int weight;
+    };
+
+    struct Plane {
+        size_t srcOffset;
+        size_t srcStride;
+        size_t srcRowBytes;
+        int srcHeight;
+
+        size_t dstOffset;
+        size_t dstStride;
+        int dstHeight;
+
+        bool boxV;
+        std::vector<Tap> rows;
+
+        struct Column {
+            Component comp;
+            bool boxH;
+            std::vector<Tap> taps;
+        };
+
+        std::vector<Column> columns;
+    };
+
+    v4l2_pix_format mSrc;
+    v4l2_pix_format mDst;
+
+    std::vector<Plane> mPlanes;
+
+    std::vector<uint8_t> mRow;
+    std::vector<uint32_t> mAcc;
+
+    static bool getPlaneInfo(uint32_t pixelFormat,
+                             std::vector<PlaneInfo>& planes);
+    static size_t getPlaneStride(const PlaneInfo& info, size_t stride);
+
+    static std::vector<Tap> getTaps(int srcSize, int dstSize, bool box);
+    static bool useBox(Filter filter, int srcSize, int dstSize);
+
+    void init(Filter filter);
+
+    void scalePlane(const Plane& plane, const uint8_t *src, uint8_t *dst);
+    void scaleRow(const Plane& plane, const uint8_t *row, uint8_t *dst);
+};
+
+typedef std::unique_ptr<Scaler> ScalerPtr;
+
+#endif /* SRC_SCALER_HPP_ */
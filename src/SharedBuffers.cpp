@@ -0,0 +1,159 @@
+// SPDX-License-Identifier: GPL-2.0
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2018 EPAM Systems Inc.
+ */
+
+#include <unistd.h>
+
+#include <xen/be/Exception.hpp>
+
+#include <xen/io/cameraif.h>
+
+#include "SharedBuffers.hpp"
+
+using XenBackend::Exception;
+
+SharedBuffers::SharedBuffers(domid_t domId, PublishCallback publish) :
+    mLog("SharedBuffers"),
+    mDomId(domId),
+    mPublish(publish),
+    mGnttab(nullptr),
+    mGntshr(nullptr)
+{
+    mGnttab = xengnttab_open(nullptr, 0);
+
+    if (!mGnttab)
+        throw Exception("Can't open gnttab device", errno);
+
+    mGntshr = xengntshr_open(nullptr, 0);
+
+    if (!mGntshr) {
+        int err = errno;
+
+        xengnttab_close(mGnttab);
+        throw Exception("Can't open gntshr device", err);
+    }
+}
+
+SharedBuffers::~SharedBuffers()
+{
+    for (auto& buffer : mBuffers)
+        release(buffer.second);
+
+    xengntshr_close(mGntshr);
+    xengnttab_close(mGnttab);
+}
+
+void SharedBuffers::add(int index, int fd, size_t size)
+{
+    size_t numRefs = (size + XC_PAGE_SIZE - 1) / XC_PAGE_SIZE;
+    std::vector<grant_ref_t> refs(numRefs);
+
+    /*
+     * Imports are released by fd, so keep one of our own: the camera
+     * closes its fds when its buffers are freed.
+     */
+    fd = dup(fd);
+
+    if (fd < 0)
+        throw Exception("Failed to dup buffer fd", errno);
+
+    /* Grants the very pages of the buffer, no copy is made. */
+    if (xengnttab_dmabuf_imp_to_refs(mGnttab, mDomId, fd, numRefs,
+                                     refs.data())) {
+        int err = errno;
+
+        close(fd);
+        throw Exception("Failed to grant buffer " + std::to_string(index),
+                        err);
+    }
+
+    Buffer buffer { fd, nullptr, {} };
+
+    const size_t grefsPerPage =
+        (XC_PAGE_SIZE - offsetof(xencamera_page_directory, gref)) /
+            sizeof(uint32_t);
+    size_t numPages = (numRefs + grefsPerPage - 1) / grefsPerPage;
+
+    buffer.directoryRefs.resize(numPages);
+    buffer.directory = xengntshr_share_pages(mGntshr, mDomId, numPages,
+                                             buffer.directoryRefs.data(), 0);
+
+    if (!buffer.directory) {
+        int err = errno;
+
+        xengnttab_dmabuf_imp_release(mGnttab, fd);
+        close(fd);
+        throw Exception("Failed to share directory of buffer " +
+                        std::to_string(index), err);
+    }
+
+    auto pages = static_cast<uint8_t *>(buffer.directory);
+
+    for (size_t i = 0; i < numPages; i++) {
+        auto pageDirectory = reinterpret_cast<xencamera_page_directory *>(
+            pages + i * XC_PAGE_SIZE);
+        size_t first = i * grefsPerPage;
+        size_t num = std::min(numRefs - first, grefsPerPage);
+
+        pageDirectory->gref_dir_next_page = i + 1 < numPages ?
+            buffer.directoryRefs[i + 1] : 0;
+
+        std::copy(refs.begin() + first, refs.begin() + first + num,
+                  pageDirectory->gref);
+    }
+
+    DLOG(mLog, DEBUG) << "Granted buffer " << index << " to dom " <<
+        std::to_string(mDomId) << ", " << numRefs << " pages, directory " <<
+        buffer.directoryRefs[0];
+
+    auto it = mBuffers.find(index);
+
+    if (it != mBuffers.end()) {
+        release(it->second);
+        mBuffers.erase(it);
+    }
+
+    mBuffers.emplace(index, std::move(buffer));
+}
+
+void SharedBuffers::publish()
+{
+    std::vector<grant_ref_t> directories;
+
+    for (auto& buffer : mBuffers) {
+        directories.resize(buffer.first, 0);
+        directories.push_back(buffer.second.directoryRefs[0]);
+    }
+
+    mPublish(directories);
+}
+
+void SharedBuffers::clear()
+{
+    for (auto& buffer : mBuffers)
+        release(buffer.second);
+
+    mBuffers.clear();
+
+    mPublish({});
+}
+
+void SharedBuffers::release(Buffer& buffer)
+{
+    /*
+     * The frontend should have unmapped the buffer by now: if it has not,
+     * the grants are only gone once it does.
+     */
+    xengntshr_unshare(mGntshr, buffer.directory,
+                      buffer.directoryRefs.size());
+
+    if (xengnttab_dmabuf_imp_release(mGnttab, buffer.fd))
+        LOG(mLog, ERROR) << "Failed to revoke grants of dom " <<
+            std::to_string(mDomId) << ": " << strerror(errno);
+
+    close(buffer.fd);
+}
@@ -0,0 +1,86 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2018 EPAM Systems Inc.
+ */
+#ifndef SRC_SHAREDBUFFERS_HPP_
+#define SRC_SHAREDBUFFERS_HPP_
+
+#include <functional>
+#include <memory>
+#include <map>
+#include <vector>
+
+#include <xen/be/Log.hpp>
+#include <xen/be/XenGnttab.hpp>
+
+extern "C" {
+#include <xengnttab.h>
+}
+
+/*
+ * The backend's capture buffers granted to one frontend, so it reads
+ * frames right from them instead of getting a copy in its own buffers.
+ * Every buffer is described to the frontend with a page directory in the
+ * format the frontend uses for its buffers, granted read-only, and the
+ * grant references of the directories are published to it.
+ * The data pages themselves are granted writable, as DMABUF exports have
+ * no read-only mode: the frontend can change frames other frontends of
+ * the camera get.
+ */
+class SharedBuffers
+{
+public:
+    /*
+     * Grant references of the buffers' directories, in index order; an
+     * index with no buffer has reference 0.
+     */
+    typedef std::function<void(const std::vector<grant_ref_t>&)>
+        PublishCallback;
+
+    SharedBuffers(domid_t domId, PublishCallback publish);
+    ~SharedBuffers();
+
+    /* Grant the DMABUF of a capture buffer. */
+    void add(int index, int fd, size_t size);
+    /* Publish the buffers added so far. */
+    void publish();
+    /* Revoke all the buffers and publish there are none. */
+    void clear();
+
+    bool has(int index) const {
+        return mBuffers.count(index);
+    }
+
+    size_t size() const {
+        return mBuffers.size();
+    }
+
+private:
+    XenBackend::Log mLog;
+
+    domid_t mDomId;
+    PublishCallback mPublish;
+
+    /* One handle per frontend, as imports are released by fd. */
+    xengnttab_handle *mGnttab;
+    xengntshr_handle *mGntshr;
+
+    struct Buffer {
+        /* Our own duplicate of the camera's fd. */
+        int fd;
+        void *directory;
+        std::vector<grant_ref_t> directoryRefs;
+    };
+
+    /* Ordered, so the directories are published in index order. */
+    std::map<int, Buffer> mBuffers;
+
+    void release(Buffer& buffer);
+};
+
+typedef std::unique_ptr<SharedBuffers> SharedBuffersPtr;
+
+#endif /* SRC_SHAREDBUFFERS_HPP_ */
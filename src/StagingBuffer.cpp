@@ -0,0 +1,64 @@
+// SPDX-License-Identifier: GPL-2.0
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2018 EPAM Systems Inc.
+ */
+
+#include <chrono>
+#include <cstring>
+
+#include <sys/mman.h>
+
+#include <xen/be/Exception.hpp>
+
+#include "StagingBuffer.hpp"
+
+using XenBackend::Exception;
+
+StagingBuffer::StagingBuffer(size_t size) :
+    mLog("StagingBuffer"),
+    mSize(size)
+{
+    mMapSize = (size + cHugePageSize - 1) & ~(cHugePageSize - 1);
+
+    void *data = mmap(nullptr, mMapSize, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+    /* No reserved huge pages: try transparent ones then. */
+    if (data == MAP_FAILED) {
+        data = mmap(nullptr, mMapSize, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (data == MAP_FAILED)
+            throw Exception("Failed to allocate staging buffer", errno);
+
+        madvise(data, mMapSize, MADV_HUGEPAGE);
+    }
+
+    mData = static_cast<uint8_t *>(data);
+
+    /* Fault all the pages in now, not on the first frame. */
+    memset(mData, 0, mMapSize);
+
+    DLOG(mLog, DEBUG) << "Allocated staging buffer of " << mMapSize <<
+        " bytes";
+}
+
+StagingBuffer::~StagingBuffer()
+{
+    munmap(mData, mMapSize);
+}
+
+double StagingBuffer::copyMeasure(void *dst, const void *src, size_t size)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    memcpy(dst, src, size);
+
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    return elapsed.count();
+}
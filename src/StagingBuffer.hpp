@@ -0,0 +1,50 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2018 EPAM Systems Inc.
+ */
+#ifndef SRC_STAGINGBUFFER_HPP_
+#define SRC_STAGINGBUFFER_HPP_
+
+#include <cstdint>
+#include <memory>
+
+#include <xen/be/Log.hpp>
+
+/*
+ * Cached, hugepage backed backend memory a frame can be copied into once,
+ * so it is read from there by every consumer instead of from a possibly
+ * uncached or write-combined V4L2 buffer.
+ */
+class StagingBuffer
+{
+public:
+    StagingBuffer(size_t size);
+    ~StagingBuffer();
+
+    uint8_t *get() const {
+        return mData;
+    }
+
+    size_t size() const {
+        return mSize;
+    }
+
+    /* Copy and return how long it took, in seconds. */
+    static double copyMeasure(void *dst, const void *src, size_t size);
+
+private:
+    XenBackend::Log mLog;
+
+    uint8_t *mData;
+    size_t mSize;
+    size_t mMapSize;
+
+    static const size_t cHugePageSize = 2 * 1024 * 1024;
+};
+
+typedef std::unique_ptr<StagingBuffer> StagingBufferPtr;
+
+#endif /* SRC_STAGINGBUFFER_HPP_ */
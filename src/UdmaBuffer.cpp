@@ -0,0 +1,151 @@
+// SPDX-License-Identifier: GPL-2.0
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2018 EPAM Systems Inc.
+ */
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <linux/dma-buf.h>
+#include <linux/udmabuf.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include <xen/be/Exception.hpp>
+
+#include "UdmaBuffer.hpp"
+
+using XenBackend::Exception;
+
+UdmaBuffer::UdmaBuffer(int udmabufFd, size_t size) :
+    mLog("UdmaBuffer"),
+    mMemFd(-1),
+    mFd(-1),
+    mData(nullptr),
+    mSize(0)
+{
+    try {
+        init(udmabufFd, size);
+    } catch (...) {
+        release();
+        throw;
+    }
+}
+
+UdmaBuffer::~UdmaBuffer()
+{
+    release();
+}
+
+void UdmaBuffer::init(int udmabufFd, size_t size)
+{
+    /*
+     * Frames of a few MiB fit huge pages well, if there are reserved ones
+     * and the kernel's udmabuf takes hugetlb memfds.
+     */
+    if (size >= cHugePageSize && create(udmabufFd, size, true))
+        return;
+
+    if (!create(udmabufFd, size, false))
+        throw Exception("Failed to create udmabuf", errno);
+}
+
+bool UdmaBuffer::create(int udmabufFd, size_t size, bool hugePages)
+{
+    size_t pageSize = hugePages ? cHugePageSize : getpagesize();
+    unsigned int flags = MFD_ALLOW_SEALING;
+
+    if (hugePages)
+        flags |= MFD_HUGETLB;
+
+    release();
+
+    mSize = (size + pageSize - 1) & ~(pageSize - 1);
+
+    mMemFd = memfd_create("camera_be", flags);
+
+    if (mMemFd < 0)
+        return false;
+
+    if (ftruncate(mMemFd, mSize) < 0)
+        return false;
+
+    /* udmabuf requires the memfd can't shrink under the device. */
+    if (fcntl(mMemFd, F_ADD_SEALS, F_SEAL_SHRINK) < 0)
+        return false;
+
+    udmabuf_create create {0};
+
+    create.memfd = mMemFd;
+    create.flags = UDMABUF_FLAGS_CLOEXEC;
+    create.offset = 0;
+    create.size = mSize;
+
+    mFd = ioctl(udmabufFd, UDMABUF_CREATE, &create);
+
+    if (mFd < 0)
+        return false;
+
+    void *data = mmap(nullptr, mSize, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      mMemFd, 0);
+
+    if (data == MAP_FAILED)
+        return false;
+
+    mData = static_cast<uint8_t *>(data);
+
+    DLOG(mLog, DEBUG) << "Allocated udmabuf of " << mSize << " bytes" <<
+        (hugePages ? " in huge pages" : "");
+
+    return true;
+}
+
+void UdmaBuffer::release()
+{
+    if (mData)
+        munmap(mData, mSize);
+
+    if (mFd >= 0)
+        close(mFd);
+
+    if (mMemFd >= 0)
+        close(mMemFd);
+
+    mData = nullptr;
+    mFd = -1;
+    mMemFd = -1;
+}
+
+void UdmaBuffer::readBegin()
+{
+    sync(DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ);
+}
+
+void UdmaBuffer::readEnd()
+{
+    sync(DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+}
+
+void UdmaBuffer::sync(uint64_t flags)
+{
+    dma_buf_sync sync {0};
+
+    sync.flags = flags;
+
+    int ret;
+
+    do {
+        ret = ioctl(mFd, DMA_BUF_IOCTL_SYNC, &sync);
+    } while (ret < 0 && (errno == EINTR || errno == EAGAIN));
+
+    /* Runs on the camera thread: a stale frame is better than none. */
+    if (ret < 0)
+        LOG(mLog, ERROR) << "Failed to sync udmabuf: " << strerror(errno);
+}
@@ -0,0 +1,67 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2018 EPAM Systems Inc.
+ */
+#ifndef SRC_UDMABUFFER_HPP_
+#define SRC_UDMABUFFER_HPP_
+
+#include <cstdint>
+#include <memory>
+
+#include <xen/be/Log.hpp>
+
+/*
+ * Cached memfd memory turned into a DMABUF with /dev/udmabuf, so a V4L2
+ * device can capture into it and the same fd can be passed on to
+ * conversion devices or other processes, while the backend reads it
+ * through an ordinary cached mapping.
+ */
+class UdmaBuffer
+{
+public:
+    /* udmabufFd is an open /dev/udmabuf. */
+    UdmaBuffer(int udmabufFd, size_t size);
+    ~UdmaBuffer();
+
+    uint8_t *get() const {
+        return mData;
+    }
+
+    size_t size() const {
+        return mSize;
+    }
+
+    int getFd() const {
+        return mFd;
+    }
+
+    /*
+     * Bracket CPU reads of what the device wrote: the mapping is cached
+     * and not every platform keeps it coherent with DMA.
+     */
+    void readBegin();
+    void readEnd();
+
+private:
+    XenBackend::Log mLog;
+
+    int mMemFd;
+    int mFd;
+    uint8_t *mData;
+    size_t mSize;
+
+    static const size_t cHugePageSize = 2 * 1024 * 1024;
+
+    void init(int udmabufFd, size_t size);
+    void release();
+
+    bool create(int udmabufFd, size_t size, bool hugePages);
+    void sync(uint64_t flags);
+};
+
+typedef std::unique_ptr<UdmaBuffer> UdmaBufferPtr;
+
+#endif /* SRC_UDMABUFFER_HPP_ */
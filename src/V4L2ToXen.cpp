@@ -5,28 +5,57 @@
 
 #include "V4L2ToXen.hpp"
 
-const V4L2ToXen::xen_to_v4l2 V4L2ToXen::XEN_TYPE_TO_V4L2_CID[] = {
+namespace {
+
+struct xen_ctrl {
+    const char *name;
+    int xen;
+    int v4l2;
+};
+
+/*
+ * Indexed by the Xen control type, so looking up a Xen control is a
+ * single array access: new protocol controls go in the order of their
+ * types, which is checked at compile time below.
+ */
+constexpr xen_ctrl XEN_CTRL[] = {
     {
+        .name = XENCAMERA_CTRL_BRIGHTNESS_STR,
         .xen = XENCAMERA_CTRL_BRIGHTNESS,
         .v4l2 = V4L2_CID_BRIGHTNESS,
     },
     {
+        .name = XENCAMERA_CTRL_CONTRAST_STR,
         .xen = XENCAMERA_CTRL_CONTRAST,
         .v4l2 = V4L2_CID_CONTRAST,
     },
     {
+        .name = XENCAMERA_CTRL_SATURATION_STR,
         .xen = XENCAMERA_CTRL_SATURATION,
         .v4l2 = V4L2_CID_SATURATION,
     },
     {
+        .name = XENCAMERA_CTRL_HUE_STR,
         .xen = XENCAMERA_CTRL_HUE,
         .v4l2 = V4L2_CID_HUE
     },
-    {
-        -1
-    }
 };
 
+constexpr int cNumCtrls = sizeof(XEN_CTRL) / sizeof(XEN_CTRL[0]);
+
+constexpr bool isCtrlTableIndexed(int i)
+{
+    return i == cNumCtrls || (XEN_CTRL[i].xen == i && isCtrlTableIndexed(i + 1));
+}
+
+static_assert(isCtrlTableIndexed(0),
+              "XEN_CTRL must be ordered by Xen control type");
+
+/* Frontends' assigned controls are kept as a 32-bit mask. */
+static_assert(cNumCtrls <= 32, "Too many Xen controls");
+
+}
+
 const V4L2ToXen::xen_to_v4l2 V4L2ToXen::XEN_COLORSPACE_TO_V4L2[] = {
     {
         .xen = XENCAMERA_COLORSPACE_DEFAULT,
@@ -147,34 +176,6 @@ const V4L2ToXen::xen_to_v4l2 V4L2ToXen::XEN_QUANTIZATION_TO_V4L2[] = {
     }
 };
 
-const V4L2ToXen::xen_ctrl V4L2ToXen::XEN_CTRL[] = {
-    {
-        .name = XENCAMERA_CTRL_BRIGHTNESS_STR,
-        .xen = XENCAMERA_CTRL_BRIGHTNESS,
-        .v4l2 = V4L2_CID_BRIGHTNESS,
-    },
-    {
-        .name = XENCAMERA_CTRL_CONTRAST_STR,
-        .xen = XENCAMERA_CTRL_CONTRAST,
-        .v4l2 = V4L2_CID_CONTRAST,
-    },
-    {
-        .name = XENCAMERA_CTRL_SATURATION_STR,
-        .xen = XENCAMERA_CTRL_SATURATION,
-        .v4l2 = V4L2_CID_SATURATION,
-    },
-    {
-        .name = XENCAMERA_CTRL_HUE_STR,
-        .xen = XENCAMERA_CTRL_HUE,
-        .v4l2 = V4L2_CID_HUE
-    },
-    {
-        .name = nullptr,
-        .xen = -1,
-        .v4l2 = -1
-    }
-};
-
 
 int V4L2ToXen::toV4L2(int xen, const V4L2ToXen::xen_to_v4l2 *table)
 {
@@ -196,9 +197,17 @@ int V4L2ToXen::toXen(int v4l2, const V4L2ToXen::xen_to_v4l2 *table)
     return -EINVAL;
 }
 
+int V4L2ToXen::ctrlFindXen(int v4l2)
+{
+    for (int i = 0; i < cNumCtrls; i++)
+        if (XEN_CTRL[i].v4l2 == v4l2)
+            return i;
+    return -1;
+}
+
 int V4L2ToXen::ctrlToXen(int v4l2)
 {
-    int ret = toXen(v4l2, XEN_TYPE_TO_V4L2_CID);
+    int ret = ctrlFindXen(v4l2);
 
     if (ret < 0)
         throw XenBackend::Exception("Unsupported V4L2 CID " +
@@ -208,12 +217,11 @@ int V4L2ToXen::ctrlToXen(int v4l2)
 
 int V4L2ToXen::ctrlToV4L2(int xen)
 {
-    int ret = toV4L2(xen, XEN_TYPE_TO_V4L2_CID);
-
-    if (ret < 0)
+    if (xen < 0 || xen >= cNumCtrls)
         throw XenBackend::Exception("Unsupported Xen CID " +
                                     std::to_string(xen), EINVAL);
-    return ret;}
+    return XEN_CTRL[xen].v4l2;
+}
 
 int V4L2ToXen::colorspaceToXen(int v4l2)
 {
@@ -322,26 +330,25 @@ int V4L2ToXen::ctrlFlagsToV4L2(int xen)
     return flags;
 }
 
-const std::string V4L2ToXen::ctrlGetNameXen(int xen)
+const char *V4L2ToXen::ctrlGetNameXen(int xen)
 {
-    int i;
-
-    for (i = 0; XEN_CTRL[i].xen != -1; i++)
-        if (XEN_CTRL[i].xen == xen)
-            return XEN_CTRL[i].name;
-
-    throw XenBackend::Exception("Unsupported Xen control type " +
-                                std::to_string(xen), EINVAL);
+    if (xen < 0 || xen >= cNumCtrls)
+        throw XenBackend::Exception("Unsupported Xen control type " +
+                                    std::to_string(xen), EINVAL);
+    return XEN_CTRL[xen].name;
 }
 
 int V4L2ToXen::ctrlGetTypeXen(const std::string& name)
 {
-    int i;
-
-    for (i = 0; XEN_CTRL[i].xen != -1; i++)
-        if (XEN_CTRL[i].name == name)
-            return XEN_CTRL[i].xen;
+    for (int i = 0; i < cNumCtrls; i++)
+        if (name == XEN_CTRL[i].name)
+            return i;
 
     throw XenBackend::Exception("Unsupported Xen control name " + name, EINVAL);
 }
 
+int V4L2ToXen::ctrlGetNumXen()
+{
+    return cNumCtrls;
+}
+
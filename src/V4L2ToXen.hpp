@@ -15,10 +15,14 @@ class V4L2ToXen
 public:
 
     static int ctrlToXen(int v4l2);
+    /* Same as above, but -1 for controls the protocol doesn't know. */
+    static int ctrlFindXen(int v4l2);
     static int ctrlToV4L2(int xen);
 
-    static const std::string ctrlGetNameXen(int xen);
+    static const char *ctrlGetNameXen(int xen);
     static int ctrlGetTypeXen(const std::string& name);
+    /* Xen control types are numbered from 0 up to this. */
+    static int ctrlGetNumXen();
 
     static int ctrlFlagsToXen(int v4l2);
     static int ctrlFlagsToV4L2(int xen);
@@ -41,20 +45,11 @@ private:
         int v4l2;
     };
 
-    static const xen_to_v4l2 XEN_TYPE_TO_V4L2_CID[];
     static const xen_to_v4l2 XEN_COLORSPACE_TO_V4L2[];
     static const xen_to_v4l2 XEN_XFER_FUNC_TO_V4L2[];
     static const xen_to_v4l2 XEN_YCBCR_ENC_TO_V4L2[];
     static const xen_to_v4l2 XEN_QUANTIZATION_TO_V4L2[];
 
-    struct xen_ctrl {
-        const char *name;
-        int xen;
-        int v4l2;
-    };
-
-    static const xen_ctrl XEN_CTRL[];
-
     static int toV4L2(int xen, const xen_to_v4l2 *table);
     static int toXen(int v4l2, const xen_to_v4l2 *table);
 };
@@ -0,0 +1,85 @@
+// SPDX-License-Identifier: GPL-2.0
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2018 EPAM Systems Inc.
+ */
+
+#include <algorithm>
+
+#include "WorkQueue.hpp"
+
+WorkQueue::WorkQueue(const std::string& name) :
+    mLog(name),
+    mTerminate(false)
+{
+    mThread = std::thread(&WorkQueue::run, this);
+}
+
+WorkQueue::~WorkQueue()
+{
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+
+        mTerminate = true;
+    }
+
+    mCondVar.notify_all();
+
+    if (mThread.joinable())
+        mThread.join();
+}
+
+void WorkQueue::post(Work work)
+{
+    postAt(work, std::chrono::steady_clock::now());
+}
+
+void WorkQueue::postAt(Work work, TimePoint when)
+{
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+
+        auto it = std::upper_bound(mWork.begin(), mWork.end(), when,
+            [](const TimePoint& t, const std::pair<TimePoint, Work>& item) {
+                return t < item.first;
+            });
+
+        mWork.insert(it, std::make_pair(when, work));
+    }
+
+    mCondVar.notify_one();
+}
+
+void WorkQueue::run()
+{
+    std::unique_lock<std::mutex> lock(mLock);
+
+    while (true) {
+        mCondVar.wait(lock, [this] { return mTerminate || !mWork.empty(); });
+
+        if (mTerminate)
+            break;
+
+        /* Woken up either by earlier work or by termination. */
+        if (mWork.front().first > std::chrono::steady_clock::now()) {
+            mCondVar.wait_until(lock, mWork.front().first);
+            continue;
+        }
+
+        Work work = mWork.front().second;
+
+        mWork.pop_front();
+
+        lock.unlock();
+
+        try {
+            work();
+        } catch (const std::exception& e) {
+            LOG(mLog, ERROR) << e.what();
+        }
+
+        lock.lock();
+    }
+}
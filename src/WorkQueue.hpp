@@ -0,0 +1,54 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2018 EPAM Systems Inc.
+ */
+#ifndef SRC_WORKQUEUE_HPP_
+#define SRC_WORKQUEUE_HPP_
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include <xen/be/Log.hpp>
+
+/*
+ * A worker thread running posted work items one by one, so slow work is
+ * taken off ring and camera threads.
+ */
+class WorkQueue
+{
+public:
+    typedef std::function<void()> Work;
+    typedef std::chrono::steady_clock::time_point TimePoint;
+
+    WorkQueue(const std::string& name);
+    ~WorkQueue();
+
+    void post(Work work);
+    /* Run the work not before the given time. */
+    void postAt(Work work, TimePoint when);
+
+private:
+    XenBackend::Log mLog;
+
+    std::mutex mLock;
+    std::condition_variable mCondVar;
+    /* Sorted by the time the work is due. */
+    std::deque<std::pair<TimePoint, Work>> mWork;
+    bool mTerminate;
+
+    std::thread mThread;
+
+    void run();
+};
+
+typedef std::unique_ptr<WorkQueue> WorkQueuePtr;
+
+#endif /* SRC_WORKQUEUE_HPP_ */
@@ -8,10 +8,16 @@
 
 #include <fstream>
 
+#include <cctype>
+#include <cerrno>
 #include <csignal>
+#include <cstdlib>
+#include <limits>
 #include <execinfo.h>
 #include <getopt.h>
 
+#include <linux/videodev2.h>
+
 #include <xen/be/Log.hpp>
 #include <xen/be/Utils.hpp>
 #include <xen/io/cameraif.h>
@@ -29,6 +35,8 @@ using XenBackend::Utils;
 
 string gLogFileName;
 
+Config gConfig;
+
 int gRetStatus = EXIT_SUCCESS;
 
 /*******************************************************************************
@@ -75,11 +83,84 @@ void waitSignals()
         gRetStatus = EXIT_FAILURE;
 }
 
+/* Parses a whole decimal number which fits into value. */
+template<typename T>
+bool parseNumber(const char *arg, T& value)
+{
+    char *end;
+
+    if (!isdigit(static_cast<unsigned char>(*arg)))
+        return false;
+
+    errno = 0;
+
+    unsigned long long num = strtoull(arg, &end, 10);
+
+    if (errno || *end || num > std::numeric_limits<T>::max())
+        return false;
+
+    value = static_cast<T>(num);
+
+    return true;
+}
+
+/* Parses a size in MiB into bytes. */
+bool parseMiB(const char *arg, size_t& bytes)
+{
+    size_t mib;
+
+    if (!parseNumber(arg, mib) ||
+        mib > std::numeric_limits<size_t>::max() / (1024 * 1024))
+        return false;
+
+    bytes = mib * 1024 * 1024;
+
+    return true;
+}
+
+/* Parses [<camera>=]<num>|auto[,<max>] */
+bool parseBufferDepth(const string& arg)
+{
+    auto pos = arg.rfind('=');
+    string value = pos == string::npos ? arg : arg.substr(pos + 1);
+    auto comma = value.find(',');
+    string num = value.substr(0, comma);
+    Config::BufferDepth depth = gConfig.bufferDepth;
+
+    if (num == "auto") {
+        depth.adaptive = true;
+    } else {
+        if (!parseNumber(num.c_str(), depth.numBuffers) || !depth.numBuffers)
+            return false;
+
+        depth.adaptive = comma != string::npos;
+    }
+
+    if (comma != string::npos &&
+        !parseNumber(value.c_str() + comma + 1, depth.maxBuffers))
+        return false;
+
+    /* V4L2 doesn't take more. */
+    if (depth.numBuffers > VIDEO_MAX_FRAME ||
+        depth.maxBuffers > VIDEO_MAX_FRAME)
+        return false;
+
+    if (depth.maxBuffers < depth.numBuffers)
+        depth.maxBuffers = depth.numBuffers;
+
+    if (pos == string::npos)
+        gConfig.bufferDepth = depth;
+    else
+        gConfig.cameraBufferDepths[arg.substr(0, pos)] = depth;
+
+    return true;
+}
+
 bool commandLineOptions(int argc, char *argv[])
 {
     int opt = -1;
 
-    while((opt = getopt(argc, argv, "v:l:fh?")) != -1) {
+    while((opt = getopt(argc, argv, "v:l:m:s:H:ML:k:b:i:w:cg:G:CDSTfh?")) != -1) {
         switch(opt) {
         case 'v':
             if (!Log::setLogMask(string(optarg)))
@@ -90,6 +171,98 @@ bool commandLineOptions(int argc, char *argv[])
             gLogFileName = optarg;
             break;
 
+        case 'm':
+            gConfig.m2mDevice = optarg;
+            break;
+
+        case 's':
+            if (string(optarg) == "auto")
+                gConfig.staging = Config::Staging::AUTO;
+            else if (string(optarg) == "on")
+                gConfig.staging = Config::Staging::ALWAYS;
+            else if (string(optarg) == "off")
+                gConfig.staging = Config::Staging::NEVER;
+            else
+                return false;
+            break;
+
+        case 'H':
+            if (!parseMiB(optarg, gConfig.historyMaxBytes))
+                return false;
+            break;
+
+        case 'M':
+            gConfig.mailbox = true;
+            break;
+
+        case 'L':
+            if (!parseNumber(optarg, gConfig.latencyBudgetMs))
+                return false;
+            break;
+
+        case 'k':
+            if (!parseNumber(optarg, gConfig.lingerMs))
+                return false;
+            break;
+
+        case 'b':
+            if (!parseBufferDepth(optarg))
+                return false;
+            break;
+
+        case 'i':
+            if (!parseNumber(optarg, gConfig.idleFrames))
+                return false;
+            break;
+
+        case 'w':
+            if (!parseNumber(optarg, gConfig.busBandwidthMbps))
+                return false;
+            break;
+
+        case 'c':
+            gConfig.softControls = true;
+            break;
+
+        case 'g':
+            if (!parseMiB(optarg, gConfig.grantCacheMaxBytes))
+                return false;
+            break;
+
+        case 'G':
+        {
+            string arg(optarg);
+            auto comma = arg.find(',');
+
+            if (!parseMiB(arg.substr(0, comma).c_str(),
+                          gConfig.mapBudget.maxBytes))
+                return false;
+
+            if (comma != string::npos &&
+                !parseNumber(arg.c_str() + comma + 1,
+                             gConfig.mapBudget.idleMs))
+                return false;
+
+            gConfig.mapBudget.enabled = true;
+            break;
+        }
+
+        case 'C':
+            gConfig.grantCopy = true;
+            break;
+
+        case 'D':
+            gConfig.udmabuf = true;
+            break;
+
+        case 'S':
+            gConfig.sharedBuffers = true;
+            break;
+
+        case 'T':
+            gConfig.sharedBuffersTrusted = true;
+            break;
+
         case 'f':
             Log::setShowFileAndLine(true);
             break;
@@ -121,7 +294,7 @@ int main(int argc, char *argv[])
                 Log::setStreamBuffer(logFile.rdbuf());
             }
 
-            Backend backend(XENCAMERA_DRIVER_NAME);
+            Backend backend(XENCAMERA_DRIVER_NAME, gConfig);
 
             backend.start();
 
@@ -130,13 +303,54 @@ int main(int argc, char *argv[])
             logFile.close();
         } else {
             cout << "Usage: " << argv[0]
-                << " [-l <file>] [-v <level>]"
+                << " [-l <file>] [-v <level>] [-m <device>]"
+                << " [-s <auto|on|off>] [-H <MiB>] [-M]"
+                << " [-L <ms>] [-k <ms>] [-b [<camera>=]<num>|auto[,<max>]]"
+                << " [-i <frames>] [-w <Mbit/s>] [-c] [-g <MiB>]"
+                << " [-G <MiB>[,<ms>]] [-C] [-D] [-S] [-T]"
                 << endl;
             cout << "\t-l -- log file" << endl;
             cout << "\t-v -- verbose level in format: "
                 << "<module>:<level>;<module:<level>" << endl;
             cout << "\t      use * for mask selection:"
                 << " *:Debug,Mod*:Info" << endl;
+            cout << "\t-m -- V4L2 mem2mem device to offload scaling and"
+                << " format conversion to, e.g. /dev/video2" << endl;
+            cout << "\t-s -- copy frames read by several frontends into"
+                << " a cached buffer first, default: auto" << endl;
+            cout << "\t-H -- keep the latest frame for frontends joining"
+                << " a running stream in this many MiB, which must fit two"
+                << " frames, default: 0 (off)" << endl;
+            cout << "\t-M -- keep the latest frame a frontend had no buffer"
+                << " for and deliver it once a buffer is queued" << endl;
+            cout << "\t-L -- drop frames older than this many ms when"
+                << " copying to a frontend, default: no limit" << endl;
+            cout << "\t-k -- keep the camera streaming for this many ms"
+                << " after the last frontend stops, default: 0" << endl;
+            cout << "\t-b -- number of camera buffers, with a maximum or"
+                << " auto the number adapts to the load, default: 4" << endl;
+            cout << "\t      can be given per camera unique id, e.g."
+                << " -b auto,8 -b /dev/video0=6" << endl;
+            cout << "\t-i -- pause the camera after this many frames no"
+                << " frontend had a buffer for, default: 0 (never)" << endl;
+            cout << "\t-w -- bandwidth of the camera bus usable for video,"
+                << " default: detect for USB" << endl;
+            cout << "\t-c -- apply image controls in software, separately"
+                << " for every frontend" << endl;
+            cout << "\t-g -- memory of destroyed frontend buffers kept"
+                << " mapped for reuse, per frontend, default: 0" << endl;
+            cout << "\t-G -- map frontend buffers on first use, within"
+                << " this many MiB for all frontends (0 for no limit)" << endl;
+            cout << "\t      and unmap them when not used for this many"
+                << " ms, default: off" << endl;
+            cout << "\t-C -- copy frames into frontend buffers with grant"
+                << " copies instead of mapping the buffers" << endl;
+            cout << "\t-D -- capture into cached udmabuf memory instead of"
+                << " driver buffers" << endl;
+            cout << "\t-S -- let a camera's only frontend read frames from"
+                << " its buffers granted to it instead of copying" << endl;
+            cout << "\t-T -- frontends trust each other: with -S, all"
+                << " frontends of a camera share its buffers" << endl;
 
             gRetStatus = EXIT_FAILURE;
         }
@@ -0,0 +1,415 @@
+// SPDX-License-Identifier: GPL-2.0
+
+/*
+ * Xen para-virtualized camera backend
+ *
+ * Copyright (C) 2018 EPAM Systems Inc.
+ */
+
+/*
+ * Compares the two ways frames reach frontend buffers: mapping the
+ * granted pages, copying and unmapping them, against grant copy. Then
+ * the same for reading the page directory of a buffer on BUF_CREATE.
+ * The pages are granted by this very domain to the domain given, which
+ * must be this one for the maps to succeed, i.e. run it in Dom0 with -d 0.
+ * With -l no Xen is needed: the local stand-in is measured instead,
+ * which is the cost of the copy alone, plus a fixed cost for every grant
+ * operation when reading directories.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#include <getopt.h>
+#include <sys/mman.h>
+
+#include <xen/xen.h>
+
+#include <xen/be/Exception.hpp>
+#include <xen/be/Log.hpp>
+#include <xen/be/XenGnttab.hpp>
+
+#include <xen/io/cameraif.h>
+
+#include "GrantCopier.hpp"
+
+using std::cout;
+using std::endl;
+using std::vector;
+
+namespace {
+
+struct FrameSize {
+    const char *name;
+    size_t size;
+};
+
+const FrameSize cFrameSizes[] = {
+    { "640x480 YUYV", 640 * 480 * 2 },
+    { "1280x720 YUYV", 1280 * 720 * 2 },
+    { "1920x1080 YUYV", 1920 * 1080 * 2 },
+    { "3840x2160 NV12", 3840 * 2160 * 3 / 2 },
+};
+
+domid_t gDomId = 0;
+int gIterations = 100;
+bool gLocal = false;
+/* What the local stand-in charges per map, unmap or copy hypercall. */
+unsigned long gOpCostUs = 20;
+
+/* Pages granted to gDomId and their refs. */
+struct Pages {
+    virtual ~Pages() {}
+
+    uint8_t *data;
+    vector<grant_ref_t> refs;
+};
+
+class SharedPages : public Pages
+{
+public:
+    SharedPages(size_t numPages)
+    {
+        mGntshr = xengntshr_open(nullptr, 0);
+
+        if (!mGntshr)
+            throw XenBackend::Exception("Can't open gntshr device", errno);
+
+        refs.resize(numPages);
+
+        data = static_cast<uint8_t *>(xengntshr_share_pages(
+            mGntshr, gDomId, numPages, refs.data(), 1));
+
+        if (!data) {
+            int err = errno;
+
+            xengntshr_close(mGntshr);
+            throw XenBackend::Exception("Can't share pages", err);
+        }
+    }
+
+    ~SharedPages()
+    {
+        xengntshr_unshare(mGntshr, data, refs.size());
+        xengntshr_close(mGntshr);
+    }
+
+private:
+    xengntshr_handle *mGntshr;
+};
+
+class LocalPages : public Pages
+{
+public:
+    LocalPages(size_t numPages) :
+        mMemory(numPages * XC_PAGE_SIZE)
+    {
+        data = mMemory.data();
+
+        for (size_t i = 0; i < numPages; i++)
+            refs.push_back(i + 1);
+    }
+
+    uint8_t *getPage(grant_ref_t ref)
+    {
+        if (!ref || ref > refs.size())
+            return nullptr;
+
+        return data + (ref - 1) * XC_PAGE_SIZE;
+    }
+
+private:
+    vector<uint8_t> mMemory;
+};
+
+template<typename F>
+double measureUs(F run)
+{
+    /* The first run faults the pages in. */
+    run();
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (int i = 0; i < gIterations; i++)
+        run();
+
+    std::chrono::duration<double, std::micro> elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    return elapsed.count() / gIterations;
+}
+
+void benchmark(const FrameSize& frameSize)
+{
+    size_t numPages = (frameSize.size + XC_PAGE_SIZE - 1) / XC_PAGE_SIZE;
+    vector<uint8_t> frame(frameSize.size);
+
+    for (size_t i = 0; i < frame.size(); i++)
+        frame[i] = i * 7;
+
+    std::unique_ptr<Pages> pages;
+    GrantCopierPtr copier;
+    double mapUs;
+
+    if (gLocal) {
+        auto local = new LocalPages(numPages);
+
+        pages.reset(local);
+        copier.reset(new LocalGrantCopier(
+            [local](domid_t, grant_ref_t ref) {
+                return local->getPage(ref);
+            }));
+
+        /* Nothing to map: the frontend's pages are ours. */
+        mapUs = measureUs([&]() {
+            memcpy(local->data, frame.data(), frame.size());
+        });
+    } else {
+        pages.reset(new SharedPages(numPages));
+        copier.reset(new XenGrantCopier());
+
+        mapUs = measureUs([&]() {
+            XenBackend::XenGnttabBuffer buffer(gDomId, pages->refs.data(),
+                                               pages->refs.size(),
+                                               PROT_READ | PROT_WRITE);
+
+            memcpy(buffer.get(), frame.data(), frame.size());
+        });
+    }
+
+    memset(pages->data, 0, frame.size());
+
+    double copyUs = measureUs([&]() {
+        copier->copy(gDomId, pages->refs, 0, frame.data(), frame.size());
+    });
+
+    if (memcmp(pages->data, frame.data(), frame.size()))
+        throw XenBackend::Exception("Frame is corrupted by grant copy", EIO);
+
+    cout << std::left << std::setw(16) << frameSize.name << std::right <<
+        std::fixed << std::setprecision(1) <<
+        std::setw(10) << frameSize.size / 1024 << " KiB" <<
+        std::setw(14) << mapUs << " us" <<
+        std::setw(14) << copyUs << " us" << endl;
+}
+
+/* Stand in for a hypercall: spin for what it would cost. */
+void chargeOp()
+{
+    auto end = std::chrono::steady_clock::now() +
+        std::chrono::microseconds(gOpCostUs);
+
+    while (std::chrono::steady_clock::now() < end)
+        ;
+}
+
+const size_t cDirectoryHeaderSize = offsetof(xencamera_page_directory, gref);
+const size_t cRefsPerDirectory = (XC_PAGE_SIZE - cDirectoryHeaderSize) /
+    sizeof(grant_ref_t);
+
+/* Lay the refs out in the directory pages the way a frontend does. */
+void directoryFill(Pages& pages, size_t numDirectories)
+{
+    size_t numRefs = pages.refs.size() - numDirectories;
+
+    for (size_t i = 0; i < numDirectories; i++) {
+        uint8_t *page = pages.data + i * XC_PAGE_SIZE;
+        size_t first = i * cRefsPerDirectory;
+        size_t num = std::min(numRefs - first, cRefsPerDirectory);
+        grant_ref_t next = i + 1 < numDirectories ? pages.refs[i + 1] : 0;
+
+        memcpy(page + offsetof(xencamera_page_directory, gref_dir_next_page),
+               &next, sizeof(next));
+        memcpy(page + cDirectoryHeaderSize,
+               &pages.refs[numDirectories + first],
+               num * sizeof(grant_ref_t));
+    }
+}
+
+/* How directories were read before: every page mapped and unmapped. */
+void directoryMap(Pages& pages, size_t numRefs, vector<grant_ref_t>& refs,
+                  LocalPages *local)
+{
+    grant_ref_t ref = pages.refs[0];
+
+    refs.clear();
+
+    while (ref != 0) {
+        std::unique_ptr<XenBackend::XenGnttabBuffer> buffer;
+        uint8_t *page;
+
+        if (local) {
+            chargeOp();
+            page = local->getPage(ref);
+        } else {
+            buffer.reset(new XenBackend::XenGnttabBuffer(gDomId, ref,
+                                                         PROT_READ));
+            page = static_cast<uint8_t *>(buffer->get());
+        }
+
+        auto directory = reinterpret_cast<xencamera_page_directory *>(page);
+        size_t num = std::min(numRefs, cRefsPerDirectory);
+
+        refs.insert(refs.end(), directory->gref, directory->gref + num);
+
+        numRefs -= num;
+        ref = directory->gref_dir_next_page;
+
+        if (local)
+            chargeOp();
+    }
+}
+
+void benchmarkDirectory(const FrameSize& frameSize)
+{
+    size_t numRefs = (frameSize.size + XC_PAGE_SIZE - 1) / XC_PAGE_SIZE;
+    size_t numDirectories = (numRefs + cRefsPerDirectory - 1) /
+        cRefsPerDirectory;
+
+    std::unique_ptr<Pages> pages;
+    GrantCopierPtr reader;
+    LocalPages *local = nullptr;
+
+    if (gLocal) {
+        local = new LocalPages(numDirectories + numRefs);
+
+        pages.reset(local);
+        reader.reset(new LocalGrantCopier(
+            [local](domid_t, grant_ref_t ref) {
+                chargeOp();
+
+                return local->getPage(ref);
+            }));
+    } else {
+        pages.reset(new SharedPages(numDirectories + numRefs));
+        reader.reset(new XenGrantCopier());
+    }
+
+    directoryFill(*pages, numDirectories);
+
+    vector<grant_ref_t> expected(pages->refs.begin() + numDirectories,
+                                 pages->refs.end());
+    vector<grant_ref_t> refs;
+
+    double mapUs = measureUs([&]() {
+        directoryMap(*pages, numRefs, refs, local);
+    });
+
+    if (refs != expected)
+        throw XenBackend::Exception("Directory is misread by map", EIO);
+
+    double copyUs = measureUs([&]() {
+        reader->readDirectory(gDomId, pages->refs[0], numRefs, refs);
+    });
+
+    if (refs != expected)
+        throw XenBackend::Exception("Directory is misread by grant copy",
+                                    EIO);
+
+    cout << std::left << std::setw(16) << frameSize.name << std::right <<
+        std::setw(14) << numDirectories <<
+        std::fixed << std::setprecision(1) <<
+        std::setw(14) << mapUs << " us" <<
+        std::setw(14) << copyUs << " us" << endl;
+}
+
+bool parseNumber(const char *arg, unsigned long max, unsigned long& value)
+{
+    char *end;
+
+    errno = 0;
+    value = strtoul(arg, &end, 10);
+
+    return !errno && end != arg && !*end && *arg != '-' && value <= max;
+}
+
+bool commandLineOptions(int argc, char *argv[])
+{
+    unsigned long value;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:n:lc:h?")) != -1) {
+        switch (opt) {
+        case 'd':
+            if (!parseNumber(optarg, DOMID_FIRST_RESERVED - 1, value))
+                return false;
+
+            gDomId = value;
+            break;
+
+        case 'n':
+            if (!parseNumber(optarg, 1000000, value) || !value)
+                return false;
+
+            gIterations = value;
+            break;
+
+        case 'l':
+            gLocal = true;
+            break;
+
+        case 'c':
+            if (!parseNumber(optarg, 1000000, value))
+                return false;
+
+            gOpCostUs = value;
+            break;
+
+        default:
+            return false;
+        }
+    }
+
+    return true;
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+    if (!commandLineOptions(argc, argv)) {
+        cout << "Usage: " << argv[0] << " [-d <domid>] [-n <frames>] [-l]"
+            << " [-c <us>]" << endl;
+        cout << "\t-d -- domain the pages are granted to, must be this"
+            << " one, default: 0" << endl;
+        cout << "\t-n -- frames to deliver per size, default: 100" << endl;
+        cout << "\t-l -- measure the local stand-in, no Xen needed" << endl;
+        cout << "\t-c -- cost of a grant operation for the local stand-in,"
+            << " default: 20 us" << endl;
+
+        return EXIT_FAILURE;
+    }
+
+    XenBackend::Log::setLogMask("*:Error");
+
+    try {
+        cout << std::left << std::setw(16) << "frame" << std::right <<
+            std::setw(14) << "size" <<
+            std::setw(17) << (gLocal ? "memcpy" : "map+memcpy") <<
+            std::setw(17) << "grant copy" << endl;
+
+        for (auto const& frameSize : cFrameSizes)
+            benchmark(frameSize);
+
+        cout << endl << std::left << std::setw(16) << "directory of" <<
+            std::right << std::setw(14) << "pages" <<
+            std::setw(17) << "map" <<
+            std::setw(17) << "grant copy" << endl;
+
+        for (auto const& frameSize : cFrameSizes)
+            benchmarkDirectory(frameSize);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << endl;
+
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}